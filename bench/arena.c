@@ -0,0 +1,154 @@
+/*
+	heap allocations and time per operation of the client request state
+
+	make bench
+	./bench/arena [threads] [ops]
+
+	a getattr/read/write mix (50/30/20) builds the state of every operation (struct spockfs_http_rr,
+	url and request headers) the way the client did before the per-thread arena (calloc()/malloc()
+	and curl_slist_append()) and with the arena (spockfs_arena_*, spockfs_prepare_url() and
+	spockfs_add_header_*()). Heap allocations are counted by interposing malloc() (glibc only),
+	so the ones made by libcurl for its lists are counted too.
+*/
+#define main spockfs_main
+#include "../spockfs.c"
+#undef main
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t bench_allocs;
+
+void *malloc(size_t len) {
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(len);
+}
+
+void *calloc(size_t n, size_t len) {
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, len);
+}
+
+void *realloc(void *ptr, size_t len) {
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, len);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+static const char *bench_base = "http://127.0.0.1:8080/spockfs";
+static const char *bench_path = "/home/spock/projects/enterprise/src/warp/core_controller.c";
+static uint64_t bench_ops = 1000000;
+
+// the pre-arena client: the url was sized for the worst case and encoded with snprintf()
+static char *bench_old_url(const char *base, size_t base_len, const char *path) {
+	size_t path_len = strlen(path);
+	size_t url_len = base_len + (path_len * 3) + 2;
+	char *url = malloc(url_len);
+	if (!url) return NULL;
+	memcpy(url, base, base_len);
+	char *ptr = url + base_len;
+	size_t i;
+	for(i=0;i<path_len;i++) {
+		char c = path[i];
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+			*ptr++ = c;
+		}
+		else {
+			snprintf(ptr, url_len - (ptr - url), "%%%02X", (uint8_t) c);
+			ptr += 3;
+		}
+	}
+	*ptr = 0;
+	return url;
+}
+
+static void bench_old_op(uint64_t i) {
+	struct spockfs_http_rr *rr = calloc(1, sizeof(struct spockfs_http_rr));
+	char *url = bench_old_url(bench_base, strlen(bench_base), bench_path);
+	struct curl_slist *headers = NULL;
+	char header[128];
+	switch(i % 10) {
+		// read
+		case 5: case 6: case 7:
+			snprintf(header, sizeof(header), "Range: bytes=%llu-%llu", (unsigned long long) i * 4096, (unsigned long long) i * 4096 + 131071);
+			headers = curl_slist_append(headers, header);
+			break;
+		// write
+		case 8: case 9:
+			snprintf(header, sizeof(header), "Content-Range: bytes=%llu-%llu", (unsigned long long) i * 4096, (unsigned long long) i * 4096 + 131071);
+			headers = curl_slist_append(headers, header);
+			headers = curl_slist_append(headers, "Expect:");
+			break;
+		// getattr
+		default:
+			break;
+	}
+	curl_slist_free_all(headers);
+	free(url);
+	free(rr);
+}
+
+static void bench_arena_op(uint64_t i) {
+	size_t mark = spockfs_arena_mark();
+	struct spockfs_http_rr *rr = spockfs_arena_calloc(sizeof(struct spockfs_http_rr));
+	char *url = spockfs_prepare_url(bench_base, strlen(bench_base), bench_path);
+	struct curl_slist *headers = NULL;
+	switch(i % 10) {
+		case 5: case 6: case 7:
+			headers = spockfs_add_header_range(headers, "Range", i * 4096, i * 4096 + 131071);
+			break;
+		case 8: case 9:
+			headers = spockfs_add_header_range(headers, "Content-Range", i * 4096, i * 4096 + 131071);
+			headers = spockfs_headers_append(headers, "Expect", "", 0);
+			break;
+		default:
+			break;
+	}
+	spockfs_headers_free(headers);
+	spockfs_arena_release(url);
+	spockfs_arena_release(rr);
+	spockfs_arena_rewind(mark);
+}
+
+static void *bench_thread(void *arg) {
+	void (*op)(uint64_t) = arg;
+	uint64_t i;
+	for(i=0;i<bench_ops;i++) op(i);
+	return NULL;
+}
+
+static void bench_run(const char *label, void (*op)(uint64_t), int threads) {
+	pthread_t *tids = __libc_calloc(threads, sizeof(pthread_t));
+	struct timespec start, end;
+	int i;
+	uint64_t allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0;i<threads;i++) pthread_create(&tids[i], NULL, bench_thread, op);
+	for(i=0;i<threads;i++) pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs;
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	double ops = (double) bench_ops * threads;
+	printf("%-8s %2d threads: %7.1f ns/op %6.2f heap allocations/op\n", label, threads, ns / ops, allocs / ops);
+	__libc_free(tids);
+}
+
+int main(int argc, char *argv[]) {
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	if (argc > 2) bench_ops = strtoull(argv[2], NULL, 10);
+	spockfs_url_init();
+	pthread_key_create(&spockfs_arena_key, spockfs_arena_free);
+	bench_run("heap", bench_old_op, 1);
+	bench_run("arena", bench_arena_op, 1);
+	if (threads > 1) {
+		bench_run("heap", bench_old_op, threads);
+		bench_run("arena", bench_arena_op, threads);
+	}
+	return 0;
+}
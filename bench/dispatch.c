@@ -0,0 +1,133 @@
+/*
+	method dispatch cost of the uwsgi plugin
+
+	make bench-server (UWSGI=/path/to/uwsgi when it is not in the PATH)
+	./bench/dispatch [rounds]
+
+	a synthetic request mix modelled on a build running over a mount (mostly GETATTR, GET and
+	PUT, see bench_mix) is dispatched with the uwsgi_strncmp() chain the plugin used before the
+	methods table (reproduced here, in its original order) and with spockfs_method_find().
+	Only the lookup is timed, the plugin is linked without the uWSGI core.
+*/
+#include "../uwsgi/spockfs.c"
+
+#define BENCH_REQUESTS 4096
+
+// uwsgi_strncmp() lives in the uWSGI core, so it is never inlined in the plugin
+static __attribute__((noinline)) int bench_strncmp(char *src, int slen, char *dst, int dlen) {
+	if (slen != dlen) return 1;
+	return memcmp(src, dst, dlen);
+}
+
+static const char *bench_old_methods[] = {
+	"GETATTR", "ACCESS", "OPEN", "GET", "PUT", "POST", "MKNOD", "LINK", "RENAME", "READDIR", "READDIRPLUS",
+	"SYMLINK", "READLINK", "DELETE", "MKDIR", "RMDIR", "CHMOD", "CHOWN", "TRUNCATE", "FALLOCATE", "STATFS",
+	"LISTXATTR", "GETXATTR", "SETXATTR", "REMOVEXATTR", "UTIMENS", "BATCH", "WATCH", NULL,
+};
+
+// the old dispatcher tested every method in turn
+static int bench_old_find(char *method, uint16_t len) {
+	int i;
+	for(i=0;bench_old_methods[i];i++) {
+		if (!bench_strncmp(method, len, (char *) bench_old_methods[i], strlen(bench_old_methods[i]))) return i;
+	}
+	return -1;
+}
+
+// method and weight (per 1000 requests)
+static struct {
+	char *name;
+	int weight;
+} bench_mix[] = {
+	{"GETATTR", 420},
+	{"GET", 180},
+	{"PUT", 120},
+	{"OPEN", 80},
+	{"READDIRPLUS", 40},
+	{"ACCESS", 40},
+	{"READLINK", 30},
+	{"POST", 20},
+	{"TRUNCATE", 20},
+	{"UTIMENS", 15},
+	{"RENAME", 10},
+	{"DELETE", 10},
+	{"GETXATTR", 10},
+	{"MKDIR", 5},
+	{NULL, 0},
+};
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+	char *requests[BENCH_REQUESTS];
+	uint16_t lens[BENCH_REQUESTS];
+	int i, r;
+
+	spockfs_methods_init();
+
+	// spread the mix over the requests (deterministically shuffled)
+	int n = 0;
+	for(i=0;bench_mix[i].name;i++) {
+		int j, count = bench_mix[i].weight * BENCH_REQUESTS / 1000;
+		for(j=0;j<count && n<BENCH_REQUESTS;j++) requests[n++] = bench_mix[i].name;
+	}
+	while(n < BENCH_REQUESTS) requests[n++] = "GETATTR";
+	uint32_t seed = 17;
+	for(i=BENCH_REQUESTS-1;i>0;i--) {
+		seed = seed * 1103515245 + 12345;
+		int j = (seed >> 8) % (i + 1);
+		char *tmp = requests[i];
+		requests[i] = requests[j];
+		requests[j] = tmp;
+	}
+	for(i=0;i<BENCH_REQUESTS;i++) lens[i] = strlen(requests[i]);
+
+	// both dispatchers must agree
+	for(i=0;i<BENCH_REQUESTS;i++) {
+		struct spockfs_method *sm = spockfs_method_find(requests[i], lens[i]);
+		int old = bench_old_find(requests[i], lens[i]);
+		if (!sm || old < 0 || strcmp(sm->name, bench_old_methods[old])) {
+			fprintf(stderr, "dispatch mismatch for %s\n", requests[i]);
+			return 1;
+		}
+	}
+
+	double ops = (double) BENCH_REQUESTS * rounds;
+	long found = 0;
+	double start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_REQUESTS;i++) found += bench_old_find(requests[i], lens[i]);
+	}
+	double ns = bench_now() - start;
+	printf("strncmp chain %6.1f ns/request\n", ns / ops);
+
+	start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_REQUESTS;i++) found += spockfs_method_find(requests[i], lens[i])->flags;
+	}
+	ns = bench_now() - start;
+	printf("method table  %6.1f ns/request\n", ns / ops);
+
+	// an unknown method walks the whole chain (volatile, so the lookup is not hoisted)
+	char *volatile unknown = "PROPFIND";
+	start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_REQUESTS;i++) found += bench_old_find(unknown, 8);
+	}
+	ns = bench_now() - start;
+	printf("strncmp chain %6.1f ns/request (unknown method)\n", ns / ops);
+
+	start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_REQUESTS;i++) found += spockfs_method_find(unknown, 8) != NULL;
+	}
+	ns = bench_now() - start;
+	printf("method table  %6.1f ns/request (unknown method)\n", ns / ops);
+
+	return found == 0x7fffffff;
+}
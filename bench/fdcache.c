@@ -0,0 +1,185 @@
+/*
+	descriptor cache of the uwsgi plugin: time per request and hit rate
+
+	make bench-server (UWSGI=/path/to/uwsgi when it is not in the PATH)
+	./bench/fdcache [directory] [requests] [change]
+
+	BENCH_FILES files are made in a directory of directory (default /tmp) and a synthetic stream
+	of requests (80% of them on a fifth of the files) opens one with spockfs_fd_open() and reads
+	4KiB from it, like a GET. Every change requests (default 1000) one of the files is chmod'ed
+	through the CHMOD path. The stream is run without the cache, with a stat() validating every
+	hit (what the cache did before the generation counter, the counter is bumped before every
+	request to get it) and with the counter. At the end a forked worker renames a file over a
+	path cached by the parent, to check that the parent does not serve the old file.
+	The plugin is linked without the uWSGI core, the few core functions it calls are defined here.
+*/
+#include "../uwsgi/spockfs.c"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define BENCH_FILES 256
+
+struct uwsgi_server uwsgi;
+
+static uint64_t bench_hits;
+static uint64_t bench_misses;
+
+time_t uwsgi_now() {
+	return time(NULL);
+}
+
+void *uwsgi_calloc(size_t len) {
+	void *ptr = calloc(1, len);
+	if (!ptr) exit(1);
+	return ptr;
+}
+
+void *uwsgi_calloc_shared(size_t len) {
+	void *ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) exit(1);
+	return ptr;
+}
+
+char *uwsgi_concat2n(char *s1, int s1_len, char *s2, int s2_len) {
+	char *buf = uwsgi_calloc(s1_len + s2_len + 1);
+	memcpy(buf, s1, s1_len);
+	memcpy(buf + s1_len, s2, s2_len);
+	return buf;
+}
+
+int uwsgi_metric_inc(char *name, char *oid, int64_t value) {
+	if (!strcmp(name, "spockfs.fd_cache.hits")) bench_hits += value;
+	else bench_misses += value;
+	return 0;
+}
+
+static char bench_base[PATH_MAX / 2];
+static struct wsgi_request bench_req;
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_fail(const char *what, char *path) {
+	fprintf(stderr, "%s(%s): %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void bench_path(char *path, int n) {
+	snprintf(path, PATH_MAX, "%s/f%d", bench_base, n);
+}
+
+static void bench_get(int n) {
+	char path[PATH_MAX];
+	char buf[4096];
+	struct spockfs_fd *sfd;
+	bench_path(path, n);
+	int fd = spockfs_fd_open(&bench_req, path, O_RDONLY, &sfd);
+	if (fd < 0) bench_fail("spockfs_fd_open", path);
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf)) bench_fail("pread", path);
+	spockfs_fd_close(fd, sfd);
+}
+
+static void bench_chmod(int n, mode_t mode) {
+	char path[PATH_MAX];
+	bench_path(path, n);
+	if (spockfs_chmodat(&bench_req, path, mode)) bench_fail("spockfs_chmodat", path);
+	spockfs_fd_invalidate(path);
+}
+
+// stat_hits bumps the generation before every request (so every hit is validated)
+static void bench_run(const char *label, int fd_cache, int stat_hits, int requests, int change) {
+	int i;
+	uint32_t seed = 17;
+	spockfs.fd_cache = fd_cache;
+	// start with an empty cache
+	spockfs_fd_invalidate(bench_base);
+	bench_hits = 0;
+	bench_misses = 0;
+	double start = bench_now();
+	for(i=0;i<requests;i++) {
+		seed = seed * 1103515245 + 12345;
+		int n = (seed >> 8) % 10 < 8 ? (seed >> 16) % (BENCH_FILES / 5) : (seed >> 16) % BENCH_FILES;
+		if (change > 0 && i % change == change - 1) bench_chmod(n, i & 1 ? 0600 : 0644);
+		if (stat_hits) __atomic_add_fetch(spockfs_generation, 1, __ATOMIC_RELEASE);
+		bench_get(n);
+	}
+	double ns = bench_now() - start;
+	printf("  %-20s %7.0f ns/request", label, ns / requests);
+	if (fd_cache > 0) printf("  hit rate %5.1f%%", bench_hits * 100.0 / (bench_hits + bench_misses));
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = argc > 1 ? argv[1] : "/tmp";
+	int requests = argc > 2 ? atoi(argv[2]) : 200000;
+	int change = argc > 3 ? atoi(argv[3]) : 1000;
+	char path[PATH_MAX];
+	char buf[4096];
+	int i;
+
+	snprintf(bench_base, sizeof(bench_base), "%s/spockfs_fdcache.XXXXXX", dir);
+	if (!mkdtemp(bench_base)) bench_fail("mkdtemp", bench_base);
+	memset(buf, 'x', sizeof(buf));
+	for(i=0;i<BENCH_FILES;i++) {
+		bench_path(path, i);
+		int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+		if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)) bench_fail("write", path);
+		close(fd);
+	}
+
+	// a single mount, the way spockfs_mount() sets it up
+	static struct uwsgi_worker worker;
+	static struct uwsgi_app app;
+	uwsgi.workers = &worker;
+	worker.apps = &app;
+	app.interpreter = bench_base;
+	app.callable = (void *) strlen(bench_base);
+#ifdef O_PATH
+	app.responder1 = (void *) (long) open(bench_base, O_PATH|O_DIRECTORY|O_CLOEXEC);
+#else
+	app.responder1 = (void *) (long) open(bench_base, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+#endif
+	if ((long) app.responder1 < 0) bench_fail("open", bench_base);
+	spockfs_init();
+	int fd_cache = spockfs.fd_cache;
+
+	printf("%d requests on %d files, %d entries cached, a CHMOD every %d requests (openat2() %s)\n", requests, BENCH_FILES,
+		fd_cache, change, spockfs_openat2 ? "available" : "not available");
+	bench_run("no cache", -1, 0, requests, change);
+	bench_run("stat() every hit", fd_cache, 1, requests, change);
+	bench_run("generation counter", fd_cache, 0, requests, change);
+
+	// another worker replaces f0 (cached here) with f1
+	char path2[PATH_MAX];
+	struct stat st, cached;
+	struct spockfs_fd *sfd;
+	bench_get(0);
+	pid_t pid = fork();
+	if (pid < 0) bench_fail("fork", bench_base);
+	if (pid == 0) {
+		bench_path(path, 0);
+		bench_path(path2, 1);
+		if (spockfs_renameat(&bench_req, path2, path, 0)) bench_fail("spockfs_renameat", path2);
+		spockfs_fd_invalidate(path2);
+		spockfs_fd_invalidate(path);
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	bench_path(path, 0);
+	int fd = spockfs_fd_open(&bench_req, path, O_RDONLY, &sfd);
+	if (fd < 0 || fstat(fd, &cached) || stat(path, &st)) bench_fail("stat", path);
+	spockfs_fd_close(fd, sfd);
+	printf("a file renamed by another worker is %s\n", cached.st_ino == st.st_ino ? "reopened" : "STILL SERVED FROM THE CACHE");
+
+	spockfs.fd_cache = -1;
+	for(i=0;i<BENCH_FILES;i++) {
+		bench_path(path, i);
+		unlink(path);
+	}
+	rmdir(bench_base);
+	return cached.st_ino == st.st_ino ? 0 : 1;
+}
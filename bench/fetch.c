@@ -0,0 +1,103 @@
+/*
+	heap allocations, copies and time per read of the client body path
+
+	make bench
+	./bench/fetch [reads]
+
+	the body of a ranged GET is fed to spockfs_http_body() in CURL_MAX_WRITE_SIZE (16KiB)
+	chunks, the way libcurl delivers it, for the read sizes of libfuse 2 (4KiB, 128KiB) and
+	libfuse 3 (1MiB). Before the fix the body was accumulated in a heap buffer (malloc() and a
+	realloc() per chunk, the path still used by the other requests) and copied to the FUSE buffer
+	by spockfs_fetch(), now it is written straight to the destination (sh_rr->dst).
+	Heap allocations are counted by interposing malloc()/realloc() and the copied bytes by
+	interposing memcpy() (glibc only, the copies realloc() makes internally are not counted).
+*/
+#define main spockfs_main
+#include "../spockfs.c"
+#undef main
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static uint64_t bench_allocs;
+static uint64_t bench_copied;
+
+void *malloc(size_t len) {
+	bench_allocs++;
+	return __libc_malloc(len);
+}
+
+void *realloc(void *ptr, size_t len) {
+	bench_allocs++;
+	return __libc_realloc(ptr, len);
+}
+
+void *memcpy(void *dst, const void *src, size_t len) {
+	bench_copied += len;
+	return memmove(dst, src, len);
+}
+
+#define BENCH_CHUNK 16384
+
+static char *bench_body;
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_feed(struct spockfs_http_rr *sh_rr, size_t size) {
+	size_t pos = 0;
+	while(pos < size) {
+		size_t len = size - pos < BENCH_CHUNK ? size - pos : BENCH_CHUNK;
+		if (spockfs_http_body(bench_body + pos, 1, len, sh_rr) != len) {
+			fprintf(stderr, "body callback failed\n");
+			exit(1);
+		}
+		pos += len;
+	}
+}
+
+// heap body, then copied to the caller buffer by spockfs_fetch()
+static void bench_old_read(char *buf, size_t size) {
+	struct spockfs_http_rr sh_rr;
+	memset(&sh_rr, 0, sizeof(struct spockfs_http_rr));
+	bench_feed(&sh_rr, size);
+	memcpy(buf, sh_rr.buf, sh_rr.len > size ? size : sh_rr.len);
+	free(sh_rr.buf);
+}
+
+static void bench_new_read(char *buf, size_t size) {
+	struct spockfs_http_rr sh_rr;
+	memset(&sh_rr, 0, sizeof(struct spockfs_http_rr));
+	sh_rr.dst = buf;
+	sh_rr.dst_len = size;
+	bench_feed(&sh_rr, size);
+}
+
+static void bench_run(const char *label, void (*read_op)(char *, size_t), char *buf, size_t size, int reads) {
+	int i;
+	uint64_t allocs = bench_allocs;
+	uint64_t copied = bench_copied;
+	double start = bench_now();
+	for(i=0;i<reads;i++) read_op(buf, size);
+	double ns = bench_now() - start;
+	printf("  %-6s %9.0f ns/read %6.2f heap allocations/read %5.2f bytes copied/byte\n", label, ns / reads,
+		(bench_allocs - allocs) / (double) reads, (bench_copied - copied) / ((double) size * reads));
+}
+
+int main(int argc, char *argv[]) {
+	int reads = argc > 1 ? atoi(argv[1]) : 2000;
+	size_t sizes[] = { 4096, 128 * 1024, 1024 * 1024 };
+	int i;
+	bench_body = __libc_malloc(sizes[2]);
+	char *buf = __libc_malloc(sizes[2]);
+	memset(bench_body, 'x', sizes[2]);
+	for(i=0;i<3;i++) {
+		printf("%zu KiB reads\n", sizes[i] / 1024);
+		bench_run("heap", bench_old_read, buf, sizes[i], reads);
+		bench_run("direct", bench_new_read, buf, sizes[i], reads);
+	}
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+	response header parsing cost of the client
+
+	make bench
+	./bench/headers [path] [rounds]
+
+	GETATTR and STATFS responses are built in the wire format of the uwsgi plugin (same headers,
+	same order) from lstat() and statvfs() of path (default /), then every header line is fed to
+	spockfs_http_headers() the way libcurl does and to the strncasecmp() chain the client used
+	before the descriptor table (reproduced here). Like curl, every line is handed in a buffer of
+	its own (the old parser wrote into it), both parsers pay the same copy.
+*/
+#define main spockfs_main
+#include "../spockfs.c"
+#undef main
+
+#include <sys/statvfs.h>
+
+#define BENCH_LINES 32
+
+struct bench_response {
+	char *lines[BENCH_LINES];
+	size_t lens[BENCH_LINES];
+	int count;
+};
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_line(struct bench_response *br, const char *name, uint64_t value) {
+	char buf[256];
+	int ret = value == (uint64_t) -1 ? snprintf(buf, sizeof(buf), "%s\r\n", name) : snprintf(buf, sizeof(buf), "%s: %llu\r\n", name, (unsigned long long) value);
+	br->lines[br->count] = strdup(buf);
+	br->lens[br->count] = ret;
+	br->count++;
+}
+
+// the pre-table parser: one strncasecmp() per known header until a match
+static int64_t bench_old_num(char *s, size_t s_len, char *header, size_t header_len) {
+	if (s_len < header_len) return -1;
+	if (strncasecmp(s, header, header_len)) return -1;
+	if (s_len - header_len == 0) return -1;
+	char *backslash_r = memchr(s + header_len, '\r', s_len - (header_len + 1));
+	if (backslash_r) *backslash_r = 0;
+	return strtoll(s + header_len, NULL, 10);
+}
+
+#define BENCH_OLD(h, f) if ((value = bench_old_num(ptr, len, h, sizeof(h)-1)) >= 0) { sh_rr->f = value; return len; }
+
+static size_t bench_old_headers(char *ptr, size_t len, struct spockfs_http_rr *sh_rr) {
+	int64_t value;
+	BENCH_OLD("X-Spock-size: ", x_spock_size);
+	BENCH_OLD("X-Spock-mode: ", x_spock_mode);
+	BENCH_OLD("X-Spock-uid: ", x_spock_uid);
+	BENCH_OLD("X-Spock-gid: ", x_spock_gid);
+	BENCH_OLD("X-Spock-mtime: ", x_spock_mtime);
+	BENCH_OLD("X-Spock-atime: ", x_spock_atime);
+	BENCH_OLD("X-Spock-ctime: ", x_spock_ctime);
+	BENCH_OLD("X-Spock-nlink: ", x_spock_nlink);
+	BENCH_OLD("X-Spock-blocks: ", x_spock_blocks);
+	BENCH_OLD("X-Spock-dev: ", x_spock_dev);
+	BENCH_OLD("X-Spock-ino: ", x_spock_ino);
+	BENCH_OLD("X-Spock-bsize: ", x_spock_bsize);
+	BENCH_OLD("X-Spock-frsize: ", x_spock_frsize);
+	BENCH_OLD("X-Spock-bfree: ", x_spock_bfree);
+	BENCH_OLD("X-Spock-bavail: ", x_spock_bavail);
+	BENCH_OLD("X-Spock-files: ", x_spock_files);
+	BENCH_OLD("X-Spock-ffree: ", x_spock_ffree);
+	BENCH_OLD("X-Spock-favail: ", x_spock_favail);
+	BENCH_OLD("X-Spock-fsid: ", x_spock_fsid);
+	BENCH_OLD("X-Spock-flag: ", x_spock_flag);
+	BENCH_OLD("X-Spock-namemax: ", x_spock_namemax);
+	return len;
+}
+
+static void bench_parse(struct bench_response *br, int old, struct spockfs_http_rr *sh_rr) {
+	char line[256];
+	int i;
+	for(i=0;i<br->count;i++) {
+		memcpy(line, br->lines[i], br->lens[i]);
+		if (old) bench_old_headers(line, br->lens[i], sh_rr);
+		else spockfs_http_headers(line, 1, br->lens[i], sh_rr);
+	}
+}
+
+static void bench_run(const char *label, struct bench_response *br, int rounds) {
+	struct spockfs_http_rr old_rr, new_rr;
+	int r;
+	memset(&old_rr, 0, sizeof(struct spockfs_http_rr));
+	memset(&new_rr, 0, sizeof(struct spockfs_http_rr));
+	bench_parse(br, 1, &old_rr);
+	bench_parse(br, 0, &new_rr);
+	if (old_rr.x_spock_mode != new_rr.x_spock_mode || old_rr.x_spock_ino != new_rr.x_spock_ino ||
+		old_rr.x_spock_namemax != new_rr.x_spock_namemax || old_rr.x_spock_blocks != new_rr.x_spock_blocks) {
+		fprintf(stderr, "%s: the parsers disagree\n", label);
+		exit(1);
+	}
+	printf("%s (%d header lines)\n", label, br->count);
+	double start = bench_now();
+	for(r=0;r<rounds;r++) bench_parse(br, 1, &old_rr);
+	double ns = bench_now() - start;
+	printf("  strncasecmp chain %7.1f ns/response\n", ns / rounds);
+	start = bench_now();
+	for(r=0;r<rounds;r++) bench_parse(br, 0, &new_rr);
+	ns = bench_now() - start;
+	printf("  descriptor table  %7.1f ns/response\n", ns / rounds);
+}
+
+int main(int argc, char *argv[]) {
+	char *path = argc > 1 ? argv[1] : "/";
+	int rounds = argc > 2 ? atoi(argv[2]) : 200000;
+	struct stat st;
+	struct statvfs sv;
+	if (lstat(path, &st) || statvfs(path, &sv)) {
+		perror(path);
+		return 1;
+	}
+	spockfs_headers_init();
+
+	struct bench_response getattr;
+	memset(&getattr, 0, sizeof(struct bench_response));
+	bench_line(&getattr, "HTTP/1.1 200 OK", -1);
+	bench_line(&getattr, "ETag: \"1a2b3c4d5e6f-1000-5f5e100\"", -1);
+	bench_line(&getattr, "X-Spock-mode", st.st_mode);
+	bench_line(&getattr, "X-Spock-uid", st.st_uid);
+	bench_line(&getattr, "X-Spock-gid", st.st_gid);
+	bench_line(&getattr, "X-Spock-size", st.st_size);
+	bench_line(&getattr, "X-Spock-mtime", st.st_mtime);
+	bench_line(&getattr, "X-Spock-atime", st.st_atime);
+	bench_line(&getattr, "X-Spock-ctime", st.st_ctime);
+	bench_line(&getattr, "X-Spock-nlink", st.st_nlink);
+	bench_line(&getattr, "X-Spock-blocks", st.st_blocks);
+	bench_line(&getattr, "X-Spock-dev", st.st_dev);
+	bench_line(&getattr, "X-Spock-ino", st.st_ino);
+	bench_line(&getattr, "Content-Length", 0);
+	bench_line(&getattr, "", -1);
+
+	struct bench_response statfs;
+	memset(&statfs, 0, sizeof(struct bench_response));
+	bench_line(&statfs, "HTTP/1.1 200 OK", -1);
+	bench_line(&statfs, "X-Spock-bsize", sv.f_bsize);
+	bench_line(&statfs, "X-Spock-frsize", sv.f_frsize);
+	bench_line(&statfs, "X-Spock-blocks", sv.f_blocks);
+	bench_line(&statfs, "X-Spock-bfree", sv.f_bfree);
+	bench_line(&statfs, "X-Spock-bavail", sv.f_bavail);
+	bench_line(&statfs, "X-Spock-files", sv.f_files);
+	bench_line(&statfs, "X-Spock-ffree", sv.f_ffree);
+	bench_line(&statfs, "X-Spock-favail", sv.f_favail);
+	bench_line(&statfs, "X-Spock-fsid", sv.f_fsid);
+	bench_line(&statfs, "X-Spock-flag", sv.f_flag);
+	bench_line(&statfs, "X-Spock-namemax", sv.f_namemax);
+	bench_line(&statfs, "Content-Length", 0);
+	bench_line(&statfs, "", -1);
+
+	bench_run("GETATTR", &getattr, rounds);
+	bench_run("STATFS", &statfs, rounds);
+	return 0;
+}
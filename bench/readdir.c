@@ -0,0 +1,187 @@
+/*
+	READDIR cost of a huge directory on the uwsgi plugin
+
+	make bench-server
+	./bench/readdir [directory] [items] [page]
+
+	a directory of items (default 100000) maildir-like names is made in directory (default /tmp)
+	and listed the way spockfs_readdir() did before paging (readdir() of the whole directory
+	into a single buffer, sent when complete) and the way it does now: pages of page items
+	(default 1024, the readdir_page default of the client), every one in its own request that
+	opens the directory, resumes from the cookie of the previous page with lseek() and reads
+	with getdents64(). Time to the first byte, total time and peak response buffer are reported.
+	The scanning code is reproduced here, so the tool does not need the uWSGI core.
+*/
+// getdents64 (the tool is linux only)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct bench_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// a growing response buffer (like uwsgi_buffer)
+struct bench_buffer {
+	char *buf;
+	size_t pos;
+	size_t len;
+};
+
+static size_t bench_peak;
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_fail(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+static void bench_buffer_init(struct bench_buffer *ub) {
+	ub->len = 4096;
+	ub->pos = 0;
+	ub->buf = malloc(ub->len);
+	if (!ub->buf) bench_fail("malloc");
+}
+
+static void bench_buffer_append(struct bench_buffer *ub, char *buf, size_t len) {
+	if (ub->pos + len > ub->len) {
+		while(ub->pos + len > ub->len) ub->len *= 2;
+		ub->buf = realloc(ub->buf, ub->len);
+		if (!ub->buf) bench_fail("realloc");
+	}
+	memcpy(ub->buf + ub->pos, buf, len);
+	ub->pos += len;
+}
+
+static void bench_buffer_done(struct bench_buffer *ub) {
+	if (ub->len > bench_peak) bench_peak = ub->len;
+	free(ub->buf);
+}
+
+// the whole listing in one response
+static void bench_old(char *dir, double *first) {
+	struct bench_buffer ub;
+	bench_buffer_init(&ub);
+	DIR *d = opendir(dir);
+	if (!d) bench_fail("opendir");
+	struct dirent *de;
+	while((de = readdir(d))) {
+		bench_buffer_append(&ub, de->d_name, strlen(de->d_name));
+		bench_buffer_append(&ub, "\n", 1);
+	}
+	closedir(d);
+	*first = bench_now();
+	bench_buffer_done(&ub);
+}
+
+// a page starting at cookie, returns the cookie of the next one (0 after the last page)
+static uint64_t bench_page(char *dir, uint64_t cookie, uint64_t max) {
+	struct bench_buffer ub;
+	char buf[32768];
+	long len = 0, pos = 0;
+	uint64_t n = 0;
+	int more = 0;
+	bench_buffer_init(&ub);
+	int fd = open(dir, O_RDONLY|O_DIRECTORY);
+	if (fd < 0) bench_fail("open");
+	if (cookie && lseek(fd, (off_t) cookie, SEEK_SET) < 0) bench_fail("lseek");
+	for(;;) {
+		if (n >= max) {
+			more = 1;
+			break;
+		}
+		if (pos >= len) {
+			pos = 0;
+			len = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+			if (len < 0) bench_fail("getdents64");
+			if (len == 0) break;
+		}
+		struct bench_dirent64 *de = (struct bench_dirent64 *) (buf + pos);
+		pos += de->d_reclen;
+		cookie = de->d_off;
+		bench_buffer_append(&ub, de->d_name, strlen(de->d_name));
+		bench_buffer_append(&ub, "\n", 1);
+		n++;
+	}
+	close(fd);
+	bench_buffer_done(&ub);
+	return more ? cookie : 0;
+}
+
+static void bench_paged(char *dir, uint64_t max, double *first, int *pages) {
+	uint64_t cookie = 0;
+	*pages = 0;
+	do {
+		cookie = bench_page(dir, cookie, max);
+		if (!(*pages)++) *first = bench_now();
+	} while(cookie);
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = argc > 1 ? argv[1] : "/tmp";
+	int items = argc > 2 ? atoi(argv[2]) : 100000;
+	uint64_t page = argc > 3 ? strtoull(argv[3], NULL, 10) : 1024;
+	char base[PATH_MAX];
+	char name[256];
+	int i;
+
+	snprintf(base, PATH_MAX, "%s/spockfs_readdir.XXXXXX", dir);
+	if (!mkdtemp(base)) bench_fail("mkdtemp");
+	int dfd = open(base, O_PATH|O_DIRECTORY);
+	if (dfd < 0) bench_fail("open");
+	for(i=0;i<items;i++) {
+		snprintf(name, sizeof(name), "%u.M%uP%u.mx1.example.com,S=%u,W=%u:2,S", 1700000000 + i, i * 7919 % 1000000, 1000 + i % 30000, 1000 + i, 1030 + i);
+		int fd = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+		if (fd < 0) bench_fail("openat");
+		close(fd);
+	}
+	printf("%d items\n", items);
+
+	// the first listing warms the dentry cache for both
+	double first;
+	bench_old(base, &first);
+
+	bench_peak = 0;
+	double start = bench_now();
+	bench_old(base, &first);
+	double end = bench_now();
+	printf("  whole listing   first byte %8.2f ms  total %8.2f ms  peak buffer %8zu KiB\n",
+		(first - start) / 1e6, (end - start) / 1e6, bench_peak / 1024);
+
+	int pages;
+	bench_peak = 0;
+	start = bench_now();
+	bench_paged(base, page, &first, &pages);
+	end = bench_now();
+	printf("  %5d pages     first byte %8.2f ms  total %8.2f ms  peak buffer %8zu KiB\n",
+		pages, (first - start) / 1e6, (end - start) / 1e6, bench_peak / 1024);
+
+	DIR *d = fdopendir(open(base, O_RDONLY|O_DIRECTORY));
+	struct dirent *de;
+	while(d && (de = readdir(d))) {
+		if (de->d_name[0] != '.') unlinkat(dfd, de->d_name, 0);
+	}
+	if (d) closedir(d);
+	close(dfd);
+	rmdir(base);
+	return 0;
+}
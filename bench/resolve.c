@@ -0,0 +1,227 @@
+/*
+	path resolution cost of the uwsgi plugin
+
+	make bench-server
+	./bench/resolve [directory] [rounds]
+
+	a GETATTR (lstat), a mkdir+rmdir and a create+unlink pair are run at increasing depths of a
+	tree made in directory (default /tmp) with the absolute paths (what the plugin did before
+	resolving beneath the mount) and the way spockfs_parentat() does it: the parent directory is
+	opened with openat2(RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS) relative to the mount descriptor and
+	the *at() syscalls work on the last component. The openat() fallback (kernels < 5.6) is timed
+	too. GETATTR is also timed relative to the mount descriptor without confinement (what it did
+	before this series confined it) and by opening the object itself beneath the mount.
+	The syscall sequences are reproduced here, so the tool does not need the uWSGI core.
+*/
+// O_PATH (the tool is linux only)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#define BENCH_MAX_DEPTH 16
+
+static int bench_dirfd;
+static int bench_use_openat2;
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_openat_rel(char *rel, int flags) {
+#ifdef SYS_openat2
+	if (bench_use_openat2) {
+		struct open_how how;
+		memset(&how, 0, sizeof(struct open_how));
+		how.flags = flags;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		return syscall(SYS_openat2, bench_dirfd, rel, &how, sizeof(struct open_how));
+	}
+#endif
+	return openat(bench_dirfd, rel, flags);
+}
+
+// rel is modified (and restored), like in spockfs_parentat()
+static int bench_parentat(char *rel, char **name) {
+	char *slash = strrchr(rel, '/');
+	if (!slash) {
+		*name = rel;
+		return bench_dirfd;
+	}
+	*slash = 0;
+	int fd = bench_openat_rel(rel, O_PATH|O_DIRECTORY);
+	*slash = '/';
+	*name = slash + 1;
+	return fd;
+}
+
+static void bench_parent_close(int fd) {
+	if (fd >= 0 && fd != bench_dirfd) close(fd);
+}
+
+static void bench_fail(const char *what, char *path) {
+	fprintf(stderr, "%s(%s): %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void bench_old_stat(char *abs) {
+	struct stat st;
+	if (lstat(abs, &st)) bench_fail("lstat", abs);
+}
+
+static void bench_old_dir(char *abs) {
+	if (mkdir(abs, 0755)) bench_fail("mkdir", abs);
+	if (rmdir(abs)) bench_fail("rmdir", abs);
+}
+
+static void bench_old_file(char *abs) {
+	int fd = open(abs, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) bench_fail("open", abs);
+	close(fd);
+	if (unlink(abs)) bench_fail("unlink", abs);
+}
+
+// what GETATTR did before resolving beneath the mount (relative to the mount descriptor)
+static void bench_rel_stat(char *rel) {
+	struct stat st;
+	if (fstatat(bench_dirfd, rel, &st, AT_SYMLINK_NOFOLLOW)) bench_fail("fstatat", rel);
+}
+
+// the object itself opened beneath the mount
+static void bench_path_stat(char *rel) {
+	struct stat st;
+	int fd = bench_openat_rel(rel, O_PATH|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) bench_fail("fstat", rel);
+	close(fd);
+}
+
+static void bench_new_stat(char *rel) {
+	struct stat st;
+	char *name;
+	int pfd = bench_parentat(rel, &name);
+	if (pfd < 0 || fstatat(pfd, name, &st, AT_SYMLINK_NOFOLLOW)) bench_fail("fstatat", rel);
+	bench_parent_close(pfd);
+}
+
+// two requests, every one resolves the parent
+static void bench_new_dir(char *rel) {
+	char *name;
+	int pfd = bench_parentat(rel, &name);
+	if (pfd < 0 || mkdirat(pfd, name, 0755)) bench_fail("mkdirat", rel);
+	bench_parent_close(pfd);
+	pfd = bench_parentat(rel, &name);
+	if (pfd < 0 || unlinkat(pfd, name, AT_REMOVEDIR)) bench_fail("unlinkat", rel);
+	bench_parent_close(pfd);
+}
+
+static void bench_new_file(char *rel) {
+	char *name;
+	int pfd = bench_parentat(rel, &name);
+	if (pfd < 0) bench_fail("parentat", rel);
+	int fd = openat(pfd, name, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if (fd < 0) bench_fail("openat", rel);
+	close(fd);
+	bench_parent_close(pfd);
+	pfd = bench_parentat(rel, &name);
+	if (pfd < 0 || unlinkat(pfd, name, 0)) bench_fail("unlinkat", rel);
+	bench_parent_close(pfd);
+}
+
+static double bench_time(void (*op)(char *), char *path, int rounds) {
+	int i;
+	double start = bench_now();
+	for(i=0;i<rounds;i++) op(path);
+	return (bench_now() - start) / rounds;
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = argc > 1 ? argv[1] : "/tmp";
+	int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+	char base[PATH_MAX];
+	char abs[PATH_MAX * 2];
+	char rel[PATH_MAX];
+	int depths[] = { 1, 4, 16 };
+	int i, d;
+
+	snprintf(base, PATH_MAX, "%s/spockfs_resolve.XXXXXX", dir);
+	if (!mkdtemp(base)) bench_fail("mkdtemp", base);
+	bench_dirfd = open(base, O_PATH|O_DIRECTORY);
+	if (bench_dirfd < 0) bench_fail("open", base);
+
+	// base/d/d/d/... (BENCH_MAX_DEPTH levels)
+	rel[0] = 0;
+	for(d=0;d<BENCH_MAX_DEPTH;d++) {
+		strcat(rel, d ? "/d" : "d");
+		snprintf(abs, sizeof(abs), "%s/%s", base, rel);
+		if (mkdir(abs, 0755)) bench_fail("mkdir", abs);
+	}
+
+#ifdef SYS_openat2
+	struct open_how how;
+	memset(&how, 0, sizeof(struct open_how));
+	how.flags = O_PATH|O_DIRECTORY;
+	how.resolve = RESOLVE_BENEATH;
+	int fd = syscall(SYS_openat2, bench_dirfd, "d", &how, sizeof(struct open_how));
+	if (fd >= 0) {
+		close(fd);
+		bench_use_openat2 = 1;
+	}
+#endif
+	if (!bench_use_openat2) printf("openat2() is not available, only the openat() fallback is timed\n");
+
+	for(i=0;i<(int)(sizeof(depths)/sizeof(int));i++) {
+		// the object is created at depth+1 (its parent is at depth)
+		rel[0] = 0;
+		for(d=0;d<depths[i];d++) strcat(rel, d ? "/d" : "d");
+		strcat(rel, "/bench");
+		snprintf(abs, sizeof(abs), "%s/%s", base, rel);
+		printf("depth %d\n", depths[i] + 1);
+
+		int has_openat2 = bench_use_openat2;
+		// the lookup needs the object
+		if (mkdir(abs, 0755)) bench_fail("mkdir", abs);
+		printf("  getattr       absolute %7.0f ns  relative %7.0f ns\n", bench_time(bench_old_stat, abs, rounds), bench_time(bench_rel_stat, rel, rounds));
+		bench_use_openat2 = 0;
+		printf("                parent openat() %7.0f ns", bench_time(bench_new_stat, rel, rounds));
+		bench_use_openat2 = has_openat2;
+		if (has_openat2) printf("  parent openat2() %7.0f ns  object openat2() %7.0f ns", bench_time(bench_new_stat, rel, rounds), bench_time(bench_path_stat, rel, rounds));
+		printf("\n");
+		rmdir(abs);
+
+		printf("  mkdir+rmdir   absolute %7.0f ns", bench_time(bench_old_dir, abs, rounds));
+		bench_use_openat2 = 0;
+		printf("  openat() %7.0f ns", bench_time(bench_new_dir, rel, rounds));
+		bench_use_openat2 = has_openat2;
+		if (has_openat2) printf("  openat2() %7.0f ns", bench_time(bench_new_dir, rel, rounds));
+		printf("\n");
+
+		printf("  create+unlink absolute %7.0f ns", bench_time(bench_old_file, abs, rounds));
+		bench_use_openat2 = 0;
+		printf("  openat() %7.0f ns", bench_time(bench_new_file, rel, rounds));
+		bench_use_openat2 = has_openat2;
+		if (has_openat2) printf("  openat2() %7.0f ns", bench_time(bench_new_file, rel, rounds));
+		printf("\n");
+	}
+
+	for(d=BENCH_MAX_DEPTH;d>0;d--) {
+		rel[0] = 0;
+		for(i=0;i<d;i++) strcat(rel, i ? "/d" : "d");
+		unlinkat(bench_dirfd, rel, AT_REMOVEDIR);
+	}
+	close(bench_dirfd);
+	rmdir(base);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+	large upload throughput of the PUT body path of the uwsgi plugin
+
+	make bench-server
+	./bench/splice [directory] [size_mb]
+
+	a child process sends size_mb MiB (default 256) over a loopback TCP connection, the parent
+	writes them in a file of directory (default /tmp) the way spockfs_put() did before (32KiB
+	reads and lseek()+write()), with 256KiB reads and pwrite() (the fallback of the plugin,
+	used when uWSGI buffers the body) and with splice() through a pipe of SPOCKFS_PUT_CHUNK
+	bytes (the zero-copy path). Wall clock time and the CPU time of the receiver are reported,
+	the page cache is not dropped (the file is rewritten in place every run).
+*/
+// splice() and F_SETPIPE_SZ (the tool is linux only)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_CHUNK (256 * 1024)
+
+static int bench_pipe[2];
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench_cpu() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+static void bench_fail(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+// the old loop: 32KiB reads, lseek() and write()
+static void bench_old(int s, int fd, size_t len) {
+	char buf[32768];
+	off_t offset = 0;
+	while(len > 0) {
+		ssize_t rlen = read(s, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (rlen <= 0) bench_fail("read");
+		if (lseek(fd, offset, SEEK_SET) < 0) bench_fail("lseek");
+		if (write(fd, buf, rlen) != rlen) bench_fail("write");
+		offset += rlen;
+		len -= rlen;
+	}
+}
+
+// spockfs_pwrite() with SPOCKFS_PUT_CHUNK reads
+static void bench_pwrite(int s, int fd, size_t len) {
+	static char buf[BENCH_CHUNK];
+	off_t offset = 0;
+	while(len > 0) {
+		ssize_t rlen = read(s, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (rlen <= 0) bench_fail("read");
+		char *ptr = buf;
+		size_t remains = rlen;
+		while(remains > 0) {
+			ssize_t wlen = pwrite(fd, ptr, remains, offset);
+			if (wlen <= 0) bench_fail("pwrite");
+			ptr += wlen;
+			remains -= wlen;
+			offset += wlen;
+		}
+		len -= rlen;
+	}
+}
+
+// spockfs_splice(): socket -> pipe -> file
+static void bench_splice(int s, int fd, size_t len) {
+	loff_t offset = 0;
+	while(len > 0) {
+		ssize_t in = splice(s, NULL, bench_pipe[1], NULL, len < BENCH_CHUNK ? len : BENCH_CHUNK, SPLICE_F_MOVE);
+		if (in <= 0) bench_fail("splice (socket)");
+		size_t piped = in;
+		while(piped > 0) {
+			ssize_t out = splice(bench_pipe[0], NULL, fd, &offset, piped, SPLICE_F_MOVE);
+			if (out <= 0) bench_fail("splice (file)");
+			piped -= out;
+		}
+		len -= in;
+	}
+}
+
+static void bench_send(struct sockaddr_in *addr, size_t len) {
+	static char buf[BENCH_CHUNK];
+	memset(buf, 'x', sizeof(buf));
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0 || connect(s, (struct sockaddr *) addr, sizeof(struct sockaddr_in))) bench_fail("connect");
+	while(len > 0) {
+		ssize_t wlen = write(s, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (wlen <= 0) bench_fail("write (socket)");
+		len -= wlen;
+	}
+	close(s);
+	_exit(0);
+}
+
+static void bench_run(const char *label, void (*recv_body)(int, int, size_t), int server, struct sockaddr_in *addr, int fd, size_t len) {
+	pid_t pid = fork();
+	if (pid < 0) bench_fail("fork");
+	if (pid == 0) bench_send(addr, len);
+	int s = accept(server, NULL, NULL);
+	if (s < 0) bench_fail("accept");
+	double cpu = bench_cpu();
+	double start = bench_now();
+	recv_body(s, fd, len);
+	if (fdatasync(fd)) bench_fail("fdatasync");
+	double ns = bench_now() - start;
+	cpu = bench_cpu() - cpu;
+	close(s);
+	waitpid(pid, NULL, 0);
+	printf("%-24s %8.1f MiB/s %6.0f ms cpu\n", label, (len / 1048576.0) / (ns / 1e9), cpu / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = argc > 1 ? argv[1] : "/tmp";
+	size_t len = (size_t) (argc > 2 ? atoi(argv[2]) : 256) * 1048576;
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/spockfs_splice.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0) bench_fail("mkstemp");
+	unlink(path);
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(struct sockaddr_in);
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (server < 0 || bind(server, (struct sockaddr *) &addr, addr_len) || listen(server, 1) ||
+		getsockname(server, (struct sockaddr *) &addr, &addr_len)) bench_fail("listen");
+
+	if (pipe2(bench_pipe, O_CLOEXEC)) bench_fail("pipe2");
+	fcntl(bench_pipe[1], F_SETPIPE_SZ, BENCH_CHUNK);
+
+	// the first run allocates the blocks of the file
+	bench_run("warm up", bench_pwrite, server, &addr, fd, len);
+	bench_run("32KiB lseek()+write()", bench_old, server, &addr, fd, len);
+	bench_run("256KiB pwrite()", bench_pwrite, server, &addr, fd, len);
+	bench_run("splice()", bench_splice, server, &addr, fd, len);
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# sequential and small-write throughput of a mounted spockfs
+#
+#	bench/throughput.sh <mountpoint> [size_mb]
+#
+# build the client twice ('make' and 'make FUSE=3'), mount the same server with each of
+# them and run this script against both mountpoints: it writes a file of <size_mb> MiB
+# (default 512) with 1MiB and 4KiB writes, then reads it back with 1MiB reads (after
+# dropping the kernel page cache when run as root).
+
+set -e
+
+if [ -z "$1" ]; then
+	echo "usage: $0 <mountpoint> [size_mb]"
+	exit 1
+fi
+
+DIR="$1/.spockfs_bench.$$"
+SIZE=${2:-512}
+mkdir "$DIR"
+trap 'rm -rf "$DIR"' EXIT
+
+now() {
+	date +%s.%N
+}
+
+# seconds since <start>
+elapsed() {
+	awk -v start="$1" -v end="$(now)" 'BEGIN { print end - start }'
+}
+
+# <label> <seconds> <mb>
+report() {
+	awk -v label="$1" -v seconds="$2" -v mb="$3" 'BEGIN { printf("%-16s %8.1f MiB/s\n", label, mb / seconds) }'
+}
+
+drop_caches() {
+	if [ "$(id -u)" = "0" ]; then
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+	fi
+}
+
+START=$(now)
+dd if=/dev/zero of="$DIR/big" bs=1M count="$SIZE" conv=fsync 2>/dev/null
+report "write (1MiB)" "$(elapsed "$START")" "$SIZE"
+
+# small writes are the case the kernel write-back cache (libfuse 3) merges
+SMALL=$((SIZE / 8))
+START=$(now)
+dd if=/dev/zero of="$DIR/small" bs=4k count=$((SMALL * 256)) conv=fsync 2>/dev/null
+report "write (4KiB)" "$(elapsed "$START")" "$SMALL"
+
+drop_caches
+START=$(now)
+dd if="$DIR/big" of=/dev/null bs=1M 2>/dev/null
+report "read (1MiB)" "$(elapsed "$START")" "$SIZE"
+
+# a second read is served by the kernel page cache when keep_cache allows it
+START=$(now)
+dd if="$DIR/big" of=/dev/null bs=1M 2>/dev/null
+report "re-read (1MiB)" "$(elapsed "$START")" "$SIZE"
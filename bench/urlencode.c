@@ -0,0 +1,153 @@
+/*
+	url encoding cost per request over realistic path corpora
+
+	make bench
+	./bench/urlencode [rounds]
+
+	every corpus is encoded with the snprintf() encoder the client used before the lookup table
+	(reproduced here), with spockfs_prepare_url() and through the url cached by an open file
+	(spockfs_file_url(), what reads and writes on the same file pay).
+*/
+#define main spockfs_main
+#include "../spockfs.c"
+#undef main
+
+#define BENCH_PATHS 4096
+
+static const char *bench_base = "http://127.0.0.1:8080/spockfs";
+
+// the pre-table client: worst-case allocation and snprintf() for every unsafe byte
+static char *bench_old_url(const char *base, size_t base_len, const char *path) {
+	size_t path_len = strlen(path);
+	size_t url_len = base_len + (path_len * 3) + 2;
+	char *url = malloc(url_len);
+	if (!url) return NULL;
+	memcpy(url, base, base_len);
+	char *ptr = url + base_len;
+	size_t i;
+	for(i=0;i<path_len;i++) {
+		char c = path[i];
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+			*ptr++ = c;
+		}
+		else {
+			snprintf(ptr, url_len - (ptr - url), "%%%02X", (uint8_t) c);
+			ptr += 3;
+		}
+	}
+	*ptr = 0;
+	return url;
+}
+
+// a source tree (only safe bytes)
+static void bench_corpus_source(char **paths) {
+	static const char *dirs[] = { "src", "include", "lib", "tests", "docs", "tools" };
+	static const char *exts[] = { "c", "h", "py", "md", "txt" };
+	int i;
+	for(i=0;i<BENCH_PATHS;i++) {
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "/home/spock/projects/enterprise-%d/%s/module_%03d/%s/file_%04d.%s", i % 7, dirs[i % 6], i % 113, dirs[(i / 6) % 6], i, exts[i % 5]);
+		paths[i] = strdup(buf);
+	}
+}
+
+// a maildir spool (',', ':' and '=' are encoded)
+static void bench_corpus_maildir(char **paths) {
+	int i;
+	for(i=0;i<BENCH_PATHS;i++) {
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "/var/mail/user%03d/Maildir/cur/%u.M%uP%u.mx%d.example.com,S=%u,W=%u:2,%s", i % 200, 1700000000 + i * 37, i * 7919 % 1000000, 1000 + i % 30000, i % 4, 1000 + i * 13, 1030 + i * 13, (i % 3) ? "S" : "RS");
+		paths[i] = strdup(buf);
+	}
+}
+
+// user documents (spaces and utf-8 names, mostly encoded)
+static void bench_corpus_documents(char **paths) {
+	static const char *names[] = { "Relazione finale", "Übersicht März", "Résumé été", "家族の写真", "Фото отпуск", "Budget (copy)" };
+	int i;
+	for(i=0;i<BENCH_PATHS;i++) {
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "/home/spock/Documents/%s %d/%s %04d.pdf", names[i % 6], 2000 + i % 25, names[(i / 6) % 6], i);
+		paths[i] = strdup(buf);
+	}
+}
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_corpus(const char *label, char **paths, int rounds) {
+	size_t bytes = 0;
+	int i, r;
+	for(i=0;i<BENCH_PATHS;i++) bytes += strlen(paths[i]);
+	double ops = (double) BENCH_PATHS * rounds;
+	printf("%s (%zu bytes per path on average)\n", label, bytes / BENCH_PATHS);
+
+	double start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_PATHS;i++) {
+			char *url = bench_old_url(bench_base, strlen(bench_base), paths[i]);
+			free(url);
+		}
+	}
+	double ns = bench_now() - start;
+	printf("  snprintf encoder %7.1f ns/path %7.1f MB/s\n", ns / ops, (bytes * (double) rounds) / ns * 1e3);
+
+	start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_PATHS;i++) {
+			size_t mark = spockfs_arena_mark();
+			char *url = spockfs_prepare_url(bench_base, strlen(bench_base), paths[i]);
+			spockfs_arena_release(url);
+			spockfs_arena_rewind(mark);
+		}
+	}
+	ns = bench_now() - start;
+	printf("  table encoder    %7.1f ns/path %7.1f MB/s\n", ns / ops, (bytes * (double) rounds) / ns * 1e3);
+
+	// what a read/write loop on an open file pays (the url is built at open)
+	struct spockfs_file *files = calloc(BENCH_PATHS, sizeof(struct spockfs_file));
+	for(i=0;i<BENCH_PATHS;i++) {
+		files[i].path = paths[i];
+		files[i].url = spockfs_file_url_new(paths[i], &files[i].url_len);
+		pthread_mutex_init(&files[i].lock, NULL);
+	}
+	start = bench_now();
+	for(r=0;r<rounds;r++) {
+		for(i=0;i<BENCH_PATHS;i++) {
+			spockfs_file_cur = &files[i];
+			size_t mark = spockfs_arena_mark();
+			char *url = spockfs_file_url(paths[i]);
+			spockfs_arena_release(url);
+			spockfs_arena_rewind(mark);
+		}
+	}
+	spockfs_file_cur = NULL;
+	ns = bench_now() - start;
+	printf("  cached url       %7.1f ns/path\n", ns / ops);
+	for(i=0;i<BENCH_PATHS;i++) {
+		free(files[i].url);
+		free(paths[i]);
+	}
+	free(files);
+}
+
+int main(int argc, char *argv[]) {
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	spockfs_url_init();
+	pthread_key_create(&spockfs_arena_key, spockfs_arena_free);
+	spockfs_config.http_url = (char *) bench_base;
+	spockfs_config.http_url_len = strlen(bench_base);
+
+	char *paths[BENCH_PATHS];
+	bench_corpus_source(paths);
+	bench_corpus("source tree", paths, rounds);
+	bench_corpus_maildir(paths);
+	bench_corpus("maildir", paths, rounds);
+	bench_corpus_documents(paths);
+	bench_corpus("documents", paths, rounds);
+	return 0;
+}
@@ -1,5 +1,9 @@
+// the libfuse 3 build (make FUSE=3) sets it to 31
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#endif
+#define _GNU_SOURCE
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -7,7 +11,14 @@
 #include <stdio.h>
 #include <curl/curl.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
 #include <pthread.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 
 #define spockfs_check(x) if (sh_rr->code != x) {\
                 		ret = spockfs_errno(sh_rr->code);\
@@ -20,7 +31,8 @@
                         }
 
 #define spockfs_init() int ret = -EIO; \
-			struct spockfs_http_rr *sh_rr = calloc(sizeof(struct spockfs_http_rr), 1);\
+			size_t spockfs_mark = spockfs_arena_mark();\
+			struct spockfs_http_rr *sh_rr = spockfs_arena_calloc(sizeof(struct spockfs_http_rr));\
 			if (!sh_rr) {\
 				return -ENOMEM;\
 			}
@@ -30,10 +42,11 @@
 			
 
 #define spockfs_free() if (sh_rr->buf) free(sh_rr->buf);\
-        		free(sh_rr);\
+        		spockfs_arena_release(sh_rr);\
+        		spockfs_arena_rewind(spockfs_mark);\
         		return ret
 
-#define spockfs_free2() if (headers) curl_slist_free_all(headers);\
+#define spockfs_free2() spockfs_headers_free(headers);\
 			spockfs_free()
 
 #define spockfs_run(x, y) if ((ret = spockfs_http(x, path, sh_rr, y))) goto end
@@ -50,27 +63,172 @@
                 goto end;\
         }
 
+#define spockfs_header_etag(x, y) headers = spockfs_add_header_etag(headers, x, y);\
+        if (!headers) {\
+                ret = -ENOMEM;\
+                goto end;\
+        }
+
 #define spockfs_header_target(x) headers = spockfs_add_header_target(headers, x);\
         if (!headers) {\
                 ret = -ENOMEM;\
                 goto end;\
         }
 
+#define spockfs_stats_inc(x) __sync_fetch_and_add(&spockfs_stats.x, 1)
+
+// a pooled curl easy handle (it keeps its connection alive between requests)
+struct spockfs_curl {
+	CURL *curl;
+	uint64_t last_used;
+	struct spockfs_curl *next;
+};
+
 static struct spockfs_config {
 	char *http_url;
 	size_t http_url_len;
-	CURLSH *dns_cache;
-	pthread_mutex_t dns_lock;
+	// dns, connections and ssl sessions are shared between all of the handles
+	CURLSH *share;
+	pthread_mutex_t share_lock[CURL_LOCK_DATA_LAST];
+
+	pthread_mutex_t pool_lock;
+	struct spockfs_curl *pool;
+	unsigned int pool_count;
+	// mount options
+	unsigned int pool_size;
+	unsigned int pool_idle;
+	double attr_ttl;
+	unsigned int attr_cache_size;
+	double negative_ttl;
+	unsigned int negative_cache_size;
+	int no_readdirplus;
+	unsigned int readdir_page;
+	int no_multi;
+	int no_writeback_cache;
+	unsigned int multi_connections;
+	unsigned int stripes_max;
+	unsigned int stripe_size;
+	unsigned int workers;
+	unsigned int readahead_max;
+	unsigned int writeback_size;
+	unsigned int writeback_delay;
+	unsigned int writeback_max;
+	unsigned int cache_size;
+	char *cache_dir;
+	unsigned int cache_dir_size;
+	unsigned int batch_max;
+	unsigned int batch_inflight;
+	int watch;
+	unsigned int watch_timeout;
 } spockfs_config;
 
+static struct spockfs_stats {
+	uint64_t requests;
+	uint64_t pool_hits;
+	uint64_t pool_misses;
+	uint64_t pool_expired;
+	uint64_t connections_new;
+	uint64_t connections_reused;
+	uint64_t attr_hits;
+	uint64_t attr_misses;
+	uint64_t attr_revalidated;
+	uint64_t readlink_hits;
+	uint64_t readlink_misses;
+	uint64_t negative_hits;
+	uint64_t negative_entries;
+	uint64_t readahead_hits;
+	uint64_t readahead_misses;
+	uint64_t readahead_bytes;
+	uint64_t readahead_wasted;
+	uint64_t writeback_writes;
+	uint64_t writeback_flushes;
+	uint64_t writeback_bytes;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_bytes;
+	uint64_t cache_evictions;
+	uint64_t disk_hits;
+	uint64_t disk_misses;
+	uint64_t disk_bytes;
+	uint64_t disk_evictions;
+	uint64_t striped_reads;
+	uint64_t stripes;
+	uint64_t batches;
+	uint64_t batched_ops;
+	uint64_t shared_requests;
+	uint64_t nodes;
+	uint64_t watch_streams;
+	uint64_t watch_events;
+	uint64_t arena_fallbacks;
+	uint64_t url_reused;
+} spockfs_stats;
+
+// exposed (read-only) as the "user.spockfs.stats" xattr of the mount root
+static struct spockfs_stats_item {
+	const char *name;
+	uint64_t *value;
+} spockfs_stats_items[] = {
+	{"requests", &spockfs_stats.requests},
+	{"pool_hits", &spockfs_stats.pool_hits},
+	{"pool_misses", &spockfs_stats.pool_misses},
+	{"pool_expired", &spockfs_stats.pool_expired},
+	{"connections_new", &spockfs_stats.connections_new},
+	{"connections_reused", &spockfs_stats.connections_reused},
+	{"attr_hits", &spockfs_stats.attr_hits},
+	{"attr_misses", &spockfs_stats.attr_misses},
+	{"attr_revalidated", &spockfs_stats.attr_revalidated},
+	{"readlink_hits", &spockfs_stats.readlink_hits},
+	{"readlink_misses", &spockfs_stats.readlink_misses},
+	{"negative_hits", &spockfs_stats.negative_hits},
+	{"negative_entries", &spockfs_stats.negative_entries},
+	{"readahead_hits", &spockfs_stats.readahead_hits},
+	{"readahead_misses", &spockfs_stats.readahead_misses},
+	{"readahead_bytes", &spockfs_stats.readahead_bytes},
+	{"readahead_wasted", &spockfs_stats.readahead_wasted},
+	{"writeback_writes", &spockfs_stats.writeback_writes},
+	{"writeback_flushes", &spockfs_stats.writeback_flushes},
+	{"writeback_bytes", &spockfs_stats.writeback_bytes},
+	{"cache_hits", &spockfs_stats.cache_hits},
+	{"cache_misses", &spockfs_stats.cache_misses},
+	{"cache_bytes", &spockfs_stats.cache_bytes},
+	{"cache_evictions", &spockfs_stats.cache_evictions},
+	{"disk_hits", &spockfs_stats.disk_hits},
+	{"disk_misses", &spockfs_stats.disk_misses},
+	{"disk_bytes", &spockfs_stats.disk_bytes},
+	{"disk_evictions", &spockfs_stats.disk_evictions},
+	{"striped_reads", &spockfs_stats.striped_reads},
+	{"stripes", &spockfs_stats.stripes},
+	{"batches", &spockfs_stats.batches},
+	{"batched_ops", &spockfs_stats.batched_ops},
+	{"shared_requests", &spockfs_stats.shared_requests},
+	{"nodes", &spockfs_stats.nodes},
+	{"watch_streams", &spockfs_stats.watch_streams},
+	{"watch_events", &spockfs_stats.watch_events},
+	{"arena_fallbacks", &spockfs_stats.arena_fallbacks},
+	{"url_reused", &spockfs_stats.url_reused},
+	{NULL, NULL},
+};
+
+// strong ETags generated by the reference server are far shorter
+#define SPOCKFS_ETAG_MAX 128
+
 struct spockfs_http_rr {
 	char *buf;
 	size_t len;
 
+	// when set, the body is written directly here (up to dst_len bytes) instead of buf
+	char *dst;
+	size_t dst_len;
+	int truncated;
+
 	const char *body;
 	size_t body_len;
+	// request headers added by spockfs_http_setup() when the caller has none
+	struct curl_slist *headers;
 
 	long code;
+	// the validator of the object (empty if not sent)
+	char etag[SPOCKFS_ETAG_MAX];
 
 	mode_t x_spock_mode;
 	uid_t x_spock_uid;
@@ -94,72 +252,272 @@ struct spockfs_http_rr {
 	uint64_t x_spock_favail;
 	uint64_t x_spock_fsid;
 	uint64_t x_spock_namemax;
+	// where the next page of a directory listing starts
+	uint64_t x_spock_cookie;
+};
+
+
+/*
+	per-thread arena
+
+	the request/response state (struct spockfs_http_rr, urls, header lists) of an operation
+	is bump-allocated from a per-thread arena and released in one shot (by rewinding to the mark
+	taken when the operation started), allocations not fitting in the arena fall back to the heap.
+	Bodies are still allocated in the heap (they are resized by the I/O thread).
+*/
+#define SPOCKFS_ARENA_SIZE 65536
+
+struct spockfs_arena {
+	char *buf;
+	size_t pos;
 };
 
+static pthread_key_t spockfs_arena_key;
+// the key only frees the arena at thread exit, lookups go through the thread local copy
+static __thread struct spockfs_arena *spockfs_arena_self;
+
+static void spockfs_arena_free(void *data) {
+	struct spockfs_arena *arena = (struct spockfs_arena *) data;
+	free(arena->buf);
+	free(arena);
+}
+
+static struct spockfs_arena *spockfs_arena_get() {
+	struct spockfs_arena *arena = spockfs_arena_self;
+	if (!arena) {
+		arena = calloc(1, sizeof(struct spockfs_arena));
+		if (!arena) return NULL;
+		arena->buf = malloc(SPOCKFS_ARENA_SIZE);
+		if (!arena->buf || pthread_setspecific(spockfs_arena_key, arena)) {
+			if (arena->buf) free(arena->buf);
+			free(arena);
+			return NULL;
+		}
+		spockfs_arena_self = arena;
+	}
+	return arena;
+}
+
+static size_t spockfs_arena_mark() {
+	struct spockfs_arena *arena = spockfs_arena_get();
+	return arena ? arena->pos : 0;
+}
+
+static void spockfs_arena_rewind(size_t mark) {
+	struct spockfs_arena *arena = spockfs_arena_self;
+	if (arena && mark < arena->pos) arena->pos = mark;
+}
+
+static void *spockfs_arena_alloc(size_t len) {
+	struct spockfs_arena *arena = spockfs_arena_get();
+	// 16 bytes alignment
+	len = (len + 15) & ~((size_t) 15);
+	if (arena && len <= SPOCKFS_ARENA_SIZE - arena->pos) {
+		void *ptr = arena->buf + arena->pos;
+		arena->pos += len;
+		return ptr;
+	}
+	spockfs_stats_inc(arena_fallbacks);
+	return malloc(len);
+}
+
+static void *spockfs_arena_calloc(size_t len) {
+	void *ptr = spockfs_arena_alloc(len);
+	if (ptr) memset(ptr, 0, len);
+	return ptr;
+}
+
+// give back the tail of the last allocation (when it is in the arena)
+static void spockfs_arena_trim(void *ptr, size_t len, size_t new_len) {
+	struct spockfs_arena *arena = spockfs_arena_self;
+	if (!arena || (char *) ptr < arena->buf || (char *) ptr >= arena->buf + SPOCKFS_ARENA_SIZE) return;
+	len = (len + 15) & ~((size_t) 15);
+	if ((char *) ptr + len != arena->buf + arena->pos) return;
+	arena->pos = ((char *) ptr - arena->buf) + ((new_len + 15) & ~((size_t) 15));
+}
+
+// arena memory is reclaimed by spockfs_arena_rewind(), only heap fallbacks are really freed
+static void spockfs_arena_release(void *ptr) {
+	struct spockfs_arena *arena = spockfs_arena_self;
+	if (arena && (char *) ptr >= arena->buf && (char *) ptr < arena->buf + SPOCKFS_ARENA_SIZE) return;
+	free(ptr);
+}
+
+// request headers are curl_slist nodes allocated (with their text) in the arena
+static void spockfs_headers_free(struct curl_slist *headers) {
+	while(headers) {
+		struct curl_slist *next = headers->next;
+		spockfs_arena_release(headers);
+		headers = next;
+	}
+}
+
+// append "name: value" (the whole list is freed on error)
+static struct curl_slist *spockfs_headers_append(struct curl_slist *headers, const char *name, const char *value, size_t value_len) {
+	size_t name_len = strlen(name);
+	struct curl_slist *node = spockfs_arena_alloc(sizeof(struct curl_slist) + name_len + 2 + value_len + 1);
+	if (!node) {
+		spockfs_headers_free(headers);
+		return NULL;
+	}
+	char *ptr = (char *) (node + 1);
+	node->data = ptr;
+	node->next = NULL;
+	memcpy(ptr, name, name_len);
+	ptr += name_len;
+	*ptr++ = ':';
+	*ptr++ = ' ';
+	memcpy(ptr, value, value_len);
+	ptr[value_len] = 0;
+	if (!headers) return node;
+	struct curl_slist *last = headers;
+	while(last->next) last = last->next;
+	last->next = node;
+	return headers;
+}
 
 static struct curl_slist *spockfs_add_header_num(struct curl_slist *headers, char *name, int64_t value) {
-	char header[64];
-        int ret = snprintf(header, 64, "X-Spock-%s: %lld", name, (long long) value);
-        if (ret <= 0 || ret > 64) {
-		if (headers) curl_slist_free_all(headers);
-                return NULL;
-        } 
-        struct curl_slist *ret_headers = curl_slist_append(headers, header);
-	// free old headers in case of error
-	if (!ret_headers) {
-		if (headers) curl_slist_free_all(headers);
+	char header[32];
+	char value_s[24];
+	int ret = snprintf(header, 32, "X-Spock-%s", name);
+	int ret2 = snprintf(value_s, 24, "%lld", (long long) value);
+	if (ret <= 0 || ret >= 32 || ret2 <= 0 || ret2 >= 24) {
+		spockfs_headers_free(headers);
+		return NULL;
 	}
-	return ret_headers;
+	return spockfs_headers_append(headers, header, value_s, ret2);
 }
 
 static struct curl_slist *spockfs_add_header_range(struct curl_slist *headers, char *name, uint64_t from, uint64_t to) {
-	char header[64];
-        int ret = snprintf(header, 64, "%s: bytes=%llu-%llu", name, (unsigned long long) from, (unsigned long long) to);
-        if (ret <= 0 || ret > 64) {
-		if (headers) curl_slist_free_all(headers);
-                return NULL;
-        }
-        struct curl_slist *ret_headers = curl_slist_append(headers, header);
-        // free old headers in case of error
-        if (!ret_headers) {
-                if (headers) curl_slist_free_all(headers);
-        }
-        return ret_headers;
+	char value[64];
+	int ret = snprintf(value, 64, "bytes=%llu-%llu", (unsigned long long) from, (unsigned long long) to);
+	if (ret <= 0 || ret >= 64) {
+		spockfs_headers_free(headers);
+		return NULL;
+	}
+	return spockfs_headers_append(headers, name, value, ret);
+}
+
+// conditional requests (If-None-Match, If-Match)
+static struct curl_slist *spockfs_add_header_etag(struct curl_slist *headers, char *name, const char *etag) {
+	return spockfs_headers_append(headers, name, etag, strlen(etag));
 }
 
 static struct curl_slist *spockfs_add_header_target(struct curl_slist *headers, const char *target) {
-	size_t target_len = strlen(target);
-	char *header = malloc(17 + target_len);
-	if (!header) {
-		if (headers) curl_slist_free_all(headers);
-		return NULL;
+	return spockfs_headers_append(headers, "X-Spock-target", target, strlen(target));
+}
+
+/*
+	response headers
+
+	X-Spock-* headers are mapped to the fields of struct spockfs_http_rr by a descriptor
+	table, indexed (at startup) by a hash of the name length and its first two chars,
+	so every header line costs a single lookup (other headers are discarded after
+	checking the prefix).
+*/
+#define SPOCKFS_HEADER(n, f) { n, sizeof(n)-1, offsetof(struct spockfs_http_rr, f), sizeof(((struct spockfs_http_rr *) 0)->f) }
+
+static struct spockfs_header {
+	const char *name;
+	size_t len;
+	size_t offset;
+	size_t size;
+} spockfs_headers[] = {
+	SPOCKFS_HEADER("size", x_spock_size),
+	SPOCKFS_HEADER("mode", x_spock_mode),
+	SPOCKFS_HEADER("uid", x_spock_uid),
+	SPOCKFS_HEADER("gid", x_spock_gid),
+	SPOCKFS_HEADER("mtime", x_spock_mtime),
+	SPOCKFS_HEADER("atime", x_spock_atime),
+	SPOCKFS_HEADER("ctime", x_spock_ctime),
+	SPOCKFS_HEADER("nlink", x_spock_nlink),
+	SPOCKFS_HEADER("blocks", x_spock_blocks),
+	SPOCKFS_HEADER("dev", x_spock_dev),
+	SPOCKFS_HEADER("ino", x_spock_ino),
+	SPOCKFS_HEADER("bsize", x_spock_bsize),
+	SPOCKFS_HEADER("frsize", x_spock_frsize),
+	SPOCKFS_HEADER("bfree", x_spock_bfree),
+	SPOCKFS_HEADER("bavail", x_spock_bavail),
+	SPOCKFS_HEADER("files", x_spock_files),
+	SPOCKFS_HEADER("ffree", x_spock_ffree),
+	SPOCKFS_HEADER("favail", x_spock_favail),
+	SPOCKFS_HEADER("fsid", x_spock_fsid),
+	SPOCKFS_HEADER("flag", x_spock_flag),
+	SPOCKFS_HEADER("namemax", x_spock_namemax),
+	SPOCKFS_HEADER("cookie", x_spock_cookie),
+	{NULL, 0, 0, 0},
+};
+
+// must be a power of two bigger than the number of headers
+#define SPOCKFS_HEADERS_SLOTS 64
+
+static struct spockfs_header *spockfs_headers_index[SPOCKFS_HEADERS_SLOTS];
+
+static uint32_t spockfs_header_hash(const char *name, size_t len) {
+	return ((len * 31) + ((name[0] | 0x20) * 7) + (name[1] | 0x20)) & (SPOCKFS_HEADERS_SLOTS - 1);
+}
+
+static void spockfs_headers_init() {
+	struct spockfs_header *sh = spockfs_headers;
+	while(sh->name) {
+		uint32_t slot = spockfs_header_hash(sh->name, sh->len);
+		while(spockfs_headers_index[slot]) {
+			slot = (slot + 1) & (SPOCKFS_HEADERS_SLOTS - 1);
+		}
+		spockfs_headers_index[slot] = sh;
+		sh++;
 	}
-	memcpy(header, "X-Spock-target: ", 16);
-	memcpy(header + 16, target, target_len);
-	header[16 + target_len] = 0;
-        struct curl_slist *ret_headers = curl_slist_append(headers, header);
-	free(header);
-        // free old headers in case of error
-        if (!ret_headers) {
-                if (headers) curl_slist_free_all(headers);
-        }
-        return ret_headers;
 }
 
-static int64_t spockfs_get_header_num(char *s, size_t s_len, char *header, size_t header_len) {
-	if (s_len < header_len) return -1;
-	if (strncasecmp(s, header, header_len)) return -1;
-	if (s_len - header_len == 0) return -1;
-	char *backslash_r = memchr(s + header_len, '\r', s_len - (header_len + 1)); 
-	*backslash_r = 0;
-	return strtoll(s + header_len, NULL, 10);
+static struct spockfs_header *spockfs_header_find(const char *name, size_t len) {
+	if (len < 2) return NULL;
+	uint32_t slot = spockfs_header_hash(name, len);
+	while(spockfs_headers_index[slot]) {
+		struct spockfs_header *sh = spockfs_headers_index[slot];
+		if (sh->len == len && !strncasecmp(sh->name, name, len)) return sh;
+		slot = (slot + 1) & (SPOCKFS_HEADERS_SLOTS - 1);
+	}
+	return NULL;
+}
+
+// parse an unsigned decimal (surrounded by optional whitespaces), returns -1 if invalid
+static int spockfs_parse_num(const char *s, size_t len, uint64_t *n) {
+	size_t i = 0;
+	uint64_t value = 0;
+	while(i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+	size_t start = i;
+	while(i < len && s[i] >= '0' && s[i] <= '9') {
+		value = (value * 10) + (s[i] - '0');
+		i++;
+	}
+	if (i == start) return -1;
+	while(i < len) {
+		if (s[i] != ' ' && s[i] != '\t' && s[i] != '\r' && s[i] != '\n') return -1;
+		i++;
+	}
+	*n = value;
+	return 0;
 }
 
 size_t spockfs_http_body(char *ptr, size_t size, size_t nmemb, void *userdata) {
 	struct spockfs_http_rr *sh_rr = (struct spockfs_http_rr *) userdata;
 	size_t len = size * nmemb;
+	if (sh_rr->dst) {
+		// more than expected (a server ignoring the Range ?), stop the transfer
+		if (len > sh_rr->dst_len - sh_rr->len) {
+			len = sh_rr->dst_len - sh_rr->len;
+			memcpy(sh_rr->dst + sh_rr->len, ptr, len);
+			sh_rr->len += len;
+			sh_rr->truncated = 1;
+			return 0;
+		}
+		memcpy(sh_rr->dst + sh_rr->len, ptr, len);
+		sh_rr->len += len;
+		return len;
+	}
 	if (!sh_rr->buf) {
 		sh_rr->buf = malloc(len);
+		if (!sh_rr->buf) return 0;
 	}
 	else {
 		char *tmp = realloc(sh_rr->buf, sh_rr->len + len);
@@ -174,146 +532,556 @@ size_t spockfs_http_body(char *ptr, size_t size, size_t nmemb, void *userdata) {
 size_t spockfs_http_headers(char *ptr, size_t size, size_t nmemb, void *userdata) {
         struct spockfs_http_rr *sh_rr = (struct spockfs_http_rr *) userdata;
         size_t len = size * nmemb;
-	int64_t value = -1;
-	if ((value = spockfs_get_header_num(ptr, len, "X-Spock-size: ", 14)) >= 0) {
-		sh_rr->x_spock_size = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-mode: ", 14)) >= 0) {
-		sh_rr->x_spock_mode = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-uid: ", 13)) >= 0) {
-		sh_rr->x_spock_uid = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-gid: ", 13)) >= 0) {
-		sh_rr->x_spock_gid = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-mtime: ", 15)) >= 0) {
-		sh_rr->x_spock_mtime = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-atime: ", 15)) >= 0) {
-		sh_rr->x_spock_atime = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-ctime: ", 15)) >= 0) {
-		sh_rr->x_spock_ctime = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-nlink: ", 15)) >= 0) {
-		sh_rr->x_spock_nlink = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-blocks: ", 16)) >= 0) {
-		sh_rr->x_spock_blocks = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-dev: ", 13)) >= 0) {
-		sh_rr->x_spock_dev = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-ino: ", 13)) >= 0) {
-		sh_rr->x_spock_ino = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-bsize: ", 15)) >= 0) {
-		sh_rr->x_spock_bsize = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-frsize: ", 16)) >= 0) {
-		sh_rr->x_spock_frsize = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-bfree: ", 15)) >= 0) {
-		sh_rr->x_spock_bfree = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-bavail: ", 16)) >= 0) {
-		sh_rr->x_spock_bavail = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-files: ", 15)) >= 0) {
-		sh_rr->x_spock_files = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-ffree: ", 15)) >= 0) {
-		sh_rr->x_spock_ffree = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-favail: ", 16)) >= 0) {
-		sh_rr->x_spock_favail = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-fsid: ", 14)) >= 0) {
-		sh_rr->x_spock_fsid = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-flag: ", 14)) >= 0) {
-		sh_rr->x_spock_flag = value;
-	} 
-	else if ((value = spockfs_get_header_num(ptr, len, "X-Spock-namemax: ", 17)) >= 0) {
-		sh_rr->x_spock_namemax = value;
-	} 
+	if (len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+		char *value = ptr + 5;
+		char *end = ptr + len;
+		while(value < end && (*value == ' ' || *value == '\t')) value++;
+		while(end > value && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) end--;
+		// too long validators are ignored (no revalidation)
+		if (end > value && end - value < SPOCKFS_ETAG_MAX) {
+			memcpy(sh_rr->etag, value, end - value);
+			sh_rr->etag[end - value] = 0;
+		}
+		return len;
+	}
+	if (len < 10 || strncasecmp(ptr, "X-Spock-", 8)) return len;
+	char *name = ptr + 8;
+	char *colon = memchr(name, ':', len - 8);
+	if (!colon) return len;
+	struct spockfs_header *sh = spockfs_header_find(name, colon - name);
+	if (!sh) return len;
+	uint64_t value;
+	if (spockfs_parse_num(colon + 1, (ptr + len) - (colon + 1), &value)) return len;
+	char *field = ((char *) sh_rr) + sh->offset;
+	if (sh->size == sizeof(uint64_t)) {
+		memcpy(field, &value, sizeof(uint64_t));
+	}
+	else if (sh->size == sizeof(uint32_t)) {
+		uint32_t value32 = value;
+		memcpy(field, &value32, sizeof(uint32_t));
+	}
+	// mode_t on macOS
+	else if (sh->size == sizeof(uint16_t)) {
+		uint16_t value16 = value;
+		memcpy(field, &value16, sizeof(uint16_t));
+	}
         return len;
 }
 
+/*
+	url encoding
+
+	bytes not in the RFC 3986 unreserved set (and not a '/') are percent-encoded. A lookup table
+	tells the safe bytes and the path is encoded in a single pass: arena urls are allocated for
+	the worst case and trimmed after encoding, only the heap ones (cached by open files) are
+	sized exactly before.
+*/
+static uint8_t spockfs_url_safe[256];
+static const char spockfs_url_hex[] = "0123456789ABCDEF";
+
+static void spockfs_url_init() {
+	int c;
+	for(c=0;c<256;c++) {
+		spockfs_url_safe[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '-' || c == '_' || c == '.' || c == '~' || c == '/';
+	}
+}
+
+static size_t spockfs_url_size(const char *path, size_t path_len) {
+	const uint8_t *src = (const uint8_t *) path;
+	size_t i, size = path_len;
+	for(i=0;i<path_len;i++) {
+		if (!spockfs_url_safe[src[i]]) size += 2;
+	}
+	return size;
+}
+
+// dst must be at least spockfs_url_size() bytes, returns the number of bytes written (no final \0)
+static size_t spockfs_url_encode(char *dst, const char *path, size_t path_len) {
+	const uint8_t *src = (const uint8_t *) path;
+	const uint8_t *end = src + path_len;
+	char *ptr = dst;
+	while(src < end) {
+		uint8_t c = *src++;
+		if (spockfs_url_safe[c]) {
+			*ptr++ = c;
+			continue;
+		}
+		*ptr++ = '%';
+		*ptr++ = spockfs_url_hex[c >> 4];
+		*ptr++ = spockfs_url_hex[c & 0x0f];
+	}
+	return ptr - dst;
+}
+
+// base + encoded path, allocated in the arena
 static char *spockfs_prepare_url(const char *base, size_t base_len, const char *path) {
 	size_t path_len = strlen(path);
-	// use two additional bytes for final \0 and for corner-case snprintf
-	size_t url_len = base_len + (path_len * 3) + 2;
-	char *url = malloc(url_len);
+	size_t max_len = base_len + (path_len * 3) + 1;
+	char *url = spockfs_arena_alloc(max_len);
 	if (!url) return NULL;
 	memcpy(url, base, base_len);
-	char *ptr = url + base_len;
-	size_t i;
-	for(i=0;i<path_len;i++) {
-		char c = path[i];
-		if ( (c >= 'a' && c <= 'z') ||
-			(c >= 'A' && c <= 'Z') ||
-			(c >= '0' && c <= '9') ||
-			c == '-' || c == '_' || c == '.' || c =='~' || c == '/') {
-			*ptr++= c;
-		}
-		else {
-			int ret = snprintf(ptr, url_len - (ptr - url), "%%%02X", (uint8_t) c);
-			if (ret != 3) {
-				free(url);
-				return NULL;
-			}
-			ptr+=3;
-		}
-	}
+	size_t len = base_len + spockfs_url_encode(url + base_len, path, path_len);
+	url[len] = 0;
+	spockfs_arena_trim(url, max_len, len + 1);
+	return url;
+}
 
-	// final \0
-	*ptr = 0;
+// set in the background workers (they are not bound to a FUSE request)
+static __thread int spockfs_background;
 
-	return url;
+// the cached url of the open file the current operation works on (NULL if none)
+static char *spockfs_file_url(const char *path);
+
+// the request served by the current FUSE thread (NULL in the other threads)
+static __thread fuse_req_t spockfs_req;
+
+static int spockfs_req_interrupted() {
+	return spockfs_req && fuse_req_interrupted(spockfs_req);
 }
 
-#ifdef CURLOPT_XFERINFOFUNCTION
+#if LIBCURL_VERSION_NUM >= 0x072000
 static int spockfs_interrupted(void *clientp, curl_off_t dltotal,  curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
 #else
 static int spockfs_interrupted(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow) {
 #endif
-	if (fuse_interrupted()) return -1;
+	// transfers driven by the multi engine are cancelled by the waiting thread
+	if (clientp) return *((int *) clientp) ? -1 : 0;
+	if (spockfs_background) return 0;
+	if (spockfs_req_interrupted()) return -1;
 	return 0;
 }
 
-static int spockfs_http(const char *method, const char *path, struct spockfs_http_rr *sh_rr, struct curl_slist *headers) {
-	int ret = -EIO;
-	if (!sh_rr) return ret;
+// monotonic clock in milliseconds
+static uint64_t spockfs_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+	estimation of the link round trip time and bandwidth (exponentially weighted),
+	used for sizing the read-ahead window
+*/
+static struct spockfs_net {
+	pthread_mutex_t lock;
+	double rtt;
+	double bandwidth;
+} spockfs_net = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void spockfs_net_measure(double ttfb, double total, double bytes) {
+	pthread_mutex_lock(&spockfs_net.lock);
+	if (ttfb > 0) {
+		spockfs_net.rtt = spockfs_net.rtt > 0 ? (spockfs_net.rtt * 0.875) + (ttfb * 0.125) : ttfb;
+	}
+	// only big enough transfers give a meaningful bandwidth
+	if (bytes >= 65536 && total > ttfb) {
+		double bw = bytes / (total - ttfb);
+		spockfs_net.bandwidth = spockfs_net.bandwidth > 0 ? (spockfs_net.bandwidth * 0.875) + (bw * 0.125) : bw;
+	}
+	pthread_mutex_unlock(&spockfs_net.lock);
+}
+
+// bandwidth-delay product in bytes
+static size_t spockfs_net_bdp() {
+	pthread_mutex_lock(&spockfs_net.lock);
+	size_t bdp = (size_t) (spockfs_net.rtt * spockfs_net.bandwidth);
+	pthread_mutex_unlock(&spockfs_net.lock);
+	return bdp;
+}
+
+/*
+	get a curl handle from the pool (or create a new one).
+	Handles idle for more than pool_idle seconds are destroyed (with their connections)
+*/
+static CURL *spockfs_curl_get() {
+	CURL *curl = NULL;
+	uint64_t now = spockfs_now();
+	pthread_mutex_lock(&spockfs_config.pool_lock);
+	while(spockfs_config.pool) {
+		struct spockfs_curl *sc = spockfs_config.pool;
+		spockfs_config.pool = sc->next;
+		spockfs_config.pool_count--;
+		if (now - sc->last_used > (uint64_t) spockfs_config.pool_idle * 1000) {
+			curl_easy_cleanup(sc->curl);
+			free(sc);
+			spockfs_stats_inc(pool_expired);
+			continue;
+		}
+		curl = sc->curl;
+		free(sc);
+		break;
+	}
+	pthread_mutex_unlock(&spockfs_config.pool_lock);
+
+	if (curl) {
+		// reset options, but retain live connections and caches
+		curl_easy_reset(curl);
+		spockfs_stats_inc(pool_hits);
+		return curl;
+	}
+
+	spockfs_stats_inc(pool_misses);
+	return curl_easy_init();
+}
+
+// give back a curl handle to the pool (destroy it if the pool is full)
+static void spockfs_curl_put(CURL *curl) {
+	struct spockfs_curl *sc = NULL;
+	if (spockfs_config.pool_count < spockfs_config.pool_size) {
+		sc = malloc(sizeof(struct spockfs_curl));
+	}
+	if (!sc) {
+		curl_easy_cleanup(curl);
+		return;
+	}
+	sc->curl = curl;
+	sc->last_used = spockfs_now();
+	pthread_mutex_lock(&spockfs_config.pool_lock);
+	if (spockfs_config.pool_count >= spockfs_config.pool_size) {
+		pthread_mutex_unlock(&spockfs_config.pool_lock);
+		curl_easy_cleanup(curl);
+		free(sc);
+		return;
+	}
+	sc->next = spockfs_config.pool;
+	spockfs_config.pool = sc;
+	spockfs_config.pool_count++;
+	pthread_mutex_unlock(&spockfs_config.pool_lock);
+}
+
+/*
+	background workers (started in the FUSE init hook, after the daemonization)
+*/
+struct spockfs_job {
+	void (*func)(void *);
+	void *data;
+	struct spockfs_job *next;
+};
 
-	char *url = spockfs_prepare_url(spockfs_config.http_url, spockfs_config.http_url_len, path);
+static struct spockfs_workers {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct spockfs_job *head;
+	struct spockfs_job *tail;
+	unsigned int running;
+} spockfs_workers = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void *spockfs_worker(void *arg) {
+	spockfs_background = 1;
+	for(;;) {
+		pthread_mutex_lock(&spockfs_workers.lock);
+		while(!spockfs_workers.head) {
+			pthread_cond_wait(&spockfs_workers.cond, &spockfs_workers.lock);
+		}
+		struct spockfs_job *job = spockfs_workers.head;
+		spockfs_workers.head = job->next;
+		if (!spockfs_workers.head) spockfs_workers.tail = NULL;
+		pthread_mutex_unlock(&spockfs_workers.lock);
+		job->func(job->data);
+		free(job);
+	}
+	return NULL;
+}
+
+static void spockfs_workers_start() {
+	unsigned int i;
+	for(i=0;i<spockfs_config.workers;i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, spockfs_worker, NULL)) break;
+		pthread_detach(t);
+		spockfs_workers.running++;
+	}
+}
+
+// enqueue a job for the workers, returns -1 if it cannot be accepted
+static int spockfs_job_add(void (*func)(void *), void *data) {
+	if (!spockfs_workers.running) return -1;
+	struct spockfs_job *job = malloc(sizeof(struct spockfs_job));
+	if (!job) return -1;
+	job->func = func;
+	job->data = data;
+	job->next = NULL;
+	pthread_mutex_lock(&spockfs_workers.lock);
+	if (spockfs_workers.tail) {
+		spockfs_workers.tail->next = job;
+	}
+	else {
+		spockfs_workers.head = job;
+	}
+	spockfs_workers.tail = job;
+	pthread_cond_signal(&spockfs_workers.cond);
+	pthread_mutex_unlock(&spockfs_workers.lock);
+	return 0;
+}
+
+#define SPOCKFS_STRIPES_MAX 16
+
+// perform n transfers in parallel with a private multi handle (when the multi engine is not running)
+static void spockfs_perform_local(CURL **curls, CURLcode *res, int n) {
+	int i;
+	CURLM *multi = n > 1 ? curl_multi_init() : NULL;
+	if (!multi) {
+		for(i=0;i<n;i++) {
+			res[i] = curl_easy_perform(curls[i]);
+		}
+		return;
+	}
+	int cancel = 0;
+	for(i=0;i<n;i++) {
+		res[i] = CURLE_FAILED_INIT;
+		curl_easy_setopt(curls[i], CURLOPT_XFERINFODATA, &cancel);
+		curl_multi_add_handle(multi, curls[i]);
+	}
+	for(;;) {
+		int running = 0;
+		curl_multi_perform(multi, &running);
+		CURLMsg *msg;
+		int left = 0;
+		while((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			for(i=0;i<n;i++) {
+				if (curls[i] == msg->easy_handle) res[i] = msg->data.result;
+			}
+		}
+		if (!running) break;
+		curl_multi_wait(multi, NULL, 0, 100, NULL);
+		if (!cancel && !spockfs_background && spockfs_req_interrupted()) cancel = 1;
+	}
+	for(i=0;i<n;i++) {
+		curl_multi_remove_handle(multi, curls[i]);
+	}
+	curl_multi_cleanup(multi);
+}
+
+/*
+	multi engine
+
+	all of the transfers are driven by a single I/O thread through a curl_multi handle
+	(unless -o nomulti is used, or libcurl is older than 7.68): connections are shared by
+	all of the requests and concurrent requests are multiplexed over the same connection
+	when the server (or a proxy in front of it) speaks HTTP/2. With HTTP/1.1 transfers
+	are queued when multi_connections are busy. FUSE threads submit their easy handle and
+	wait for its completion, checking for interruptions: an interrupted transfer is
+	aborted (by the progress callback) at the next run of the I/O thread.
+*/
+#if LIBCURL_VERSION_NUM >= 0x074400
+struct spockfs_xfer {
+	CURL *curl;
+	CURLcode res;
+	int done;
+	int cancel;
+	// shared by the transfers submitted together
+	pthread_cond_t *cond;
+	struct spockfs_xfer *next;
+};
+
+// the clock of the waits for transfers (macOS has no pthread_condattr_setclock())
+#ifdef __APPLE__
+#define SPOCKFS_COND_CLOCK CLOCK_REALTIME
+#else
+#define SPOCKFS_COND_CLOCK CLOCK_MONOTONIC
+#endif
+
+static struct spockfs_multi {
+	CURLM *multi;
+	pthread_mutex_t lock;
+	// submitted transfers, not yet added to the multi handle
+	struct spockfs_xfer *queue;
+	pthread_condattr_t condattr;
+} spockfs_multi = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *spockfs_multi_loop(void *arg) {
+	spockfs_background = 1;
+	for(;;) {
+		pthread_mutex_lock(&spockfs_multi.lock);
+		while(spockfs_multi.queue) {
+			struct spockfs_xfer *x = spockfs_multi.queue;
+			spockfs_multi.queue = x->next;
+			CURLMcode mres = curl_multi_add_handle(spockfs_multi.multi, x->curl);
+			if (mres != CURLM_OK) {
+				x->res = CURLE_FAILED_INIT;
+				x->done = 1;
+				pthread_cond_signal(x->cond);
+			}
+		}
+		pthread_mutex_unlock(&spockfs_multi.lock);
+
+		int running = 0;
+		curl_multi_perform(spockfs_multi.multi, &running);
+
+		CURLMsg *msg;
+		int left = 0;
+		while((msg = curl_multi_info_read(spockfs_multi.multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			CURL *curl = msg->easy_handle;
+			CURLcode res = msg->data.result;
+			char *priv = NULL;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+			curl_multi_remove_handle(spockfs_multi.multi, curl);
+			struct spockfs_xfer *x = (struct spockfs_xfer *) priv;
+			pthread_mutex_lock(&spockfs_multi.lock);
+			x->res = res;
+			x->done = 1;
+			pthread_cond_signal(x->cond);
+			pthread_mutex_unlock(&spockfs_multi.lock);
+		}
+
+		// the timeout allows the progress callbacks to notice cancellations
+		curl_multi_poll(spockfs_multi.multi, NULL, 0, 100, NULL);
+	}
+	return NULL;
+}
+
+static void spockfs_multi_start() {
+	if (spockfs_config.no_multi) return;
+	CURLM *multi = curl_multi_init();
+	if (!multi) return;
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) spockfs_config.multi_connections);
+	pthread_condattr_init(&spockfs_multi.condattr);
+#ifndef __APPLE__
+	pthread_condattr_setclock(&spockfs_multi.condattr, SPOCKFS_COND_CLOCK);
+#endif
+	spockfs_multi.multi = multi;
+	pthread_t t;
+	if (pthread_create(&t, NULL, spockfs_multi_loop, NULL)) {
+		spockfs_multi.multi = NULL;
+		curl_multi_cleanup(multi);
+		return;
+	}
+	pthread_detach(t);
+}
+
+// perform n transfers (at most SPOCKFS_STRIPES_MAX) in parallel
+static void spockfs_perform_many(CURL **curls, CURLcode *res, int n) {
+	if (!spockfs_multi.multi) {
+		spockfs_perform_local(curls, res, n);
+		return;
+	}
+
+	struct spockfs_xfer xs[SPOCKFS_STRIPES_MAX];
+	pthread_cond_t cond;
+	pthread_cond_init(&cond, &spockfs_multi.condattr);
+	int i;
+	for(i=0;i<n;i++) {
+		memset(&xs[i], 0, sizeof(struct spockfs_xfer));
+		xs[i].curl = curls[i];
+		xs[i].cond = &cond;
+		curl_easy_setopt(curls[i], CURLOPT_PRIVATE, (char *) &xs[i]);
+		curl_easy_setopt(curls[i], CURLOPT_XFERINFODATA, &xs[i].cancel);
+		// prefer waiting for a multiplexed connection over opening a new one
+		curl_easy_setopt(curls[i], CURLOPT_PIPEWAIT, 1L);
+	}
+
+	pthread_mutex_lock(&spockfs_multi.lock);
+	for(i=0;i<n;i++) {
+		xs[i].next = spockfs_multi.queue;
+		spockfs_multi.queue = &xs[i];
+	}
+	curl_multi_wakeup(spockfs_multi.multi);
+	int done = 0;
+	while(done < n) {
+		done = 0;
+		for(i=0;i<n;i++) {
+			if (xs[i].done) done++;
+		}
+		if (done == n) break;
+		struct timespec ts;
+		clock_gettime(SPOCKFS_COND_CLOCK, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_cond_timedwait(&cond, &spockfs_multi.lock, &ts);
+		if (!xs[0].cancel && !spockfs_background && spockfs_req_interrupted()) {
+			for(i=0;i<n;i++) xs[i].cancel = 1;
+			curl_multi_wakeup(spockfs_multi.multi);
+		}
+	}
+	pthread_mutex_unlock(&spockfs_multi.lock);
+	pthread_cond_destroy(&cond);
+	for(i=0;i<n;i++) {
+		res[i] = xs[i].res;
+	}
+}
+
+static CURLcode spockfs_perform(CURL *curl) {
+	if (!spockfs_multi.multi) return curl_easy_perform(curl);
+	CURLcode res;
+	spockfs_perform_many(&curl, &res, 1);
+	return res;
+}
+#else
+static void spockfs_multi_start() {
+}
+
+static void spockfs_perform_many(CURL **curls, CURLcode *res, int n) {
+	spockfs_perform_local(curls, res, n);
+}
+
+static CURLcode spockfs_perform(CURL *curl) {
+	return curl_easy_perform(curl);
+}
+#endif
+
+// prepare a (pooled) curl handle for a request, the url must be freed after the transfer
+static CURL *spockfs_http_setup(const char *method, const char *path, struct spockfs_http_rr *sh_rr, struct curl_slist *headers, char **url_p) {
+	char *url = spockfs_file_url(path);
+	if (!url) url = spockfs_prepare_url(spockfs_config.http_url, spockfs_config.http_url_len, path);
 	if (!url) {
-		return -ENOMEM;
+		return NULL;
+	}
+
+	if (sh_rr->body && sh_rr->body_len) {
+		struct curl_slist *body_headers = spockfs_headers_append(NULL, "Content-Type", "application/octet-stream", 24);
+		if (body_headers) body_headers = spockfs_headers_append(body_headers, "Expect", "", 0);
+		if (!body_headers) {
+			spockfs_arena_release(url);
+			return NULL;
+		}
+		// appended to the caller list (freed with it) or owned by the request
+		if (headers) {
+			struct curl_slist *last = headers;
+			while(last->next) last = last->next;
+			last->next = body_headers;
+		}
+		else {
+			headers = sh_rr->headers = body_headers;
+		}
 	}
 
-	CURL *curl = curl_easy_init();
+	CURL *curl = spockfs_curl_get();
 	if (!curl) {
-		free(url);
-		return -ENOMEM;
+		spockfs_arena_release(url);
+		return NULL;
 	}
 
-#ifdef CURLOPT_XFERINFOFUNCTION
+#if LIBCURL_VERSION_NUM >= 0x072000
 	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, spockfs_interrupted);
 #else
 	curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, spockfs_interrupted);
 #endif
 	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-	curl_easy_setopt(curl, CURLOPT_SHARE, spockfs_config.dns_cache);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30);
-	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
+	curl_easy_setopt(curl, CURLOPT_SHARE, spockfs_config.share);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long) spockfs_config.pool_idle);
+#if LIBCURL_VERSION_NUM >= 0x074100
+	// do not reuse connections idle for more than pool_idle seconds
+	curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long) spockfs_config.pool_idle);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	// HTTP/2 over TLS (negotiated with ALPN), HTTP/1.1 otherwise
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#endif
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
 	if (sh_rr->body && sh_rr->body_len) {
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sh_rr->body);
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, sh_rr->body_len);
-		headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
-		headers = curl_slist_append(headers, "Expect: ");
 	}
 	if (headers) {
 		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
@@ -322,8 +1090,16 @@ static int spockfs_http(const char *method, const char *path, struct spockfs_htt
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sh_rr);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, spockfs_http_headers);
 	curl_easy_setopt(curl, CURLOPT_HEADERDATA, sh_rr);
-	CURLcode res = curl_easy_perform(curl);
-	if (res != CURLE_OK) {
+	spockfs_stats_inc(requests);
+	*url_p = url;
+	return curl;
+}
+
+// collect the results of a transfer and give back the handle
+static int spockfs_http_finish(CURL *curl, CURLcode res, struct spockfs_http_rr *sh_rr, char *url) {
+	int ret = -EIO;
+	// a full destination buffer is not an error (but the connection will not be reused)
+	if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && sh_rr->truncated)) {
 		goto end;
 	}
 #ifdef CURLINFO_RESPONSE_CODE
@@ -331,13 +1107,42 @@ static int spockfs_http(const char *method, const char *path, struct spockfs_htt
 #else
 	curl_easy_getinfo(curl, CURLINFO_HTTP_CODE, &sh_rr->code);
 #endif
+	double ttfb = 0, total = 0;
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	spockfs_net_measure(ttfb, total, sh_rr->len);
+	long connects = 0;
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+	if (connects > 0) {
+		spockfs_stats_inc(connections_new);
+	}
+	else {
+		spockfs_stats_inc(connections_reused);
+	}
 	ret = 0;
 end:
-	free(url);
-	curl_easy_cleanup(curl);
+	spockfs_arena_release(url);
+	spockfs_headers_free(sh_rr->headers);
+	sh_rr->headers = NULL;
+	// a failed transfer could have left the connection in a dirty state
+	if (res != CURLE_OK) {
+		curl_easy_cleanup(curl);
+	}
+	else {
+		spockfs_curl_put(curl);
+	}
 	return ret;
 }
 
+static int spockfs_http(const char *method, const char *path, struct spockfs_http_rr *sh_rr, struct curl_slist *headers) {
+	if (!sh_rr) return -EIO;
+	char *url = NULL;
+	CURL *curl = spockfs_http_setup(method, path, sh_rr, headers, &url);
+	if (!curl) return -ENOMEM;
+	CURLcode res = spockfs_perform(curl);
+	return spockfs_http_finish(curl, res, sh_rr, url);
+}
+
 static int spockfs_errno(long code) {
 	switch(code) {
 		case 403:
@@ -367,42 +1172,842 @@ static int spockfs_errno(long code) {
 	return -EIO;
 }
 
-static int spockfs_getattr(const char *path, struct stat *st) {
+/*
+	attributes cache
+
+	GETATTR results are cached by path for attr_ttl seconds. The table is split
+	in SPOCKFS_ATTR_LOCKS stripes, each one with its lock and a generation counter.
+	The generation is bumped at every invalidation, so a GETATTR running in parallel
+	with a local mutation will not store stale values.
+
+	Symlink targets are stored in the same entry and survive attribute refreshes
+	until the inode behind the path changes.
+
+	Expired items are kept (until evicted) along with the ETag got from the server, and
+	revalidated with a conditional GETATTR: a 304 renews them without parsing anything.
+
+	Non-existent paths (404 on GETATTR) are cached too, as "negative" items, with their
+	own (generally shorter) TTL and limit. Creating a name locally invalidates them.
+
+	The limits are hard: every stripe gets its share of them and, when full, evicts its
+	least recently used item (of the same kind when possible).
+*/
+#define SPOCKFS_ATTR_LOCKS 64
+
+struct spockfs_attr {
+	char *path;
+	uint32_t hash;
+	uint64_t expires;
+	int negative;
+	struct stat st;
+	// used for revalidating the attributes when they expire
+	char *etag;
+	char *link;
+	size_t link_len;
+	struct spockfs_attr *next;
+	// the lru list of the stripe (one for positive and one for negative items)
+	struct spockfs_attr *lru_prev;
+	struct spockfs_attr *lru_next;
+};
 
-	spockfs_init();
+struct spockfs_attr_lru {
+	// most recently used first
+	struct spockfs_attr *head;
+	struct spockfs_attr *tail;
+	uint64_t count;
+};
 
-	spockfs_run("GETATTR", NULL);
+static struct spockfs_attr_cache {
+	struct spockfs_attr **buckets;
+	uint32_t mask;
+	uint64_t count;
+	pthread_mutex_t lock[SPOCKFS_ATTR_LOCKS];
+	uint64_t generation[SPOCKFS_ATTR_LOCKS];
+	struct spockfs_attr_lru lru[SPOCKFS_ATTR_LOCKS][2];
+	// the limits of every stripe
+	uint64_t stripe_max;
+	uint64_t negative_stripe_max;
+} spockfs_attr_cache;
+
+static uint32_t spockfs_hash(const char *key, size_t len) {
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	size_t i;
+	for(i=0;i<len;i++) {
+		h ^= (uint8_t) key[i];
+		h *= 16777619;
+	}
+	return h;
+}
 
-	spockfs_check(200);
+static uint64_t spockfs_hash64(const char *key, size_t len) {
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for(i=0;i<len;i++) {
+		h ^= (uint8_t) key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
 
-        ret = 0;
-	st->st_rdev = 0;
-	st->st_blksize = 0;
-	st->st_ino = sh_rr->x_spock_ino;
-	st->st_dev = sh_rr->x_spock_dev;
-	st->st_mode = sh_rr->x_spock_mode;
-	st->st_uid = sh_rr->x_spock_uid;
-	st->st_gid = sh_rr->x_spock_gid;
-	st->st_size = sh_rr->x_spock_size;
-	st->st_mtime = sh_rr->x_spock_mtime;
-	st->st_atime = sh_rr->x_spock_atime;
-	st->st_ctime = sh_rr->x_spock_ctime;
-	st->st_nlink = sh_rr->x_spock_nlink;
-	st->st_blocks = sh_rr->x_spock_blocks;
+static void spockfs_attr_init() {
+	uint32_t buckets = 1024;
+	while(buckets < spockfs_config.attr_cache_size) buckets <<= 1;
+	spockfs_attr_cache.buckets = calloc(buckets, sizeof(struct spockfs_attr *));
+	if (!spockfs_attr_cache.buckets) {
+		// no memory, no party
+		spockfs_config.attr_ttl = 0;
+		spockfs_config.negative_ttl = 0;
+		return;
+	}
+	spockfs_attr_cache.mask = buckets - 1;
+	spockfs_attr_cache.stripe_max = spockfs_config.attr_cache_size / SPOCKFS_ATTR_LOCKS;
+	if (!spockfs_attr_cache.stripe_max && spockfs_config.attr_cache_size) spockfs_attr_cache.stripe_max = 1;
+	spockfs_attr_cache.negative_stripe_max = spockfs_config.negative_cache_size / SPOCKFS_ATTR_LOCKS;
+	if (!spockfs_attr_cache.negative_stripe_max && spockfs_config.negative_cache_size) spockfs_attr_cache.negative_stripe_max = 1;
+	int i;
+	for(i=0;i<SPOCKFS_ATTR_LOCKS;i++) {
+		pthread_mutex_init(&spockfs_attr_cache.lock[i], NULL);
+	}
+}
 
-end:
-	spockfs_free();
+#define spockfs_attr_enabled() (spockfs_attr_cache.buckets)
+
+// the lru functions need the stripe lock
+static void spockfs_attr_lru_unlink(struct spockfs_attr *sa) {
+	struct spockfs_attr_lru *lru = &spockfs_attr_cache.lru[sa->hash % SPOCKFS_ATTR_LOCKS][sa->negative];
+	if (sa->lru_prev) sa->lru_prev->lru_next = sa->lru_next;
+	else lru->head = sa->lru_next;
+	if (sa->lru_next) sa->lru_next->lru_prev = sa->lru_prev;
+	else lru->tail = sa->lru_prev;
+	sa->lru_prev = NULL;
+	sa->lru_next = NULL;
+	lru->count--;
 }
 
-static int spockfs_statfs(const char *path, struct statvfs *vfs) {
+static void spockfs_attr_lru_push(struct spockfs_attr *sa) {
+	struct spockfs_attr_lru *lru = &spockfs_attr_cache.lru[sa->hash % SPOCKFS_ATTR_LOCKS][sa->negative];
+	sa->lru_prev = NULL;
+	sa->lru_next = lru->head;
+	if (lru->head) lru->head->lru_prev = sa;
+	else lru->tail = sa;
+	lru->head = sa;
+	lru->count++;
+}
 
-	spockfs_init();
-        
-        spockfs_run("STATFS", NULL);
+static void spockfs_attr_destroy(struct spockfs_attr *sa) {
+	spockfs_attr_lru_unlink(sa);
+	if (sa->negative) __sync_fetch_and_sub(&spockfs_stats.negative_entries, 1);
+	if (sa->link) free(sa->link);
+	if (sa->etag) free(sa->etag);
+	free(sa->path);
+	free(sa);
+	__sync_fetch_and_sub(&spockfs_attr_cache.count, 1);
+}
 
-	spockfs_check(200);
+// find an item (the stripe lock must be held)
+static struct spockfs_attr **spockfs_attr_find(const char *path, uint32_t hash) {
+	struct spockfs_attr **sa = &spockfs_attr_cache.buckets[hash & spockfs_attr_cache.mask];
+	while(*sa) {
+		if ((*sa)->hash == hash && !strcmp((*sa)->path, path)) return sa;
+		sa = &(*sa)->next;
+	}
+	return sa;
+}
 
-        ret = 0;
+// drop the least recently used item of a kind from a stripe (its lock must be held)
+static int spockfs_attr_evict(uint32_t stripe, int negative) {
+	struct spockfs_attr *sa = spockfs_attr_cache.lru[stripe][negative].tail;
+	if (!sa) return -1;
+	struct spockfs_attr **slot = spockfs_attr_find(sa->path, sa->hash);
+	*slot = sa->next;
+	spockfs_attr_destroy(sa);
+	return 0;
+}
+
+/*
+	returns 0 on hit (filling st), -ENOENT on negative hit, -1 on miss.
+	On miss, gen is filled with the stripe generation to pass to spockfs_attr_set(), and
+	if etag is not NULL and the attributes are only expired, they are copied in st and
+	their ETag in etag (at least SPOCKFS_ETAG_MAX bytes), otherwise etag is emptied
+*/
+static int spockfs_attr_get(const char *path, struct stat *st, uint64_t *gen, char *etag) {
+	if (etag) etag[0] = 0;
+	if (!spockfs_attr_enabled()) return -1;
+	int ret = -1;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	uint32_t stripe = hash % SPOCKFS_ATTR_LOCKS;
+	pthread_mutex_lock(&spockfs_attr_cache.lock[stripe]);
+	struct spockfs_attr *sa = *spockfs_attr_find(path, hash);
+	if (sa) {
+		spockfs_attr_lru_unlink(sa);
+		spockfs_attr_lru_push(sa);
+	}
+	if (sa && sa->expires > spockfs_now()) {
+		if (sa->negative) {
+			ret = -ENOENT;
+		}
+		else {
+			memcpy(st, &sa->st, sizeof(struct stat));
+			ret = 0;
+		}
+	}
+	else if (sa && !sa->negative && sa->etag && etag) {
+		memcpy(st, &sa->st, sizeof(struct stat));
+		strcpy(etag, sa->etag);
+	}
+	*gen = spockfs_attr_cache.generation[stripe];
+	pthread_mutex_unlock(&spockfs_attr_cache.lock[stripe]);
+	if (ret == -1) {
+		spockfs_stats_inc(attr_misses);
+	}
+	else if (ret) {
+		spockfs_stats_inc(negative_hits);
+	}
+	else {
+		spockfs_stats_inc(attr_hits);
+	}
+	return ret;
+}
+
+// store attributes (or a negative item when st is NULL) with their ETag (if known)
+static void spockfs_attr_set(const char *path, struct stat *st, uint64_t gen, const char *etag) {
+	if (!spockfs_attr_enabled()) return;
+	double ttl = st ? spockfs_config.attr_ttl : spockfs_config.negative_ttl;
+	if (ttl <= 0) return;
+	size_t path_len = strlen(path);
+	uint32_t hash = spockfs_hash(path, path_len);
+	uint32_t stripe = hash % SPOCKFS_ATTR_LOCKS;
+	uint64_t now = spockfs_now();
+	pthread_mutex_lock(&spockfs_attr_cache.lock[stripe]);
+	// something changed in the mean time
+	if (spockfs_attr_cache.generation[stripe] != gen) goto end;
+	struct spockfs_attr *sa = *spockfs_attr_find(path, hash);
+	if (sa) {
+		// the symlink target is valid only for the same inode
+		if (sa->link && (!st || sa->st.st_ino != st->st_ino || sa->st.st_ctime != st->st_ctime)) {
+			free(sa->link);
+			sa->link = NULL;
+		}
+		spockfs_attr_lru_unlink(sa);
+		if (sa->negative && st) {
+			__sync_fetch_and_sub(&spockfs_stats.negative_entries, 1);
+		}
+		else if (!sa->negative && !st) {
+			// make room for another negative item
+			if (spockfs_attr_cache.lru[stripe][1].count >= spockfs_attr_cache.negative_stripe_max &&
+				spockfs_attr_evict(stripe, 1)) {
+				*spockfs_attr_find(path, hash) = sa->next;
+				spockfs_attr_lru_push(sa);
+				spockfs_attr_destroy(sa);
+				goto end;
+			}
+			__sync_fetch_and_add(&spockfs_stats.negative_entries, 1);
+		}
+	}
+	else {
+		// full ? drop the least recently used items of the stripe
+		if (!st && spockfs_attr_cache.lru[stripe][1].count >= spockfs_attr_cache.negative_stripe_max) {
+			if (spockfs_attr_evict(stripe, 1)) goto end;
+		}
+		if (spockfs_attr_cache.lru[stripe][0].count + spockfs_attr_cache.lru[stripe][1].count >= spockfs_attr_cache.stripe_max) {
+			// items of the same kind first
+			if (spockfs_attr_evict(stripe, !st) && spockfs_attr_evict(stripe, !!st)) goto end;
+		}
+		sa = calloc(1, sizeof(struct spockfs_attr));
+		if (!sa) goto end;
+		sa->path = malloc(path_len + 1);
+		if (!sa->path) {
+			free(sa);
+			goto end;
+		}
+		memcpy(sa->path, path, path_len + 1);
+		sa->hash = hash;
+		struct spockfs_attr **bucket = &spockfs_attr_cache.buckets[hash & spockfs_attr_cache.mask];
+		// new items at the head of the bucket
+		sa->next = *bucket;
+		*bucket = sa;
+		__sync_fetch_and_add(&spockfs_attr_cache.count, 1);
+		if (!st) __sync_fetch_and_add(&spockfs_stats.negative_entries, 1);
+	}
+	sa->negative = !st;
+	spockfs_attr_lru_push(sa);
+	if (st) {
+		memcpy(&sa->st, st, sizeof(struct stat));
+	}
+	if (!sa->etag || !etag || strcmp(sa->etag, etag)) {
+		if (sa->etag) free(sa->etag);
+		sa->etag = (st && etag) ? strdup(etag) : NULL;
+	}
+	sa->expires = now + (uint64_t) (ttl * 1000);
+end:
+	pthread_mutex_unlock(&spockfs_attr_cache.lock[stripe]);
+}
+
+// snapshot the generations of all the stripes (for requests returning attributes of multiple items)
+static void spockfs_attr_generations(uint64_t *gens) {
+	if (!spockfs_attr_enabled()) return;
+	int i;
+	for(i=0;i<SPOCKFS_ATTR_LOCKS;i++) {
+		pthread_mutex_lock(&spockfs_attr_cache.lock[i]);
+		gens[i] = spockfs_attr_cache.generation[i];
+		pthread_mutex_unlock(&spockfs_attr_cache.lock[i]);
+	}
+}
+
+#define spockfs_attr_stripe(path) (spockfs_hash(path, strlen(path)) % SPOCKFS_ATTR_LOCKS)
+
+// copy the cached symlink target (if any) in buf (of size len, always > 0)
+static int spockfs_attr_get_link(const char *path, char *buf, size_t len) {
+	if (!spockfs_attr_enabled()) return -1;
+	int ret = -1;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	uint32_t stripe = hash % SPOCKFS_ATTR_LOCKS;
+	pthread_mutex_lock(&spockfs_attr_cache.lock[stripe]);
+	struct spockfs_attr *sa = *spockfs_attr_find(path, hash);
+	if (sa && sa->link) {
+		size_t link_len = sa->link_len >= len ? len - 1 : sa->link_len;
+		memcpy(buf, sa->link, link_len);
+		buf[link_len] = 0;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&spockfs_attr_cache.lock[stripe]);
+	if (ret) {
+		spockfs_stats_inc(readlink_misses);
+	}
+	else {
+		spockfs_stats_inc(readlink_hits);
+	}
+	return ret;
+}
+
+// attach a symlink target to an already cached item
+static void spockfs_attr_set_link(const char *path, const char *link, size_t link_len) {
+	if (!spockfs_attr_enabled()) return;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	uint32_t stripe = hash % SPOCKFS_ATTR_LOCKS;
+	pthread_mutex_lock(&spockfs_attr_cache.lock[stripe]);
+	struct spockfs_attr *sa = *spockfs_attr_find(path, hash);
+	if (sa && !sa->negative && !sa->link && S_ISLNK(sa->st.st_mode)) {
+		sa->link = malloc(link_len);
+		if (sa->link) {
+			memcpy(sa->link, link, link_len);
+			sa->link_len = link_len;
+		}
+	}
+	pthread_mutex_unlock(&spockfs_attr_cache.lock[stripe]);
+}
+
+// defined with the single-flight code
+static void spockfs_shared_invalidate(const char *path);
+
+static void spockfs_attr_invalidate(const char *path) {
+	spockfs_shared_invalidate(path);
+	if (!spockfs_attr_enabled()) return;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	uint32_t stripe = hash % SPOCKFS_ATTR_LOCKS;
+	pthread_mutex_lock(&spockfs_attr_cache.lock[stripe]);
+	spockfs_attr_cache.generation[stripe]++;
+	struct spockfs_attr **slot = spockfs_attr_find(path, hash);
+	struct spockfs_attr *sa = *slot;
+	if (sa) {
+		*slot = sa->next;
+		spockfs_attr_destroy(sa);
+	}
+	pthread_mutex_unlock(&spockfs_attr_cache.lock[stripe]);
+}
+
+// invalidate the parent directory (its mtime and nlink change when items are added/removed)
+static void spockfs_attr_invalidate_parent(const char *path) {
+	if (!spockfs_attr_enabled()) return;
+	char *slash = strrchr(path, '/');
+	if (!slash) return;
+	if (slash == path) {
+		spockfs_attr_invalidate("/");
+		return;
+	}
+	size_t len = slash - path;
+	char *parent = malloc(len + 1);
+	if (!parent) return;
+	memcpy(parent, path, len);
+	parent[len] = 0;
+	spockfs_attr_invalidate(parent);
+	free(parent);
+}
+
+// invalidate an item and all of the items below it (used for directories renames/removals)
+static void spockfs_attr_invalidate_tree(const char *path) {
+	spockfs_shared_invalidate(path);
+	if (!spockfs_attr_enabled()) return;
+	size_t path_len = strlen(path);
+	uint32_t i;
+	for(i=0;i<SPOCKFS_ATTR_LOCKS;i++) {
+		pthread_mutex_lock(&spockfs_attr_cache.lock[i]);
+		spockfs_attr_cache.generation[i]++;
+	}
+	for(i=0;i<=spockfs_attr_cache.mask;i++) {
+		struct spockfs_attr **slot = &spockfs_attr_cache.buckets[i];
+		while(*slot) {
+			struct spockfs_attr *sa = *slot;
+			if (!strncmp(sa->path, path, path_len) && (sa->path[path_len] == 0 || sa->path[path_len] == '/' || path_len == 1)) {
+				*slot = sa->next;
+				spockfs_attr_destroy(sa);
+				continue;
+			}
+			slot = &sa->next;
+		}
+	}
+	for(i=0;i<SPOCKFS_ATTR_LOCKS;i++) {
+		pthread_mutex_unlock(&spockfs_attr_cache.lock[i]);
+	}
+}
+
+/*
+	single-flight
+
+	concurrent identical idempotent requests (same method, path and range) share a single
+	HTTP transaction: the first one (the leader) performs it, the others wait for its
+	response and get a copy of it. The leader keeps its response alive until all of the
+	waiters copied it. A transaction failed at the transport level (code 0) is not shared,
+	every waiter performs its own request.
+
+	Local changes detach the transactions in progress for the path, so requests issued
+	after a change never get a response generated before it.
+*/
+#define SPOCKFS_FLIGHTS 256
+
+struct spockfs_flight {
+	const char *method;
+	char *path;
+	uint64_t from;
+	uint64_t to;
+	int done;
+	// still in the table (joinable)
+	int linked;
+	unsigned int waiters;
+	struct spockfs_http_rr *sh_rr;
+	pthread_cond_t cond;
+	struct spockfs_flight *next;
+};
+
+static struct spockfs_flights {
+	pthread_mutex_t lock;
+	struct spockfs_flight *buckets[SPOCKFS_FLIGHTS];
+} spockfs_flights = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// copy the response of the leader (the data goes to dst when the waiter set it)
+static int spockfs_rr_copy(struct spockfs_http_rr *to, struct spockfs_http_rr *from) {
+	char *dst = to->dst;
+	size_t dst_len = to->dst_len;
+	const char *body = to->body;
+	size_t body_len = to->body_len;
+	const char *data = from->dst ? from->dst : from->buf;
+	size_t len = from->len;
+
+	*to = *from;
+	to->dst = dst;
+	to->dst_len = dst_len;
+	to->body = body;
+	to->body_len = body_len;
+	to->buf = NULL;
+	to->len = 0;
+	if (!data || !len) return 0;
+
+	if (dst) {
+		if (len > dst_len) len = dst_len;
+		memcpy(dst, data, len);
+		to->len = len;
+		return 0;
+	}
+	to->buf = malloc(len);
+	if (!to->buf) return -1;
+	memcpy(to->buf, data, len);
+	to->len = len;
+	return 0;
+}
+
+/*
+	join the transaction (method, path, from, to) in progress: returns 1 if sh_rr has been
+	filled with its response, 0 if the caller must perform the request and then pass
+	the response to spockfs_shared_done()
+*/
+static int spockfs_shared(const char *method, const char *path, uint64_t from, uint64_t to, struct spockfs_http_rr *sh_rr, struct spockfs_flight **leader) {
+	*leader = NULL;
+	uint32_t slot = spockfs_hash(path, strlen(path)) % SPOCKFS_FLIGHTS;
+	pthread_mutex_lock(&spockfs_flights.lock);
+	struct spockfs_flight *flight = spockfs_flights.buckets[slot];
+	while(flight) {
+		if (flight->from == from && flight->to == to && !strcmp(flight->method, method) && !strcmp(flight->path, path)) break;
+		flight = flight->next;
+	}
+
+	if (flight) {
+		flight->waiters++;
+		while(!flight->done) pthread_cond_wait(&flight->cond, &spockfs_flights.lock);
+		int shared = flight->sh_rr->code && !spockfs_rr_copy(sh_rr, flight->sh_rr);
+		flight->waiters--;
+		if (!flight->waiters) pthread_cond_broadcast(&flight->cond);
+		pthread_mutex_unlock(&spockfs_flights.lock);
+		if (shared) spockfs_stats_inc(shared_requests);
+		return shared;
+	}
+
+	// become the leader (without an entry the request is simply not shared)
+	flight = calloc(1, sizeof(struct spockfs_flight));
+	if (flight) {
+		flight->path = strdup(path);
+		if (!flight->path) {
+			free(flight);
+			flight = NULL;
+		}
+	}
+	if (flight) {
+		flight->method = method;
+		flight->from = from;
+		flight->to = to;
+		flight->linked = 1;
+		pthread_cond_init(&flight->cond, NULL);
+		flight->next = spockfs_flights.buckets[slot];
+		spockfs_flights.buckets[slot] = flight;
+		*leader = flight;
+	}
+	pthread_mutex_unlock(&spockfs_flights.lock);
+	return 0;
+}
+
+// publish the response of the leader to the waiters (it must stay valid until the function returns)
+static void spockfs_shared_done(struct spockfs_flight *flight, struct spockfs_http_rr *sh_rr) {
+	if (!flight) return;
+	uint32_t slot = spockfs_hash(flight->path, strlen(flight->path)) % SPOCKFS_FLIGHTS;
+	pthread_mutex_lock(&spockfs_flights.lock);
+	// new requests from now on start a new transaction
+	if (flight->linked) {
+		struct spockfs_flight **prev = &spockfs_flights.buckets[slot];
+		while(*prev != flight) prev = &(*prev)->next;
+		*prev = flight->next;
+	}
+	flight->sh_rr = sh_rr;
+	flight->done = 1;
+	pthread_cond_broadcast(&flight->cond);
+	while(flight->waiters) pthread_cond_wait(&flight->cond, &spockfs_flights.lock);
+	pthread_mutex_unlock(&spockfs_flights.lock);
+	pthread_cond_destroy(&flight->cond);
+	free(flight->path);
+	free(flight);
+}
+
+static void spockfs_shared_invalidate(const char *path) {
+	uint32_t slot = spockfs_hash(path, strlen(path)) % SPOCKFS_FLIGHTS;
+	pthread_mutex_lock(&spockfs_flights.lock);
+	struct spockfs_flight **prev = &spockfs_flights.buckets[slot];
+	while(*prev) {
+		struct spockfs_flight *flight = *prev;
+		if (!strcmp(flight->path, path)) {
+			*prev = flight->next;
+			flight->linked = 0;
+			continue;
+		}
+		prev = &flight->next;
+	}
+	pthread_mutex_unlock(&spockfs_flights.lock);
+}
+
+/*
+	batching
+
+	metadata operations are sent as usual while less than batch_inflight of them are
+	running, the others are queued and the first of the queue sends all of them (up to
+	batch_max) in a single BATCH request as soon as a slot is free (group commit).
+	Queued operations come from concurrent syscalls, so they are independent, and the
+	server executes them in order anyway. Servers without BATCH (405) disable it.
+*/
+struct spockfs_bop {
+	char *line;
+	size_t len;
+	// the caller holds an inflight slot
+	int slot;
+	int done;
+	long code;
+	struct stat st;
+	struct spockfs_bop *next;
+};
+
+static struct spockfs_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int inflight;
+	struct spockfs_bop *head;
+	struct spockfs_bop *tail;
+	int unsupported;
+} spockfs_batch = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// parse the attributes of an object (as sent by READDIRPLUS and BATCH), returns what follows them
+static char *spockfs_attrs_parse(char *line, struct stat *st) {
+	int64_t values[11];
+	char *ptr = line;
+	int i;
+	for(i=0;i<11;i++) {
+		char *end = NULL;
+		values[i] = strtoll(ptr, &end, 10);
+		if (end == ptr || *end != ' ') return NULL;
+		ptr = end + 1;
+	}
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = values[0];
+	st->st_uid = values[1];
+	st->st_gid = values[2];
+	st->st_size = values[3];
+	st->st_mtime = values[4];
+	st->st_atime = values[5];
+	st->st_ctime = values[6];
+	st->st_nlink = values[7];
+	st->st_blocks = values[8];
+	st->st_dev = values[9];
+	st->st_ino = values[10];
+	return ptr;
+}
+
+// send a list of operations in a single BATCH request (codes set to 0 ask the callers to retry them alone)
+static void spockfs_batch_send(struct spockfs_bop *list, unsigned int n) {
+	struct spockfs_bop *bop;
+	size_t body_len = 0;
+	for(bop=list;bop;bop=bop->next) body_len += bop->len;
+	long code = 500;
+	size_t mark = spockfs_arena_mark();
+	char *body = malloc(body_len);
+	struct spockfs_http_rr *sh_rr = spockfs_arena_calloc(sizeof(struct spockfs_http_rr));
+	struct curl_slist *headers = spockfs_add_header_num(NULL, "count", n);
+	if (!body || !sh_rr || !headers) goto end;
+	char *ptr = body;
+	for(bop=list;bop;bop=bop->next) {
+		memcpy(ptr, bop->line, bop->len);
+		ptr += bop->len;
+	}
+	sh_rr->body = body;
+	sh_rr->body_len = body_len;
+	spockfs_stats_inc(batches);
+	if (spockfs_http("BATCH", "/", sh_rr, headers)) goto end;
+	if (sh_rr->code == 405) {
+		spockfs_batch.unsupported = 1;
+		code = 0;
+		goto end;
+	}
+	if (sh_rr->code != 200) goto end;
+
+	// one line per operation: <status>[ <attrs>]
+	bop = list;
+	size_t i;
+	char *base = sh_rr->buf;
+	for(i=0;i<sh_rr->len && bop;i++) {
+		if (sh_rr->buf[i] != '\n') continue;
+		sh_rr->buf[i] = 0;
+		char *end = NULL;
+		bop->code = strtol(base, &end, 10);
+		if (end == base) bop->code = 500;
+		if (bop->code == 200 && *end == ' ' && !spockfs_attrs_parse(end + 1, &bop->st)) bop->code = 500;
+		base = sh_rr->buf + i + 1;
+		bop->done = 1;
+		bop = bop->next;
+	}
+end:
+	for(bop=list;bop;bop=bop->next) {
+		if (!bop->done) bop->code = code;
+	}
+	spockfs_headers_free(headers);
+	if (sh_rr) {
+		if (sh_rr->buf) free(sh_rr->buf);
+		spockfs_arena_release(sh_rr);
+	}
+	if (body) free(body);
+	spockfs_arena_rewind(mark);
+}
+
+/*
+	try to perform an operation (with nargs numeric arguments and an optional target)
+	in a batch: returns 1 if done (filling sh_rr->code and, for GETATTR, the attributes),
+	0 if the caller must perform it (and then call spockfs_batch_leave())
+*/
+static int spockfs_batched(struct spockfs_bop *bop, struct spockfs_http_rr *sh_rr, const char *method, const char *path, const char *target, int nargs, int64_t a0, int64_t a1) {
+	memset(bop, 0, sizeof(struct spockfs_bop));
+	if (!spockfs_config.batch_max || spockfs_batch.unsupported) return 0;
+
+	pthread_mutex_lock(&spockfs_batch.lock);
+	if (spockfs_batch.inflight < spockfs_config.batch_inflight) {
+		spockfs_batch.inflight++;
+		bop->slot = 1;
+		pthread_mutex_unlock(&spockfs_batch.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&spockfs_batch.lock);
+
+	// METHOD <path>[ <target>][ <a0>[ <a1>]]\n
+	char *e_path = spockfs_prepare_url("", 0, path);
+	char *e_target = target ? spockfs_prepare_url("", 0, target) : NULL;
+	if (!e_path || (target && !e_target)) goto error;
+	size_t len = strlen(method) + strlen(e_path) + (e_target ? strlen(e_target) : 0) + (2 * 24) + 5;
+	bop->line = spockfs_arena_alloc(len);
+	if (!bop->line) goto error;
+	int ret = snprintf(bop->line, len, "%s %s%s%s", method, e_path, e_target ? " " : "", e_target ? e_target : "");
+	if (ret > 0 && nargs > 0) ret += snprintf(bop->line + ret, len - ret, " %lld", (long long) a0);
+	if (ret > 0 && nargs > 1) ret += snprintf(bop->line + ret, len - ret, " %lld", (long long) a1);
+	if (ret <= 0 || (size_t) ret + 1 >= len) goto error;
+	bop->line[ret++] = '\n';
+	bop->len = ret;
+	spockfs_arena_release(e_path);
+	if (e_target) spockfs_arena_release(e_target);
+
+	pthread_mutex_lock(&spockfs_batch.lock);
+	if (spockfs_batch.tail) {
+		spockfs_batch.tail->next = bop;
+	}
+	else {
+		spockfs_batch.head = bop;
+	}
+	spockfs_batch.tail = bop;
+	while(!bop->done) {
+		if (spockfs_batch.head == bop && spockfs_batch.inflight < spockfs_config.batch_inflight) {
+			// take the queue (up to batch_max operations) and send it
+			spockfs_batch.inflight++;
+			struct spockfs_bop *list = spockfs_batch.head;
+			struct spockfs_bop *last = list;
+			unsigned int n = 1;
+			while(last->next && n < spockfs_config.batch_max) {
+				last = last->next;
+				n++;
+			}
+			spockfs_batch.head = last->next;
+			if (!spockfs_batch.head) spockfs_batch.tail = NULL;
+			last->next = NULL;
+			pthread_mutex_unlock(&spockfs_batch.lock);
+			spockfs_batch_send(list, n);
+			pthread_mutex_lock(&spockfs_batch.lock);
+			while(list) {
+				struct spockfs_bop *next = list->next;
+				list->done = 1;
+				list = next;
+			}
+			spockfs_batch.inflight--;
+			pthread_cond_broadcast(&spockfs_batch.cond);
+			continue;
+		}
+		pthread_cond_wait(&spockfs_batch.cond, &spockfs_batch.lock);
+	}
+	pthread_mutex_unlock(&spockfs_batch.lock);
+	spockfs_arena_release(bop->line);
+	bop->line = NULL;
+
+	// the server does not support BATCH
+	if (!bop->code) return 0;
+
+	spockfs_stats_inc(batched_ops);
+	sh_rr->code = bop->code;
+	sh_rr->x_spock_mode = bop->st.st_mode;
+	sh_rr->x_spock_uid = bop->st.st_uid;
+	sh_rr->x_spock_gid = bop->st.st_gid;
+	sh_rr->x_spock_size = bop->st.st_size;
+	sh_rr->x_spock_mtime = bop->st.st_mtime;
+	sh_rr->x_spock_atime = bop->st.st_atime;
+	sh_rr->x_spock_ctime = bop->st.st_ctime;
+	sh_rr->x_spock_nlink = bop->st.st_nlink;
+	sh_rr->x_spock_blocks = bop->st.st_blocks;
+	sh_rr->x_spock_dev = bop->st.st_dev;
+	sh_rr->x_spock_ino = bop->st.st_ino;
+	return 1;
+
+error:
+	if (e_path) spockfs_arena_release(e_path);
+	if (e_target) spockfs_arena_release(e_target);
+	if (bop->line) spockfs_arena_release(bop->line);
+	bop->line = NULL;
+	return 0;
+}
+
+static void spockfs_batch_leave(struct spockfs_bop *bop) {
+	if (!bop->slot) return;
+	pthread_mutex_lock(&spockfs_batch.lock);
+	spockfs_batch.inflight--;
+	pthread_cond_broadcast(&spockfs_batch.cond);
+	pthread_mutex_unlock(&spockfs_batch.lock);
+	bop->slot = 0;
+}
+
+// defined with the write-back code
+static void spockfs_files_flush(const char *path, uint64_t older);
+
+static int spockfs_getattr(const char *path, struct stat *st) {
+
+	// cleaned up at the end, even when building the headers fails
+	struct spockfs_flight *flight = NULL;
+	struct spockfs_bop bop = { .slot = 0 };
+
+	// size and mtime must reflect the dirty data
+	spockfs_files_flush(path, 0);
+
+	uint64_t gen = 0;
+	char etag[SPOCKFS_ETAG_MAX];
+	int cached = spockfs_attr_get(path, st, &gen, etag);
+	if (cached != -1) return cached;
+
+	spockfs_init2();
+
+	// expired attributes are revalidated (requests for different ETags are not shared)
+	uint64_t version = 0;
+	if (etag[0]) {
+		spockfs_header_etag("If-None-Match", etag);
+		version = spockfs_hash64(etag, strlen(etag));
+	}
+
+	if (!spockfs_shared("GETATTR", path, version, 0, sh_rr, &flight) && !spockfs_batched(&bop, sh_rr, "GETATTR", path, NULL, 0, 0, 0)) {
+		spockfs_run("GETATTR", headers);
+	}
+
+	if (sh_rr->code == 404) {
+		spockfs_attr_set(path, NULL, gen, NULL);
+	}
+
+	// still valid, st already contains the attributes
+	if (sh_rr->code == 304 && etag[0]) {
+		spockfs_stats_inc(attr_revalidated);
+		spockfs_attr_set(path, st, gen, etag);
+		ret = 0;
+		goto end;
+	}
+
+	spockfs_check(200);
+
+        ret = 0;
+	st->st_rdev = 0;
+	st->st_blksize = 0;
+	st->st_ino = sh_rr->x_spock_ino;
+	st->st_dev = sh_rr->x_spock_dev;
+	st->st_mode = sh_rr->x_spock_mode;
+	st->st_uid = sh_rr->x_spock_uid;
+	st->st_gid = sh_rr->x_spock_gid;
+	st->st_size = sh_rr->x_spock_size;
+	st->st_mtime = sh_rr->x_spock_mtime;
+	st->st_atime = sh_rr->x_spock_atime;
+	st->st_ctime = sh_rr->x_spock_ctime;
+	st->st_nlink = sh_rr->x_spock_nlink;
+	st->st_blocks = sh_rr->x_spock_blocks;
+
+	spockfs_attr_set(path, st, gen, sh_rr->etag[0] ? sh_rr->etag : NULL);
+
+end:
+	spockfs_shared_done(flight, sh_rr);
+	spockfs_batch_leave(&bop);
+	spockfs_free2();
+}
+
+static int spockfs_statfs(const char *path, struct statvfs *vfs) {
+
+	spockfs_init();
+        
+        spockfs_run("STATFS", NULL);
+
+	spockfs_check(200);
+
+        ret = 0;
         vfs->f_bsize = sh_rr->x_spock_bsize;
         vfs->f_frsize = sh_rr->x_spock_frsize;
         vfs->f_blocks = sh_rr->x_spock_blocks;
@@ -419,11 +2024,89 @@ end:
 	spockfs_free();
 }
 
-static int spockfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+// called for every item of a directory (st is NULL when the attributes are not known)
+typedef int (*spockfs_fill_t)(void *buf, const char *name, const struct stat *st);
+
+/*
+	directories are listed in pages of readdir_page items: *cookie is where the page starts
+	(0 for the first one) and it is set to the start of the next page (0 after the last one).
+	Servers not supporting pagination return the whole listing in the first page.
+*/
+static int spockfs_readdir_page(struct curl_slist **headers, uint64_t cookie) {
+	if (!spockfs_config.readdir_page) return 0;
+	*headers = spockfs_add_header_num(NULL, "count", spockfs_config.readdir_page);
+	if (!*headers) return -ENOMEM;
+	if (cookie) {
+		*headers = spockfs_add_header_num(*headers, "cookie", cookie);
+		if (!*headers) return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+	READDIRPLUS returns the attributes of every item, they are passed to FUSE
+	and used to fill the attributes cache (avoiding a GETATTR for each item)
+*/
+static int spockfs_readdirplus(const char *path, uint64_t *cookie, void *buf, spockfs_fill_t filler) {
 
-	spockfs_init();
+	uint64_t gens[SPOCKFS_ATTR_LOCKS];
+	spockfs_attr_generations(gens);
+
+	spockfs_init2();
+
+	if ((ret = spockfs_readdir_page(&headers, *cookie))) goto end;
+
+	spockfs_run("READDIRPLUS", headers);
+
+	if (sh_rr->code == 405) {
+		// the server does not support it, do not try again
+		spockfs_config.no_readdirplus = 1;
+	}
+
+	spockfs_check(200);
+
+	size_t path_len = strlen(path);
+	// skip the slash for the root
+	if (path_len == 1) path_len = 0;
+	char item[PATH_MAX+1];
+	memcpy(item, path, path_len);
+	item[path_len] = '/';
+
+	size_t i, len = sh_rr->len;
+	char *base = sh_rr->buf;
+	for(i=0;i<len;i++) {
+		if (sh_rr->buf[i] == '\n') {
+			sh_rr->buf[i] = 0;
+			struct stat st;
+			char *name = spockfs_attrs_parse(base, &st);
+			base = sh_rr->buf + i + 1;
+			if (!name || !*name) continue;
+			if (filler(buf, name, &st)) break;
+			if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+			size_t name_len = strlen(name);
+			if (path_len + 1 + name_len > PATH_MAX) continue;
+			memcpy(item + path_len + 1, name, name_len + 1);
+			spockfs_attr_set(item, &st, gens[spockfs_attr_stripe(item)], NULL);
+		}
+	}
+	*cookie = sh_rr->x_spock_cookie;
+	ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_readdir(const char *path, uint64_t *cookie, void *buf, spockfs_fill_t filler) {
+
+	if (!spockfs_config.no_readdirplus) {
+		int plus_ret = spockfs_readdirplus(path, cookie, buf, filler);
+		if (plus_ret != -ENOSYS) return plus_ret;
+	}
+
+	spockfs_init2();
 
-        spockfs_run("READDIR", NULL);
+	if ((ret = spockfs_readdir_page(&headers, *cookie))) goto end;
+
+        spockfs_run("READDIR", headers);
 
         spockfs_check(200);
 
@@ -433,454 +2116,3453 @@ static int spockfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	for(i=0;i<len;i++) {
 		if (sh_rr->buf[i] == '\n') {
 			sh_rr->buf[i] = 0;
-			filler(buf, base, NULL, 0);
+			if (filler(buf, base, NULL)) break;
 			base = sh_rr->buf + i + 1;
 			continue;
 		}
 	}
+	*cookie = sh_rr->x_spock_cookie;
 	ret = 0;
 end:
-	spockfs_free();
+	spockfs_free2();
 }
 
-static int spockfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+/*
+	block cache
+
+	file data is cached in memory in blocks of SPOCKFS_BLOCK_SIZE bytes (up to cache_size
+	bytes). Blocks are grouped by object (path) and tagged with the version (the hash of
+	its ETag, or its mtime with servers not sending it) and size the object had when the
+	file was opened (close-to-open consistency): a handle opened after
+	a change made by another client drops the stale blocks. Local changes immediately drop
+	the blocks of the involved objects.
+
+	Eviction follows the 2Q policy: new blocks enter a FIFO (a1in, 1/4 of the cache) and are
+	promoted to the LRU (am) only when requested again after their eviction from the FIFO
+	(their keys are remembered in the a1out ghost list), so a single scan of a big file
+	does not wipe the working set.
+*/
+#define SPOCKFS_BLOCK_SIZE (128 * 1024)
+
+#define SPOCKFS_Q_A1IN 0
+#define SPOCKFS_Q_AM 1
+#define SPOCKFS_Q_A1OUT 2
+
+struct spockfs_cobj;
+
+struct spockfs_block {
+	// NULL for ghosts (they have no data)
+	struct spockfs_cobj *obj;
+	uint32_t hash;
+	uint64_t index;
+	int queue;
+	char *buf;
+	size_t len;
+	struct spockfs_block *hnext;
+	// queue
+	struct spockfs_block *prev;
+	struct spockfs_block *next;
+	// blocks of the same object
+	struct spockfs_block *oprev;
+	struct spockfs_block *onext;
+};
+
+struct spockfs_cobj {
+	char *path;
+	uint32_t hash;
+	uint64_t version;
+	uint64_t size;
+	struct spockfs_block *blocks;
+	struct spockfs_cobj *hnext;
+};
+
+struct spockfs_queue {
+	struct spockfs_block *head;
+	struct spockfs_block *tail;
+	uint64_t count;
+};
+
+static struct spockfs_cache {
+	pthread_mutex_t lock;
+	// bumped at every invalidation, blocks fetched before it are not stored
+	uint64_t gen;
+	uint32_t mask;
+	struct spockfs_block **blocks;
+	struct spockfs_cobj **objs;
+	struct spockfs_queue q[3];
+	uint64_t max;
+	uint64_t a1in_max;
+	uint64_t a1out_max;
+} spockfs_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void spockfs_cache_init() {
+	spockfs_cache.max = spockfs_config.cache_size / SPOCKFS_BLOCK_SIZE;
+	if (!spockfs_cache.max) return;
+	spockfs_cache.a1in_max = spockfs_cache.max / 4;
+	if (!spockfs_cache.a1in_max) spockfs_cache.a1in_max = 1;
+	spockfs_cache.a1out_max = spockfs_cache.max / 2;
+	if (!spockfs_cache.a1out_max) spockfs_cache.a1out_max = 1;
+	uint32_t buckets = 64;
+	while(buckets < spockfs_cache.max * 2) buckets <<= 1;
+	spockfs_cache.objs = calloc(buckets, sizeof(struct spockfs_cobj *));
+	if (!spockfs_cache.objs) return;
+	spockfs_cache.blocks = calloc(buckets, sizeof(struct spockfs_block *));
+	if (!spockfs_cache.blocks) {
+		free(spockfs_cache.objs);
+		spockfs_cache.objs = NULL;
+		return;
+	}
+	spockfs_cache.mask = buckets - 1;
+}
+
+#define spockfs_cache_enabled() (spockfs_cache.blocks)
+
+static struct spockfs_block **spockfs_block_bucket(uint32_t hash, uint64_t index) {
+	return &spockfs_cache.blocks[(hash ^ (uint32_t) (index * 2654435761U)) & spockfs_cache.mask];
+}
+
+static void spockfs_queue_push(int queue, struct spockfs_block *b) {
+	struct spockfs_queue *q = &spockfs_cache.q[queue];
+	b->queue = queue;
+	b->prev = NULL;
+	b->next = q->head;
+	if (q->head) q->head->prev = b;
+	q->head = b;
+	if (!q->tail) q->tail = b;
+	q->count++;
+}
+
+static void spockfs_queue_remove(struct spockfs_block *b) {
+	struct spockfs_queue *q = &spockfs_cache.q[b->queue];
+	if (b->prev) b->prev->next = b->next;
+	else q->head = b->next;
+	if (b->next) b->next->prev = b->prev;
+	else q->tail = b->prev;
+	q->count--;
+}
+
+// detach a block from its object and release its data (it becomes a ghost)
+static void spockfs_block_orphan(struct spockfs_block *b) {
+	struct spockfs_cobj *obj = b->obj;
+	if (b->oprev) b->oprev->onext = b->onext;
+	else obj->blocks = b->onext;
+	if (b->onext) b->onext->oprev = b->oprev;
+	b->obj = NULL;
+	b->oprev = NULL;
+	b->onext = NULL;
+	free(b->buf);
+	b->buf = NULL;
+	b->len = 0;
+}
+
+static void spockfs_block_destroy(struct spockfs_block *b) {
+	struct spockfs_block **slot = spockfs_block_bucket(b->hash, b->index);
+	while(*slot) {
+		if (*slot == b) {
+			*slot = b->hnext;
+			break;
+		}
+		slot = &(*slot)->hnext;
+	}
+	spockfs_queue_remove(b);
+	if (b->obj) spockfs_block_orphan(b);
+	free(b);
+}
+
+static struct spockfs_cobj **spockfs_cobj_find(const char *path, uint32_t hash) {
+	struct spockfs_cobj **obj = &spockfs_cache.objs[hash & spockfs_cache.mask];
+	while(*obj) {
+		if ((*obj)->hash == hash && !strcmp((*obj)->path, path)) return obj;
+		obj = &(*obj)->hnext;
+	}
+	return obj;
+}
+
+// remove an object without blocks
+static void spockfs_cobj_destroy(struct spockfs_cobj *obj) {
+	struct spockfs_cobj **slot = spockfs_cobj_find(obj->path, obj->hash);
+	if (*slot == obj) *slot = obj->hnext;
+	free(obj->path);
+	free(obj);
+}
+
+static void spockfs_cobj_drop(struct spockfs_cobj *obj) {
+	while(obj->blocks) {
+		spockfs_block_destroy(obj->blocks);
+	}
+}
+
+// make room for a new block (the cache lock must be held)
+static void spockfs_cache_evict() {
+	while(spockfs_cache.q[SPOCKFS_Q_A1IN].count + spockfs_cache.q[SPOCKFS_Q_AM].count >= spockfs_cache.max) {
+		struct spockfs_block *b;
+		if (spockfs_cache.q[SPOCKFS_Q_A1IN].count > spockfs_cache.a1in_max || !spockfs_cache.q[SPOCKFS_Q_AM].count) {
+			// the fifo tail becomes a ghost
+			b = spockfs_cache.q[SPOCKFS_Q_A1IN].tail;
+			struct spockfs_cobj *obj = b->obj;
+			spockfs_queue_remove(b);
+			spockfs_block_orphan(b);
+			if (!obj->blocks) spockfs_cobj_destroy(obj);
+			spockfs_queue_push(SPOCKFS_Q_A1OUT, b);
+			if (spockfs_cache.q[SPOCKFS_Q_A1OUT].count > spockfs_cache.a1out_max) {
+				spockfs_block_destroy(spockfs_cache.q[SPOCKFS_Q_A1OUT].tail);
+			}
+		}
+		else {
+			b = spockfs_cache.q[SPOCKFS_Q_AM].tail;
+			struct spockfs_cobj *obj = b->obj;
+			spockfs_block_destroy(b);
+			if (!obj->blocks) spockfs_cobj_destroy(obj);
+		}
+		spockfs_stats_inc(cache_evictions);
+	}
+}
+
+static uint64_t spockfs_cache_generation() {
+	pthread_mutex_lock(&spockfs_cache.lock);
+	uint64_t gen = spockfs_cache.gen;
+	pthread_mutex_unlock(&spockfs_cache.lock);
+	return gen;
+}
+
+/*
+	copy len bytes (starting from "from") of a block, returns the number of bytes
+	copied (less than len at the end of the file) or -1 on miss
+*/
+static int spockfs_cache_get(const char *path, uint64_t version, uint64_t size, uint64_t index, char *buf, size_t from, size_t len) {
+	int ret = -1;
+	if (!spockfs_cache_enabled()) return ret;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	pthread_mutex_lock(&spockfs_cache.lock);
+	struct spockfs_cobj *obj = *spockfs_cobj_find(path, hash);
+	if (!obj || obj->version != version || obj->size != size) goto end;
+	struct spockfs_block *b = *spockfs_block_bucket(hash, index);
+	while(b) {
+		if (b->obj == obj && b->index == index) break;
+		b = b->hnext;
+	}
+	if (!b) goto end;
+	if (b->queue == SPOCKFS_Q_AM) {
+		spockfs_queue_remove(b);
+		spockfs_queue_push(SPOCKFS_Q_AM, b);
+	}
+	ret = 0;
+	if (from < b->len) {
+		ret = b->len - from;
+		if ((size_t) ret > len) ret = len;
+		memcpy(buf, b->buf + from, ret);
+	}
+end:
+	pthread_mutex_unlock(&spockfs_cache.lock);
+	return ret;
+}
+
+static void spockfs_cache_set(const char *path, uint64_t version, uint64_t size, uint64_t index, const char *data, size_t len, uint64_t gen) {
+	if (!spockfs_cache_enabled()) return;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	char *buf = malloc(len);
+	if (!buf) return;
+	memcpy(buf, data, len);
+	pthread_mutex_lock(&spockfs_cache.lock);
+	if (gen != spockfs_cache.gen) goto error;
+
+	// seen recently ?
+	int queue = SPOCKFS_Q_A1IN;
+	struct spockfs_block **slot = spockfs_block_bucket(hash, index);
+	struct spockfs_block *b = *slot;
+	while(b) {
+		if (b->index == index && b->hash == hash) {
+			// already there (stored by a concurrent read)
+			if (b->obj && !strcmp(b->obj->path, path) && b->obj->version == version && b->obj->size == size) goto error;
+			if (!b->obj) {
+				spockfs_block_destroy(b);
+				queue = SPOCKFS_Q_AM;
+				break;
+			}
+		}
+		b = b->hnext;
+	}
+
+	spockfs_cache_evict();
+
+	struct spockfs_cobj **oslot = spockfs_cobj_find(path, hash);
+	struct spockfs_cobj *obj = *oslot;
+	if (!obj) {
+		obj = calloc(1, sizeof(struct spockfs_cobj));
+		if (!obj) goto error;
+		obj->path = strdup(path);
+		if (!obj->path) {
+			free(obj);
+			goto error;
+		}
+		obj->hash = hash;
+		obj->version = version;
+		obj->size = size;
+		*oslot = obj;
+	}
+	// stale blocks
+	else if (obj->version != version || obj->size != size) {
+		spockfs_cobj_drop(obj);
+		obj->version = version;
+		obj->size = size;
+	}
+	else {
+		// another object could own a block with the same index
+		b = *slot;
+		while(b) {
+			if (b->obj == obj && b->index == index) goto error;
+			b = b->hnext;
+		}
+	}
+
+	b = calloc(1, sizeof(struct spockfs_block));
+	if (!b) {
+		if (!obj->blocks) spockfs_cobj_destroy(obj);
+		goto error;
+	}
+	b->obj = obj;
+	b->hash = hash;
+	b->index = index;
+	b->buf = buf;
+	b->len = len;
+	b->onext = obj->blocks;
+	if (b->onext) b->onext->oprev = b;
+	obj->blocks = b;
+	b->hnext = *slot;
+	*slot = b;
+	spockfs_queue_push(queue, b);
+	pthread_mutex_unlock(&spockfs_cache.lock);
+	return;
+error:
+	pthread_mutex_unlock(&spockfs_cache.lock);
+	free(buf);
+}
+
+// the content of path changed
+static void spockfs_cache_invalidate(const char *path) {
+	if (!spockfs_cache_enabled()) return;
+	uint32_t hash = spockfs_hash(path, strlen(path));
+	pthread_mutex_lock(&spockfs_cache.lock);
+	spockfs_cache.gen++;
+	struct spockfs_cobj *obj = *spockfs_cobj_find(path, hash);
+	if (obj) {
+		spockfs_cobj_drop(obj);
+		spockfs_cobj_destroy(obj);
+	}
+	pthread_mutex_unlock(&spockfs_cache.lock);
+}
+
+// path and all of the objects under it changed (rename, or everything for the root)
+static void spockfs_cache_invalidate_tree(const char *path) {
+	if (!spockfs_cache_enabled()) return;
+	size_t len = strlen(path);
+	uint32_t i;
+	pthread_mutex_lock(&spockfs_cache.lock);
+	spockfs_cache.gen++;
+	for(i=0;i<=spockfs_cache.mask;i++) {
+		struct spockfs_cobj *obj = spockfs_cache.objs[i];
+		while(obj) {
+			struct spockfs_cobj *next = obj->hnext;
+			if (!strncmp(obj->path, path, len) && (obj->path[len] == 0 || obj->path[len] == '/' || len == 1)) {
+				spockfs_cobj_drop(obj);
+				spockfs_cobj_destroy(obj);
+			}
+			obj = next;
+		}
+	}
+	pthread_mutex_unlock(&spockfs_cache.lock);
+}
+
+/*
+	disk cache
+
+	when cache_dir is set, the blocks fetched from the server are stored on the local disk
+	too, and they survive remounts. Every object has a sparse data file (named by the
+	hash of its path) where blocks are written at their natural offset, while a
+	memory-mapped index (open addressing, linear probing) maps (path, block) to the
+	validators (inode, version and size) of the object when the block has been fetched.
+	As in the memory cache, a block is used only if the validators match the ones got at
+	open, so the first access after a mount always revalidates against the server.
+
+	Blocks carry a checksum verified at their first use after every mount (the index could
+	have reached the disk before the data on a crash). When the cache is full the least
+	recently used of a sample of blocks is evicted (punching a hole in its data file).
+
+	An in-memory table (rebuilt at every compaction) lists the cached blocks of every object,
+	so invalidating a path costs as much as the blocks it has, not a walk of the whole index.
+*/
+#define SPOCKFS_DISK_MAGIC 0x53504f434b465331ULL
+#define SPOCKFS_DISK_SAMPLE 16
+
+#define SPOCKFS_SLOT_EMPTY 0
+#define SPOCKFS_SLOT_USED 1
+#define SPOCKFS_SLOT_DELETED 2
+
+struct spockfs_disk_header {
+	uint64_t magic;
+	uint64_t block_size;
+	uint64_t slots;
+	uint64_t epoch;
+};
+
+struct spockfs_disk_slot {
+	uint64_t key;
+	uint64_t index;
+	uint64_t ino;
+	uint64_t version;
+	uint64_t size;
+	uint64_t atime;
+	uint32_t len;
+	uint32_t sum;
+	uint32_t state;
+	uint32_t epoch;
+};
+
+// the blocks of an object in the index
+struct spockfs_disk_obj {
+	uint64_t key;
+	uint64_t *indexes;
+	uint32_t count;
+	uint32_t size;
+	struct spockfs_disk_obj *next;
+};
+
+static struct spockfs_disk {
+	pthread_rwlock_t lock;
+	struct spockfs_disk_header *header;
+	struct spockfs_disk_slot *slots;
+	uint64_t mask;
+	uint64_t count;
+	uint64_t deleted;
+	uint64_t max;
+	uint64_t hand;
+	char *dir;
+	struct spockfs_disk_obj **objs;
+	uint64_t objs_mask;
+} spockfs_disk = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+#define spockfs_disk_enabled() (spockfs_disk.slots)
+
+// the objects table functions need the write lock
+static struct spockfs_disk_obj **spockfs_disk_obj_find(uint64_t key) {
+	struct spockfs_disk_obj **obj = &spockfs_disk.objs[key & spockfs_disk.objs_mask];
+	while(*obj) {
+		if ((*obj)->key == key) return obj;
+		obj = &(*obj)->next;
+	}
+	return obj;
+}
+
+static void spockfs_disk_obj_destroy(struct spockfs_disk_obj **slot) {
+	struct spockfs_disk_obj *obj = *slot;
+	*slot = obj->next;
+	free(obj->indexes);
+	free(obj);
+}
+
+static int spockfs_disk_obj_add(uint64_t key, uint64_t index) {
+	struct spockfs_disk_obj **slot = spockfs_disk_obj_find(key);
+	struct spockfs_disk_obj *obj = *slot;
+	if (!obj) {
+		obj = calloc(1, sizeof(struct spockfs_disk_obj));
+		if (!obj) return -1;
+		obj->key = key;
+		*slot = obj;
+	}
+	if (obj->count >= obj->size) {
+		uint32_t size = obj->size ? obj->size * 2 : 8;
+		uint64_t *indexes = realloc(obj->indexes, sizeof(uint64_t) * size);
+		if (!indexes) {
+			if (!obj->count) spockfs_disk_obj_destroy(slot);
+			return -1;
+		}
+		obj->indexes = indexes;
+		obj->size = size;
+	}
+	obj->indexes[obj->count++] = index;
+	return 0;
+}
+
+static void spockfs_disk_obj_remove(uint64_t key, uint64_t index) {
+	struct spockfs_disk_obj **slot = spockfs_disk_obj_find(key);
+	struct spockfs_disk_obj *obj = *slot;
+	if (!obj) return;
+	uint32_t i;
+	for(i=0;i<obj->count;i++) {
+		if (obj->indexes[i] == index) {
+			obj->indexes[i] = obj->indexes[--obj->count];
+			break;
+		}
+	}
+	if (!obj->count) spockfs_disk_obj_destroy(slot);
+}
+
+static int spockfs_disk_open(uint64_t key, int flags) {
+	char name[PATH_MAX];
+	int ret = snprintf(name, PATH_MAX, "%s/data/%016llx", spockfs_disk.dir, (unsigned long long) key);
+	if (ret <= 0 || ret >= PATH_MAX) return -1;
+	return open(name, flags, 0600);
+}
+
+static void spockfs_disk_unlink(uint64_t key) {
+	char name[PATH_MAX];
+	int ret = snprintf(name, PATH_MAX, "%s/data/%016llx", spockfs_disk.dir, (unsigned long long) key);
+	if (ret <= 0 || ret >= PATH_MAX) return;
+	unlink(name);
+}
+
+static struct spockfs_disk_slot *spockfs_disk_find(uint64_t key, uint64_t index) {
+	uint64_t i, pos = (key ^ (index * 2654435761U)) & spockfs_disk.mask;
+	for(i=0;i<=spockfs_disk.mask;i++) {
+		struct spockfs_disk_slot *slot = &spockfs_disk.slots[(pos + i) & spockfs_disk.mask];
+		if (slot->state == SPOCKFS_SLOT_EMPTY) return NULL;
+		if (slot->state == SPOCKFS_SLOT_USED && slot->key == key && slot->index == index) return slot;
+	}
+	return NULL;
+}
+
+// (the write lock must be held)
+static void spockfs_disk_evict(struct spockfs_disk_slot *slot) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	int fd = spockfs_disk_open(slot->key, O_WRONLY);
+	if (fd >= 0) {
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, slot->index * SPOCKFS_BLOCK_SIZE, SPOCKFS_BLOCK_SIZE)) {
+			// not supported by the filesystem, the space will be reclaimed on invalidation
+		}
+		close(fd);
+	}
+#endif
+	spockfs_disk_obj_remove(slot->key, slot->index);
+	slot->state = SPOCKFS_SLOT_DELETED;
+	spockfs_disk.count--;
+	spockfs_disk.deleted++;
+}
+
+// the least recently used of a sample of slots (the write lock must be held)
+static struct spockfs_disk_slot *spockfs_disk_victim() {
+	struct spockfs_disk_slot *victim = NULL;
+	uint64_t i, checked = 0;
+	for(i=0;i<=spockfs_disk.mask && checked < SPOCKFS_DISK_SAMPLE;i++) {
+		struct spockfs_disk_slot *slot = &spockfs_disk.slots[spockfs_disk.hand++ & spockfs_disk.mask];
+		if (slot->state != SPOCKFS_SLOT_USED) continue;
+		checked++;
+		if (!victim || slot->atime < victim->atime) victim = slot;
+	}
+	return victim;
+}
+
+// rebuild the index dropping tombstones
+static void spockfs_disk_compact() {
+	size_t len = (spockfs_disk.mask + 1) * sizeof(struct spockfs_disk_slot);
+	struct spockfs_disk_slot *old = malloc(len);
+	if (!old) return;
+	memcpy(old, spockfs_disk.slots, len);
+	memset(spockfs_disk.slots, 0, len);
+	spockfs_disk.count = 0;
+	spockfs_disk.deleted = 0;
+	uint64_t i;
+	for(i=0;i<=spockfs_disk.objs_mask;i++) {
+		while(spockfs_disk.objs[i]) spockfs_disk_obj_destroy(&spockfs_disk.objs[i]);
+	}
+	for(i=0;i<=spockfs_disk.mask;i++) {
+		if (old[i].state != SPOCKFS_SLOT_USED) continue;
+		uint64_t j, pos = (old[i].key ^ (old[i].index * 2654435761U)) & spockfs_disk.mask;
+		for(j=0;j<=spockfs_disk.mask;j++) {
+			struct spockfs_disk_slot *slot = &spockfs_disk.slots[(pos + j) & spockfs_disk.mask];
+			if (slot->state == SPOCKFS_SLOT_EMPTY) {
+				// without memory for the table the block cannot be invalidated, forget it
+				if (spockfs_disk_obj_add(old[i].key, old[i].index)) break;
+				*slot = old[i];
+				spockfs_disk.count++;
+				break;
+			}
+		}
+	}
+	free(old);
+}
+
+static int spockfs_disk_init() {
+	char name[PATH_MAX];
+	spockfs_disk.max = ((uint64_t) spockfs_config.cache_dir_size * 1024 * 1024) / SPOCKFS_BLOCK_SIZE;
+	if (!spockfs_disk.max) return 0;
+	uint64_t slots = 1024;
+	while(slots < spockfs_disk.max * 2) slots <<= 1;
+	spockfs_disk.objs = calloc(slots / 8, sizeof(struct spockfs_disk_obj *));
+	if (!spockfs_disk.objs) return -1;
+	spockfs_disk.objs_mask = (slots / 8) - 1;
+
+	int ret = snprintf(name, PATH_MAX, "%s/data", spockfs_config.cache_dir);
+	if (ret <= 0 || ret >= PATH_MAX) return -1;
+	if (mkdir(spockfs_config.cache_dir, 0700) && errno != EEXIST) return -1;
+	if (mkdir(name, 0700) && errno != EEXIST) return -1;
+	// FUSE changes the working directory when daemonizing
+	spockfs_disk.dir = realpath(spockfs_config.cache_dir, NULL);
+	if (!spockfs_disk.dir) return -1;
+
+	ret = snprintf(name, PATH_MAX, "%s/index", spockfs_disk.dir);
+	if (ret <= 0 || ret >= PATH_MAX) return -1;
+	int fd = open(name, O_RDWR|O_CREAT, 0600);
+	if (fd < 0) return -1;
+	// the directory cannot be shared between mounts (the lock is held until exit)
+	if (flock(fd, LOCK_EX|LOCK_NB)) goto error;
+	size_t len = sizeof(struct spockfs_disk_header) + (slots * sizeof(struct spockfs_disk_slot));
+	struct stat st;
+	if (fstat(fd, &st)) goto error;
+	int fresh = 0;
+	if ((size_t) st.st_size != len) {
+		if (ftruncate(fd, 0) || ftruncate(fd, len)) goto error;
+		fresh = 1;
+	}
+	char *addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) goto error;
+
+	spockfs_disk.header = (struct spockfs_disk_header *) addr;
+	spockfs_disk.slots = (struct spockfs_disk_slot *) (addr + sizeof(struct spockfs_disk_header));
+	spockfs_disk.mask = slots - 1;
+
+	// a different layout (or a new file), start from scratch
+	if (fresh || spockfs_disk.header->magic != SPOCKFS_DISK_MAGIC || spockfs_disk.header->block_size != SPOCKFS_BLOCK_SIZE || spockfs_disk.header->slots != slots) {
+		memset(addr, 0, len);
+		spockfs_disk.header->magic = SPOCKFS_DISK_MAGIC;
+		spockfs_disk.header->block_size = SPOCKFS_BLOCK_SIZE;
+		spockfs_disk.header->slots = slots;
+	}
+	spockfs_disk.header->epoch++;
+	spockfs_disk_compact();
+	return 0;
+error:
+	close(fd);
+	return -1;
+}
+
+static uint32_t spockfs_disk_sum(const char *buf, size_t len) {
+	return spockfs_hash(buf, len);
+}
+
+/*
+	read a whole block from the disk cache, returns 0 on hit (buf must be at least
+	len bytes, the size of the block)
+*/
+static int spockfs_disk_get(const char *path, uint64_t ino, uint64_t version, uint64_t size, uint64_t index, char *buf, size_t len) {
+	int ret = -1;
+	uint64_t key = spockfs_hash64(path, strlen(path));
+	pthread_rwlock_rdlock(&spockfs_disk.lock);
+	struct spockfs_disk_slot *slot = spockfs_disk_find(key, index);
+	if (!slot || slot->ino != ino || slot->version != version || slot->size != size || slot->len != len) goto end;
+	int fd = spockfs_disk_open(key, O_RDONLY);
+	if (fd < 0) goto end;
+	ssize_t rlen = pread(fd, buf, len, index * SPOCKFS_BLOCK_SIZE);
+	close(fd);
+	if (rlen != (ssize_t) len) goto end;
+	// other readers could update the same slot (only the read lock is held)
+	uint32_t epoch = (uint32_t) spockfs_disk.header->epoch;
+	if (__atomic_load_n(&slot->epoch, __ATOMIC_RELAXED) != epoch) {
+		if (spockfs_disk_sum(buf, len) != slot->sum) goto end;
+		__atomic_store_n(&slot->epoch, epoch, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&slot->atime, spockfs_now(), __ATOMIC_RELAXED);
+	ret = 0;
+end:
+	pthread_rwlock_unlock(&spockfs_disk.lock);
+	return ret;
+}
+
+static void spockfs_disk_set(const char *path, uint64_t ino, uint64_t version, uint64_t size, uint64_t index, const char *buf, size_t len) {
+	uint64_t key = spockfs_hash64(path, strlen(path));
+	uint32_t sum = spockfs_disk_sum(buf, len);
+	pthread_rwlock_wrlock(&spockfs_disk.lock);
+	struct spockfs_disk_slot *slot = spockfs_disk_find(key, index);
+	if (slot) {
+		// replaced
+		spockfs_disk_obj_remove(key, index);
+		slot->state = SPOCKFS_SLOT_DELETED;
+		spockfs_disk.count--;
+		spockfs_disk.deleted++;
+	}
+	if (spockfs_disk.count >= spockfs_disk.max) {
+		struct spockfs_disk_slot *victim = spockfs_disk_victim();
+		if (victim) {
+			spockfs_disk_evict(victim);
+			spockfs_stats_inc(disk_evictions);
+		}
+	}
+	// too many tombstones make lookups slow
+	if (spockfs_disk.deleted > (spockfs_disk.mask + 1) / 4) {
+		spockfs_disk_compact();
+	}
+	// the data first, then the index
+	int fd = spockfs_disk_open(key, O_WRONLY|O_CREAT);
+	if (fd < 0) goto end;
+	ssize_t wlen = pwrite(fd, buf, len, index * SPOCKFS_BLOCK_SIZE);
+	close(fd);
+	if (wlen != (ssize_t) len) goto end;
+	if (spockfs_disk_obj_add(key, index)) goto end;
+
+	uint64_t i, pos = (key ^ (index * 2654435761U)) & spockfs_disk.mask;
+	for(i=0;i<=spockfs_disk.mask;i++) {
+		slot = &spockfs_disk.slots[(pos + i) & spockfs_disk.mask];
+		if (slot->state == SPOCKFS_SLOT_USED) continue;
+		if (slot->state == SPOCKFS_SLOT_DELETED) spockfs_disk.deleted--;
+		slot->key = key;
+		slot->index = index;
+		slot->ino = ino;
+		slot->version = version;
+		slot->size = size;
+		slot->atime = spockfs_now();
+		slot->len = len;
+		slot->sum = sum;
+		slot->epoch = (uint32_t) spockfs_disk.header->epoch;
+		slot->state = SPOCKFS_SLOT_USED;
+		spockfs_disk.count++;
+		break;
+	}
+end:
+	pthread_rwlock_unlock(&spockfs_disk.lock);
+}
+
+// the content of path changed
+static void spockfs_disk_invalidate(const char *path) {
+	if (!spockfs_disk_enabled()) return;
+	uint64_t key = spockfs_hash64(path, strlen(path));
+	uint32_t i;
+	pthread_rwlock_wrlock(&spockfs_disk.lock);
+	struct spockfs_disk_obj **obj = spockfs_disk_obj_find(key);
+	// (the common case) nothing cached for this object
+	if (!*obj) goto end;
+	for(i=0;i<(*obj)->count;i++) {
+		struct spockfs_disk_slot *slot = spockfs_disk_find(key, (*obj)->indexes[i]);
+		if (slot) {
+			slot->state = SPOCKFS_SLOT_DELETED;
+			spockfs_disk.count--;
+			spockfs_disk.deleted++;
+		}
+	}
+	spockfs_disk_obj_destroy(obj);
+	spockfs_disk_unlink(key);
+end:
+	pthread_rwlock_unlock(&spockfs_disk.lock);
+}
+
+/*
+	open files
+
+	every file handle (fi->fh) maps to a struct spockfs_file, all of them are linked
+	in spockfs_files, so operations on a path can reach the state of the open handles.
+
+	Lock ordering: spockfs_files.lock is never held while acquiring wb_lock, so threads
+	working on the dirty data of a handle (outside its FUSE request) take a reference to it.
+*/
+#define SPOCKFS_RA_EMPTY 0
+#define SPOCKFS_RA_PENDING 1
+#define SPOCKFS_RA_READY 2
+
+// the minimal read-ahead window, and the tolerance for considering a read sequential
+#define SPOCKFS_RA_MIN (128 * 1024)
+
+struct spockfs_ra {
+	int state;
+	off_t offset;
+	// requested bytes when pending, available ones when ready
+	size_t len;
+	size_t served;
+	char *buf;
+};
+
+struct spockfs_file {
+	char *path;
+	// the encoded url of path (protected by lock, NULL if it could not be allocated)
+	char *url;
+	size_t url_len;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// read-ahead state
+	off_t ra_next;
+	off_t ra_eof;
+	size_t ra_window;
+	uint32_t ra_seq;
+	uint64_t ra_gen;
+	int ra_pending;
+	struct spockfs_ra ra[2];
+
+	// block cache validators (inode, version and size of the object at open)
+	int c_valid;
+	uint64_t c_ino;
+	uint64_t c_version;
+	uint64_t c_size;
+
+	// write-back state (dirty extent), protected by wb_lock
+	pthread_mutex_t wb_lock;
+	char *wb_buf;
+	size_t wb_cap;
+	off_t wb_off;
+	size_t wb_len;
+	uint64_t wb_since;
+	int wb_error;
+
+	// references held by threads other than the FUSE ones (protected by spockfs_files.lock)
+	int refs;
+
+	struct spockfs_file *prev;
+	struct spockfs_file *next;
+};
+
+static struct spockfs_files {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct spockfs_file *head;
+	// global amount of dirty (not yet flushed) bytes and number of dirty handles
+	uint64_t dirty_bytes;
+	uint64_t dirty_files;
+} spockfs_files = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+struct spockfs_prefetch {
+	struct spockfs_file *sf;
+	struct spockfs_ra *ra;
+	uint64_t gen;
+	char *path;
+	off_t offset;
+	size_t len;
+};
+
+// the file the current thread is reading, writing or flushing (its url is reused by the requests)
+static __thread struct spockfs_file *spockfs_file_cur;
+
+static char *spockfs_file_url_new(const char *path, size_t *len) {
+	size_t path_len = strlen(path);
+	char *url = malloc(spockfs_config.http_url_len + spockfs_url_size(path, path_len) + 1);
+	if (!url) return NULL;
+	memcpy(url, spockfs_config.http_url, spockfs_config.http_url_len);
+	*len = spockfs_config.http_url_len + spockfs_url_encode(url + spockfs_config.http_url_len, path, path_len);
+	url[*len] = 0;
+	return url;
+}
+
+// an arena copy of the url of the current file (if path is still its path)
+static char *spockfs_file_url(const char *path) {
+	struct spockfs_file *sf = spockfs_file_cur;
+	if (!sf) return NULL;
+	char *url = NULL;
+	pthread_mutex_lock(&sf->lock);
+	if (sf->url && !strcmp(sf->path, path)) {
+		url = spockfs_arena_alloc(sf->url_len + 1);
+		if (url) memcpy(url, sf->url, sf->url_len + 1);
+	}
+	pthread_mutex_unlock(&sf->lock);
+	if (url) spockfs_stats_inc(url_reused);
+	return url;
+}
+
+static struct spockfs_file *spockfs_file_new(const char *path) {
+	struct spockfs_file *sf = calloc(1, sizeof(struct spockfs_file));
+	if (!sf) return NULL;
+	sf->path = strdup(path);
+	if (!sf->path) {
+		free(sf);
+		return NULL;
+	}
+	sf->url = spockfs_file_url_new(path, &sf->url_len);
+	pthread_mutex_init(&sf->lock, NULL);
+	pthread_cond_init(&sf->cond, NULL);
+	pthread_mutex_init(&sf->wb_lock, NULL);
+	sf->ra_eof = -1;
+	sf->ra_window = SPOCKFS_RA_MIN;
+	pthread_mutex_lock(&spockfs_files.lock);
+	sf->next = spockfs_files.head;
+	if (sf->next) sf->next->prev = sf;
+	spockfs_files.head = sf;
+	pthread_mutex_unlock(&spockfs_files.lock);
+	return sf;
+}
+
+// drop a read-ahead buffer (the sf lock must be held)
+static void spockfs_ra_drop(struct spockfs_ra *ra) {
+	if (ra->state != SPOCKFS_RA_READY) return;
+	if (ra->served < ra->len) {
+		__sync_fetch_and_add(&spockfs_stats.readahead_wasted, ra->len - ra->served);
+	}
+	free(ra->buf);
+	ra->buf = NULL;
+	ra->len = 0;
+	ra->served = 0;
+	ra->state = SPOCKFS_RA_EMPTY;
+}
+
+// throw away the read-ahead buffers (the sf lock must be held), pending ones will be discarded on completion
+static void spockfs_ra_reset(struct spockfs_file *sf) {
+	spockfs_ra_drop(&sf->ra[0]);
+	spockfs_ra_drop(&sf->ra[1]);
+	sf->ra_gen++;
+	sf->ra_eof = -1;
+}
+
+// the dirty data must be already flushed
+static void spockfs_file_destroy(struct spockfs_file *sf) {
+	pthread_mutex_lock(&spockfs_files.lock);
+	if (sf->prev) {
+		sf->prev->next = sf->next;
+	}
+	else {
+		spockfs_files.head = sf->next;
+	}
+	if (sf->next) sf->next->prev = sf->prev;
+	// wait for the flushers
+	while(sf->refs) {
+		pthread_cond_wait(&spockfs_files.cond, &spockfs_files.lock);
+	}
+	pthread_mutex_unlock(&spockfs_files.lock);
+
+	pthread_mutex_lock(&sf->lock);
+	// wait for the prefetches still running
+	while(sf->ra_pending) {
+		pthread_cond_wait(&sf->cond, &sf->lock);
+	}
+	spockfs_ra_reset(sf);
+	pthread_mutex_unlock(&sf->lock);
+
+	pthread_mutex_destroy(&sf->lock);
+	pthread_cond_destroy(&sf->cond);
+	pthread_mutex_destroy(&sf->wb_lock);
+	if (sf->wb_buf) free(sf->wb_buf);
+	if (sf->url) free(sf->url);
+	free(sf->path);
+	free(sf);
+}
+
+/*
+	the content of path changed, drop the cached blocks and the read-ahead data of all
+	of the handles opened on it (their validators are no more valid too)
+*/
+static void spockfs_files_invalidate(const char *path) {
+	spockfs_shared_invalidate(path);
+	spockfs_cache_invalidate(path);
+	spockfs_disk_invalidate(path);
+	pthread_mutex_lock(&spockfs_files.lock);
+	struct spockfs_file *sf = spockfs_files.head;
+	while(sf) {
+		if (!strcmp(sf->path, path)) {
+			pthread_mutex_lock(&sf->lock);
+			spockfs_ra_reset(sf);
+			sf->c_valid = 0;
+			pthread_mutex_unlock(&sf->lock);
+		}
+		sf = sf->next;
+	}
+	pthread_mutex_unlock(&spockfs_files.lock);
+}
+
+// update the path of the open handles after a rename (of the object or of one of its parents)
+static void spockfs_files_rename(const char *old, const char *new) {
+	size_t old_len = strlen(old);
+	size_t new_len = strlen(new);
+	pthread_mutex_lock(&spockfs_files.lock);
+	struct spockfs_file *sf = spockfs_files.head;
+	while(sf) {
+		if (!strncmp(sf->path, old, old_len) && (sf->path[old_len] == 0 || sf->path[old_len] == '/')) {
+			size_t rest = strlen(sf->path + old_len);
+			char *path = malloc(new_len + rest + 1);
+			if (path) {
+				memcpy(path, new, new_len);
+				memcpy(path + new_len, sf->path + old_len, rest + 1);
+				size_t url_len = 0;
+				char *url = spockfs_file_url_new(path, &url_len);
+				pthread_mutex_lock(&sf->lock);
+				free(sf->path);
+				sf->path = path;
+				if (sf->url) free(sf->url);
+				sf->url = url;
+				sf->url_len = url_len;
+				pthread_mutex_unlock(&sf->lock);
+			}
+		}
+		sf = sf->next;
+	}
+	pthread_mutex_unlock(&spockfs_files.lock);
+}
+
+/*
+	striped reads
+
+	big ranges (at least two stripes of stripe_size bytes) are fetched with parallel
+	ranged GETs, so a single TCP window does not cap the throughput on long fat links.
+	The number of stripes is tuned by hill climbing on the observed throughput: it grows
+	while adding a stripe pays and shrinks when it does not (up to stripes_max).
+*/
+static struct spockfs_stripes {
+	pthread_mutex_t lock;
+	int n;
+	// bytes per second observed for every number of stripes (exponentially weighted)
+	double throughput[SPOCKFS_STRIPES_MAX + 1];
+} spockfs_stripes = { .lock = PTHREAD_MUTEX_INITIALIZER, .n = 2 };
+
+static int spockfs_stripes_count(size_t size) {
+	if (spockfs_config.stripes_max < 2 || !spockfs_config.stripe_size) return 1;
+	pthread_mutex_lock(&spockfs_stripes.lock);
+	int n = spockfs_stripes.n;
+	pthread_mutex_unlock(&spockfs_stripes.lock);
+	if (n > (int) spockfs_config.stripes_max) n = spockfs_config.stripes_max;
+	if ((size_t) n > size / spockfs_config.stripe_size) n = size / spockfs_config.stripe_size;
+	return n;
+}
+
+static void spockfs_stripes_measure(int n, size_t bytes, double elapsed) {
+	if (elapsed <= 0 || bytes < (size_t) n * spockfs_config.stripe_size) return;
+	double tp = bytes / elapsed;
+	pthread_mutex_lock(&spockfs_stripes.lock);
+	double *t = spockfs_stripes.throughput;
+	t[n] = t[n] > 0 ? (t[n] * 0.75) + (tp * 0.25) : tp;
+	// the single stream estimation
+	pthread_mutex_lock(&spockfs_net.lock);
+	t[1] = spockfs_net.bandwidth;
+	pthread_mutex_unlock(&spockfs_net.lock);
+	if (n == spockfs_stripes.n) {
+		int max = spockfs_config.stripes_max > SPOCKFS_STRIPES_MAX ? SPOCKFS_STRIPES_MAX : spockfs_config.stripes_max;
+		if (n < max && t[n] > t[n-1] * 1.05 && (t[n+1] <= 0 || t[n+1] > t[n])) {
+			spockfs_stripes.n++;
+		}
+		else if (n > 2 && t[n-1] > t[n]) {
+			spockfs_stripes.n--;
+		}
+		spockfs_stats.stripes = spockfs_stripes.n;
+	}
+	pthread_mutex_unlock(&spockfs_stripes.lock);
+}
+
+static int spockfs_fetch_striped(const char *path, char *buf, size_t size, off_t offset, int n) {
+	struct spockfs_http_rr rr[SPOCKFS_STRIPES_MAX];
+	struct curl_slist *headers[SPOCKFS_STRIPES_MAX];
+	CURL *curls[SPOCKFS_STRIPES_MAX];
+	char *urls[SPOCKFS_STRIPES_MAX];
+	CURLcode res[SPOCKFS_STRIPES_MAX];
+	int i, ret = -ENOMEM, ready = 0;
+
+	memset(rr, 0, sizeof(rr));
+	memset(headers, 0, sizeof(headers));
+	// page aligned stripes
+	size_t chunk = (((size + n - 1) / n) + 4095) & ~((size_t) 4095);
+	// rounding up could leave nothing for the last stripes (never more stripes than requested)
+	n = (size + chunk - 1) / chunk;
+	for(i=0;i<n;i++) {
+		size_t from = i * chunk;
+		size_t len = i == n-1 ? size - from : chunk;
+		if (len > size - from) len = size - from;
+		headers[i] = spockfs_add_header_range(NULL, "Range", offset + from, offset + from + len - 1);
+		if (!headers[i]) goto end;
+		rr[i].dst = buf + from;
+		rr[i].dst_len = len;
+		curls[i] = spockfs_http_setup("GET", path, &rr[i], headers[i], &urls[i]);
+		if (!curls[i]) goto end;
+		ready++;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	spockfs_perform_many(curls, res, n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	spockfs_stats_inc(striped_reads);
+
+	ret = 0;
+	for(i=0;i<n;i++) {
+		int r = spockfs_http_finish(curls[i], res[i], &rr[i], urls[i]);
+		if (r && !ret) ret = r;
+	}
+	ready = 0;
+	if (ret) goto end;
+
+	size_t done = 0;
+	for(i=0;i<n;i++) {
+		// a range beyond the end of the file
+		if (rr[i].code == 200 && offset + (off_t) (i * chunk) > 0) break;
+		if (rr[i].code != 206 && rr[i].code != 200) {
+			ret = spockfs_errno(rr[i].code);
+			goto end;
+		}
+		done += rr[i].len;
+		if (rr[i].len < rr[i].dst_len) break;
+	}
+	spockfs_stripes_measure(n, done, (t1.tv_sec - t0.tv_sec) + ((t1.tv_nsec - t0.tv_nsec) / 1e9));
+	ret = done;
+end:
+	for(i=0;i<ready;i++) {
+		curl_easy_cleanup(curls[i]);
+		spockfs_arena_release(urls[i]);
+	}
+	for(i=0;i<n;i++) {
+		spockfs_headers_free(headers[i]);
+		if (rr[i].buf) free(rr[i].buf);
+	}
+	return ret;
+}
+
+// GET a range of a file, returns the number of bytes read (less than size at the end of the file)
+static int spockfs_fetch(const char *path, char *buf, size_t size, off_t offset) {
+
+	spockfs_init2();
+
+	// the body goes straight to the caller buffer
+	sh_rr->dst = buf;
+	sh_rr->dst_len = size;
+
+	struct spockfs_flight *flight = NULL;
+	if (spockfs_shared("GET", path, offset, offset + size, sh_rr, &flight)) goto shared;
+
+	int stripes = spockfs_stripes_count(size);
+	if (stripes > 1) {
+		ret = spockfs_fetch_striped(path, buf, size, offset, stripes);
+		// publish it as a plain range
+		if (ret >= 0) {
+			sh_rr->code = 206;
+			sh_rr->len = ret;
+		}
+		goto end;
+	}
+
+        spockfs_header_range("Range", offset, ((offset+size)-1));
+
+	spockfs_run("GET", headers);
+
+shared:
+	spockfs_check2(206, 200);
+
+        ret = sh_rr->len;
+	// the server answers with the whole file to ranges beyond its end
+	if (sh_rr->code == 200 && offset > 0) ret = 0;
+end:
+	spockfs_shared_done(flight, sh_rr);
+	spockfs_free2();
+}
+
+static void spockfs_ra_run(void *data) {
+	struct spockfs_prefetch *sp = (struct spockfs_prefetch *) data;
+	struct spockfs_file *sf = sp->sf;
+	char *buf = malloc(sp->len);
+	spockfs_file_cur = sf;
+	int ret = buf ? spockfs_fetch(sp->path, buf, sp->len, sp->offset) : -ENOMEM;
+	spockfs_file_cur = NULL;
+
+	pthread_mutex_lock(&sf->lock);
+	struct spockfs_ra *ra = sp->ra;
+	// the file changed in the mean time ?
+	if (ret > 0 && sp->gen == sf->ra_gen) {
+		ra->buf = buf;
+		ra->len = ret;
+		ra->served = 0;
+		ra->state = SPOCKFS_RA_READY;
+		__sync_fetch_and_add(&spockfs_stats.readahead_bytes, ret);
+		if ((size_t) ret < sp->len) sf->ra_eof = sp->offset + ret;
+	}
+	else {
+		if (buf) free(buf);
+		ra->len = 0;
+		ra->state = SPOCKFS_RA_EMPTY;
+		if (ret == 0 && sp->gen == sf->ra_gen) sf->ra_eof = sp->offset;
+	}
+	sf->ra_pending--;
+	pthread_cond_broadcast(&sf->cond);
+	pthread_mutex_unlock(&sf->lock);
+
+	free(sp->path);
+	free(sp);
+}
+
+/*
+	schedule the prefetch of the next window (the sf lock must be held).
+	The window doubles at every prefetch until it reaches twice the bandwidth-delay
+	product of the link (bounded by readahead_max)
+*/
+static void spockfs_ra_schedule(struct spockfs_file *sf, const char *path, off_t pos) {
+	off_t end = pos;
+	struct spockfs_ra *slot = NULL;
+	int i;
+	for(i=0;i<2;i++) {
+		struct spockfs_ra *ra = &sf->ra[i];
+		if (ra->state != SPOCKFS_RA_EMPTY && (off_t) (ra->offset + ra->len) > pos) {
+			if ((off_t) (ra->offset + ra->len) > end) end = ra->offset + ra->len;
+			continue;
+		}
+		// pending prefetches already behind us are useless but they cannot be reused until completion
+		if (ra->state == SPOCKFS_RA_PENDING) continue;
+		slot = ra;
+	}
+	if (!slot) return;
+	if (sf->ra_eof >= 0 && end >= sf->ra_eof) return;
+	// enough data ahead
+	if ((size_t) (end - pos) >= sf->ra_window / 2) return;
+
+	size_t target = spockfs_net_bdp() * 2;
+	if (target < SPOCKFS_RA_MIN) target = SPOCKFS_RA_MIN;
+	if (target > spockfs_config.readahead_max) target = spockfs_config.readahead_max;
+	if (sf->ra_window < target) {
+		sf->ra_window *= 2;
+		if (sf->ra_window > target) sf->ra_window = target;
+	}
+	else {
+		sf->ra_window = target;
+	}
+
+	struct spockfs_prefetch *sp = malloc(sizeof(struct spockfs_prefetch));
+	if (!sp) return;
+	sp->path = strdup(path);
+	if (!sp->path) {
+		free(sp);
+		return;
+	}
+	spockfs_ra_drop(slot);
+	sp->sf = sf;
+	sp->ra = slot;
+	sp->gen = sf->ra_gen;
+	sp->offset = end;
+	sp->len = sf->ra_window;
+	slot->state = SPOCKFS_RA_PENDING;
+	slot->offset = end;
+	slot->len = sf->ra_window;
+	sf->ra_pending++;
+	if (spockfs_job_add(spockfs_ra_run, sp)) {
+		slot->state = SPOCKFS_RA_EMPTY;
+		slot->len = 0;
+		sf->ra_pending--;
+		free(sp->path);
+		free(sp);
+	}
+}
+
+// the read-ahead buffer (ready or pending) containing pos (the sf lock must be held)
+static struct spockfs_ra *spockfs_ra_find(struct spockfs_file *sf, off_t pos) {
+	int i;
+	for(i=0;i<2;i++) {
+		struct spockfs_ra *ra = &sf->ra[i];
+		if (ra->state == SPOCKFS_RA_EMPTY) continue;
+		if (pos >= ra->offset && pos < (off_t) (ra->offset + ra->len)) return ra;
+	}
+	return NULL;
+}
+
+/*
+	read through the read-ahead buffers, returns the number of bytes read
+	(less than size at the end of the file)
+*/
+static int spockfs_ra_read(struct spockfs_file *sf, const char *path, char *buf, size_t size, off_t offset) {
+	size_t done = 0;
+	int eof = 0;
+
+	pthread_mutex_lock(&sf->lock);
+	// the kernel could send a bunch of (async) reads out of order, so be tolerant
+	if (offset + SPOCKFS_RA_MIN >= sf->ra_next && offset <= (off_t) (sf->ra_next + SPOCKFS_RA_MIN)) {
+		sf->ra_seq++;
+	}
+	else {
+		sf->ra_seq = 0;
+		sf->ra_window = SPOCKFS_RA_MIN;
+		spockfs_ra_drop(&sf->ra[0]);
+		spockfs_ra_drop(&sf->ra[1]);
+	}
+	if ((off_t) (offset + size) > sf->ra_next) sf->ra_next = offset + size;
+
+	while(done < size) {
+		off_t pos = offset + done;
+		if (sf->ra_eof >= 0 && pos >= sf->ra_eof) {
+			eof = 1;
+			break;
+		}
+		struct spockfs_ra *ra = spockfs_ra_find(sf, pos);
+		if (!ra) break;
+		if (ra->state == SPOCKFS_RA_PENDING) {
+			pthread_cond_wait(&sf->cond, &sf->lock);
+			continue;
+		}
+		size_t chunk = (ra->offset + ra->len) - pos;
+		if (chunk > size - done) chunk = size - done;
+		memcpy(buf + done, ra->buf + (pos - ra->offset), chunk);
+		ra->served += chunk;
+		if (ra->served > ra->len) ra->served = ra->len;
+		done += chunk;
+	}
+
+	if (sf->ra_seq > 0) {
+		if (done == size || (eof && done > 0)) {
+			spockfs_stats_inc(readahead_hits);
+		}
+		else {
+			spockfs_stats_inc(readahead_misses);
+		}
+		spockfs_ra_schedule(sf, path, offset + size);
+	}
+	pthread_mutex_unlock(&sf->lock);
+
+	if (done < size && !eof) {
+		int ret = spockfs_fetch(path, buf + done, size - done, offset + done);
+		if (ret < 0) return done ? (int) done : ret;
+		done += ret;
+	}
+
+	return done;
+}
+
+// read from the server (through the read-ahead buffers when enabled)
+static int spockfs_data_read(struct spockfs_file *sf, const char *path, char *buf, size_t size, off_t offset) {
+	if (sf && spockfs_config.readahead_max) {
+		return spockfs_ra_read(sf, path, buf, size, offset);
+	}
+	return spockfs_fetch(path, buf, size, offset);
+}
+
+/*
+	read through the block caches (memory and disk), returns the number of bytes read
+	(less than size at the end of the file). Misses fetch whole blocks, data beyond the
+	size the file had at open is never cached.
+*/
+static int spockfs_cache_read(struct spockfs_file *sf, const char *path, char *buf, size_t size, off_t offset) {
+	size_t done = 0;
+
+	pthread_mutex_lock(&sf->lock);
+	uint64_t ino = sf->c_ino;
+	uint64_t version = sf->c_version;
+	uint64_t fsize = sf->c_size;
+	pthread_mutex_unlock(&sf->lock);
+
+	while(done < size) {
+		off_t pos = offset + done;
+		if ((uint64_t) pos >= fsize) break;
+		uint64_t index = pos / SPOCKFS_BLOCK_SIZE;
+		size_t from = pos % SPOCKFS_BLOCK_SIZE;
+		size_t chunk = SPOCKFS_BLOCK_SIZE - from;
+		if (chunk > size - done) chunk = size - done;
+
+		int ret = spockfs_cache_get(path, version, fsize, index, buf + done, from, chunk);
+		if (ret >= 0) {
+			spockfs_stats_inc(cache_hits);
+			__sync_fetch_and_add(&spockfs_stats.cache_bytes, ret);
+			done += ret;
+			if ((size_t) ret < chunk) return done;
+			continue;
+		}
+
+		spockfs_stats_inc(cache_misses);
+		off_t block_offset = index * SPOCKFS_BLOCK_SIZE;
+		size_t block_len = SPOCKFS_BLOCK_SIZE;
+		if (block_offset + block_len > fsize) block_len = fsize - block_offset;
+		char *block = malloc(block_len);
+		if (!block) return done ? (int) done : -ENOMEM;
+		uint64_t gen = spockfs_cache_generation();
+		if (spockfs_disk_enabled() && !spockfs_disk_get(path, ino, version, fsize, index, block, block_len)) {
+			spockfs_stats_inc(disk_hits);
+			__sync_fetch_and_add(&spockfs_stats.disk_bytes, block_len);
+			spockfs_cache_set(path, version, fsize, index, block, block_len, gen);
+			ret = block_len;
+		}
+		else {
+			if (spockfs_disk_enabled()) spockfs_stats_inc(disk_misses);
+			ret = spockfs_data_read(sf, path, block, block_len, block_offset);
+			if (ret < 0) {
+				free(block);
+				return done ? (int) done : ret;
+			}
+			// a short read means the file changed, do not cache it
+			if ((size_t) ret == block_len) {
+				spockfs_cache_set(path, version, fsize, index, block, block_len, gen);
+				if (spockfs_disk_enabled() && gen == spockfs_cache_generation()) {
+					spockfs_disk_set(path, ino, version, fsize, index, block, block_len);
+				}
+			}
+		}
+		size_t available = (size_t) ret > from ? ret - from : 0;
+		if (available > chunk) available = chunk;
+		memcpy(buf + done, block + from, available);
+		free(block);
+		done += available;
+		if (available < chunk) return done;
+	}
+
+	// the file could have grown after the open
+	if (done < size) {
+		int ret = spockfs_data_read(sf, path, buf + done, size - done, offset + done);
+		if (ret < 0) return done ? (int) done : ret;
+		done += ret;
+	}
+
+	return done;
+}
+
+/*
+	write-back
+
+	small writes on a handle are merged in a single dirty extent (adjacent or overlapping
+	writes extend it), flushed with a single PUT when it reaches writeback_size, when a
+	non-contiguous write arrives, after writeback_delay milliseconds (by the flusher thread),
+	on flush/fsync/release and before any operation needing the real content of the file.
+	Flush errors are reported by the following flush/fsync (so by close()).
+*/
+static int spockfs_put(const char *path, const char *buf, size_t size, off_t offset) {
+
+	spockfs_init2();
+
+        spockfs_header_range("Content-Range", offset, ((offset+size)-1));
+
+	sh_rr->body = buf;
+	sh_rr->body_len = size;
+
+	spockfs_run("PUT", headers);
+
+	spockfs_attr_invalidate(path);
+	spockfs_files_invalidate(path);
+
+	spockfs_check(200);
+
+        ret = size;
+end:
+	spockfs_free2();
+}
+
+// flush the dirty extent (wb_lock must be held)
+static int spockfs_wb_flush(struct spockfs_file *sf) {
+	if (!sf->wb_len) return 0;
+	pthread_mutex_lock(&sf->lock);
+	char *path = strdup(sf->path);
+	pthread_mutex_unlock(&sf->lock);
+	struct spockfs_file *cur = spockfs_file_cur;
+	spockfs_file_cur = sf;
+	int ret = path ? spockfs_put(path, sf->wb_buf, sf->wb_len, sf->wb_off) : -ENOMEM;
+	spockfs_file_cur = cur;
+	if (path) free(path);
+	spockfs_stats_inc(writeback_flushes);
+	__sync_fetch_and_add(&spockfs_stats.writeback_bytes, sf->wb_len);
+	__sync_fetch_and_sub(&spockfs_files.dirty_bytes, sf->wb_len);
+	__sync_fetch_and_sub(&spockfs_files.dirty_files, 1);
+	sf->wb_len = 0;
+	if (ret < 0) {
+		if (!sf->wb_error) sf->wb_error = ret;
+		return ret;
+	}
+	return 0;
+}
+
+static int spockfs_wb_write(struct spockfs_file *sf, const char *path, const char *buf, size_t size, off_t offset) {
+	int ret = size;
+	pthread_mutex_lock(&sf->wb_lock);
+	// not contiguous with the current extent ?
+	if (sf->wb_len && (offset > (off_t) (sf->wb_off + sf->wb_len) || (off_t) (offset + size) < sf->wb_off)) {
+		spockfs_wb_flush(sf);
+	}
+
+	off_t start = offset;
+	off_t end = offset + size;
+	if (sf->wb_len) {
+		if (sf->wb_off < start) start = sf->wb_off;
+		if ((off_t) (sf->wb_off + sf->wb_len) > end) end = sf->wb_off + sf->wb_len;
+	}
+	size_t len = end - start;
+	if (len > sf->wb_cap) {
+		char *tmp = realloc(sf->wb_buf, len);
+		if (!tmp) {
+			// no memory, flush and write directly
+			spockfs_wb_flush(sf);
+			pthread_mutex_unlock(&sf->wb_lock);
+			return spockfs_put(path, buf, size, offset);
+		}
+		sf->wb_buf = tmp;
+		sf->wb_cap = len;
+	}
+	if (sf->wb_len) {
+		// the extent grows backward
+		if (start < sf->wb_off) {
+			memmove(sf->wb_buf + (sf->wb_off - start), sf->wb_buf, sf->wb_len);
+		}
+	}
+	else {
+		sf->wb_since = spockfs_now();
+		__sync_fetch_and_add(&spockfs_files.dirty_files, 1);
+	}
+	memcpy(sf->wb_buf + (offset - start), buf, size);
+	__sync_fetch_and_add(&spockfs_files.dirty_bytes, len - sf->wb_len);
+	sf->wb_off = start;
+	sf->wb_len = len;
+	spockfs_stats_inc(writeback_writes);
+
+	// the cached attributes (size, mtime) are no more valid
+	spockfs_attr_invalidate(path);
+
+	if (sf->wb_len >= spockfs_config.writeback_size || spockfs_files.dirty_bytes > spockfs_config.writeback_max) {
+		spockfs_wb_flush(sf);
+	}
+	pthread_mutex_unlock(&sf->wb_lock);
+	return ret;
+}
+
+// flush the handle and consume its pending error
+static int spockfs_wb_sync(struct spockfs_file *sf) {
+	pthread_mutex_lock(&sf->wb_lock);
+	spockfs_wb_flush(sf);
+	int ret = sf->wb_error;
+	sf->wb_error = 0;
+	pthread_mutex_unlock(&sf->wb_lock);
+	return ret;
+}
+
+static void spockfs_file_unref(struct spockfs_file *sf) {
+	pthread_mutex_lock(&spockfs_files.lock);
+	sf->refs--;
+	if (!sf->refs) pthread_cond_broadcast(&spockfs_files.cond);
+	pthread_mutex_unlock(&spockfs_files.lock);
+}
+
+/*
+	flush the dirty handles opened on path (or all of the ones dirty for more than
+	"older" milliseconds when path is NULL)
+*/
+static void spockfs_files_flush(const char *path, uint64_t older) {
+	if (!spockfs_files.dirty_files) return;
+	uint64_t now = spockfs_now();
+	for(;;) {
+		struct spockfs_file *found = NULL;
+		pthread_mutex_lock(&spockfs_files.lock);
+		struct spockfs_file *sf = spockfs_files.head;
+		while(sf) {
+			if (sf->wb_len) {
+				if ((path && !strcmp(sf->path, path)) || (!path && now - sf->wb_since >= older)) {
+					found = sf;
+					found->refs++;
+					break;
+				}
+			}
+			sf = sf->next;
+		}
+		pthread_mutex_unlock(&spockfs_files.lock);
+		if (!found) break;
+		pthread_mutex_lock(&found->wb_lock);
+		spockfs_wb_flush(found);
+		pthread_mutex_unlock(&found->wb_lock);
+		spockfs_file_unref(found);
+	}
+}
+
+static void *spockfs_flusher(void *arg) {
+	spockfs_background = 1;
+	unsigned int delay = spockfs_config.writeback_delay;
+	if (delay < 20) delay = 20;
+	for(;;) {
+		usleep((delay / 2) * 1000);
+		spockfs_files_flush(NULL, spockfs_config.writeback_delay);
+	}
+	return NULL;
+}
+
+static int spockfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+	spockfs_init2();
+
+	spockfs_header_num("mode", mode);
+
+	spockfs_run("POST", headers);
+
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
+
+	spockfs_check(201);
+
+	fi->fh = (uint64_t) (uintptr_t) spockfs_file_new(path);
+	if (!fi->fh) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_mknod(const char *path, mode_t mode, dev_t dev) {
+
+	spockfs_init2();
+
+	spockfs_header_num("mode", mode);
+
+	spockfs_header_num("dev", dev);
+
+        spockfs_run("MKNOD", headers);
+
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
+
+	spockfs_check(201);
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_open(const char *path, struct fuse_file_info *fi) {
+
+	spockfs_init2();
+
+        spockfs_header_num("flag", fi->flags);
+
+	spockfs_run("OPEN", headers);
+
+	spockfs_check(200);
+
+	struct spockfs_file *sf = spockfs_file_new(path);
+	if (!sf) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	fi->fh = (uint64_t) (uintptr_t) sf;
+
+	// the validators for the block cache (older servers do not return them with OPEN)
+	if (spockfs_cache_enabled() || spockfs_disk_enabled()) {
+		if (sh_rr->x_spock_mode) {
+			sf->c_ino = sh_rr->x_spock_ino;
+			// the ETag catches the changes made in the same second too
+			sf->c_version = sh_rr->etag[0] ? spockfs_hash64(sh_rr->etag, strlen(sh_rr->etag)) : (uint64_t) sh_rr->x_spock_mtime;
+			sf->c_size = sh_rr->x_spock_size;
+			sf->c_valid = 1;
+		}
+		else {
+			struct stat st;
+			if (!spockfs_getattr(path, &st)) {
+				sf->c_ino = st.st_ino;
+				sf->c_version = st.st_mtime;
+				sf->c_size = st.st_size;
+				sf->c_valid = 1;
+			}
+		}
+	}
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_release(const char *path, struct fuse_file_info *fi) {
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	if (sf) {
+		spockfs_wb_sync(sf);
+		spockfs_file_destroy(sf);
+		fi->fh = 0;
+	}
+	return 0;
+}
+
+static int spockfs_access(const char *path, int mode) {
+
+	spockfs_init2();
+
+	spockfs_header_num("mode", mode);
+
+	spockfs_run("ACCESS", headers);
+
+	spockfs_check(200);
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	int ret;
+	// the server must know about the dirty data
+	spockfs_files_flush(path, 0);
+	spockfs_file_cur = sf;
+	if (sf && sf->c_valid && (spockfs_cache_enabled() || spockfs_disk_enabled())) {
+		ret = spockfs_cache_read(sf, path, buf, size, offset);
+	}
+	else {
+		ret = spockfs_data_read(sf, path, buf, size, offset);
+	}
+	spockfs_file_cur = NULL;
+	// a short read means end of file (the kernel zero-fills the rest of the page)
+	return ret;
+}
+
+static int spockfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	if (sf && spockfs_config.writeback_size) {
+		return spockfs_wb_write(sf, path, buf, size, offset);
+	}
+
+	spockfs_file_cur = sf;
+	int ret = spockfs_put(path, buf, size, offset);
+	spockfs_file_cur = NULL;
+	return ret;
+}
+
+static int spockfs_flush(const char *path, struct fuse_file_info *fi) {
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	if (!sf) return 0;
+	return spockfs_wb_sync(sf);
+}
+
+static int spockfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	if (!sf) return 0;
+	return spockfs_wb_sync(sf);
+}
+
+static int spockfs_chmod(const char *path, mode_t mode) {
+
+	spockfs_init2();
+
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "CHMOD", path, NULL, 1, mode, 0)) {
+		spockfs_header_num("mode", mode);
+		spockfs_run("CHMOD", headers);
+	}
+
+	spockfs_attr_invalidate(path);
+
+	spockfs_check(200);
+
+        ret = 0;
+end:
+	spockfs_batch_leave(&bop);
+	spockfs_free2();
+}
+
+static int spockfs_chown(const char *path, uid_t uid, gid_t gid) {
+
+	spockfs_init2();
+
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "CHOWN", path, NULL, 2, uid, gid)) {
+		spockfs_header_num("uid", uid);
+		spockfs_header_num("gid", gid);
+		spockfs_run("CHOWN", headers);
+	}
+
+	spockfs_attr_invalidate(path);
+
+	spockfs_check(200);
+
+        ret = 0;
+end:
+	spockfs_batch_leave(&bop);
+	spockfs_free2();
+}
+
+static int spockfs_listxattr(const char *path, char *buf, size_t len) {
+
+	spockfs_init2();
+
+        spockfs_header_num("size", len);	
+
+	spockfs_run("LISTXATTR", headers);
+
+	spockfs_check(200);
+
+	// special case for 0 length
+	if (len == 0) {
+		ret = sh_rr->x_spock_size;
+		goto end;
+	}
+
+	if (sh_rr->len > len) {
+		ret = -ERANGE;
+		goto end;
+	}
+
+	// transform \n to \0
+	uint64_t i;
+	for(i=0;i<sh_rr->len;i++) {
+		if (sh_rr->buf[i] == '\n') {
+			buf[i] = 0;
+		}
+		else {
+			buf[i] = sh_rr->buf[i];
+		}
+	}
+
+        ret = sh_rr->len;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_stats_xattr(char *buf, size_t len) {
+	char stats[4096];
+	size_t pos = 0;
+	struct spockfs_stats_item *item = spockfs_stats_items;
+	while(item->name) {
+		int ret = snprintf(stats + pos, sizeof(stats) - pos, "%s %llu\n", item->name, (unsigned long long) *item->value);
+		if (ret <= 0 || ret >= (int) (sizeof(stats) - pos)) return -ERANGE;
+		pos += ret;
+		item++;
+	}
+	if (len == 0) return pos;
+	if (pos > len) return -ERANGE;
+	memcpy(buf, stats, pos);
+	return pos;
+}
+
+#ifndef __APPLE__
+static int spockfs_getxattr(const char *path, const char *name, char *buf, size_t len) {
+#else
+static int spockfs_getxattr(const char *path, const char *name, char *buf, size_t len, uint32_t position) {
+#endif
+
+	// client statistics are exposed as a virtual xattr of the root
+	if (!strcmp(path, "/") && !strcmp(name, "user.spockfs.stats")) {
+		return spockfs_stats_xattr(buf, len);
+	}
+
+	spockfs_init2();
+
+	spockfs_header_num("size", len);
+
+	spockfs_header_target(name);
+
+        spockfs_run("GETXATTR", headers);
+
+	spockfs_check(200);
+
+        // special case for 0 length
+        if (len == 0) {
+                ret = sh_rr->x_spock_size;
+                goto end;
+        }
+
+        if (sh_rr->len > len) {
+                ret = -ERANGE;
+                goto end;
+        }
+
+	memcpy(buf, sh_rr->buf, sh_rr->len);
+
+        ret = sh_rr->len;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_removexattr(const char *path, const char *name) {
+
+	spockfs_init2();
+
+	spockfs_header_target(name);
+
+	spockfs_run("REMOVEXATTR", headers);
+
+	spockfs_attr_invalidate(path);
+
+	spockfs_check(200);
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+#ifndef __APPLE__
+static int spockfs_setxattr(const char *path, const char *name, const char *buf, size_t len, int flag) {
+#else
+static int spockfs_setxattr(const char *path, const char *name, const char *buf, size_t len, int flag, uint32_t position) {
+#endif
+
+	spockfs_init2();
+
+	spockfs_header_num("flag", flag);
+
+        spockfs_header_target(name);
+
+	sh_rr->body = buf;
+	sh_rr->body_len = len;
+
+        spockfs_run("SETXATTR", headers);
+
+	spockfs_attr_invalidate(path);
+
+	spockfs_check(200);
+
+        ret = 0;
+end:
+	spockfs_free2();
+}
+
+static int spockfs_truncate(const char *path, off_t n) {
+
+	spockfs_files_flush(path, 0);
 
 	spockfs_init2();
 
-	spockfs_header_num("mode", mode);
+	spockfs_header_num("size", n);
 
-	spockfs_run("POST", headers);
+	spockfs_run("TRUNCATE", headers);
 
-	spockfs_check(201);
+	spockfs_attr_invalidate(path);
+	spockfs_files_invalidate(path);
+
+	spockfs_check(200);
 
         ret = 0;
 end:
 	spockfs_free2();
 }
 
-static int spockfs_mknod(const char *path, mode_t mode, dev_t dev) {
+static int spockfs_rename(const char *target, const char *path) {
 
 	spockfs_init2();
 
-	spockfs_header_num("mode", mode);
+	// the dirty data must reach the file before it moves
+	spockfs_files_flush(target, 0);
 
-	spockfs_header_num("dev", dev);
+	spockfs_header_target(target);
 
-        spockfs_run("MKNOD", headers);
+	spockfs_run("RENAME", headers);
 
-	spockfs_check(201);
+	spockfs_attr_invalidate_tree(target);
+	spockfs_attr_invalidate_parent(target);
+	spockfs_attr_invalidate_tree(path);
+	spockfs_attr_invalidate_parent(path);
+
+	spockfs_check(200);
+
+	spockfs_files_rename(target, path);
+	spockfs_cache_invalidate_tree(target);
+	spockfs_cache_invalidate_tree(path);
+	// the objects under a renamed directory are protected by the inode validator
+	spockfs_disk_invalidate(target);
+	spockfs_disk_invalidate(path);
 
         ret = 0;
 end:
 	spockfs_free2();
 }
 
-static int spockfs_open(const char *path, struct fuse_file_info *fi) {
+static int spockfs_link(const char *target, const char *path) {
 
 	spockfs_init2();
 
-        spockfs_header_num("flag", fi->flags);
+        spockfs_header_target(target);
 
-	spockfs_run("OPEN", headers);
+        spockfs_run("LINK", headers);
 
-	spockfs_check(200);
+	spockfs_attr_invalidate(target);
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
+
+	spockfs_check(201);
 
         ret = 0;
 end:
 	spockfs_free2();
 }
 
-static int spockfs_access(const char *path, int mode) {
+static int spockfs_symlink(const char *target, const char *path) {
 
 	spockfs_init2();
 
-	spockfs_header_num("mode", mode);
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "SYMLINK", path, target, 0, 0, 0)) {
+		spockfs_header_target(target);
+		spockfs_run("SYMLINK", headers);
+	}
 
-	spockfs_run("ACCESS", headers);
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
 
-	spockfs_check(200);
+	spockfs_check(201);
+
+	ret = 0;
 
-        ret = 0;
 end:
+	spockfs_batch_leave(&bop);
 	spockfs_free2();
 }
 
-static int spockfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int spockfs_readlink(const char *path, char *buf, size_t len) {
 
-	spockfs_init2();
+	if (!spockfs_attr_get_link(path, buf, len)) return 0;
 
-        spockfs_header_range("Range", offset, ((offset+size)-1));
+	spockfs_init();
 
-	spockfs_run("GET", headers);
+	struct spockfs_flight *flight = NULL;
+	if (!spockfs_shared("READLINK", path, 0, 0, sh_rr, &flight)) {
+		spockfs_run("READLINK", NULL);
+	}
 
-	spockfs_check2(206, 200);
+	spockfs_check(200);
+
+	if (!sh_rr->buf) goto end;
 
-	if (sh_rr->len >= size) {
-		memcpy(buf, sh_rr->buf, size);
+	spockfs_attr_set_link(path, sh_rr->buf, sh_rr->len);
+
+	if (sh_rr->len >= len) {
+		// truncate
+		memcpy(buf, sh_rr->buf, len-1);	
+		buf[len-1] = 0;
 	}
 	else {
 		memcpy(buf, sh_rr->buf, sh_rr->len);
-		// fill with zero
-		memset(buf + sh_rr->len, 0, size - sh_rr->len);
+		buf[sh_rr->len] = 0;
 	}
 
-        ret = size;
+	ret = 0;
 end:
-	spockfs_free2();
+	spockfs_shared_done(flight, sh_rr);
+	spockfs_free();
 }
 
-static int spockfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int spockfs_unlink(const char *path) {
 
-	spockfs_init2();
+	spockfs_init();
 
-        spockfs_header_range("Content-Range", offset, ((offset+size)-1));
+	// the dirty data must reach the file before it goes away
+	spockfs_files_flush(path, 0);
 
-	sh_rr->body = buf;
-	sh_rr->body_len = size;
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "DELETE", path, NULL, 0, 0, 0)) {
+		spockfs_run("DELETE", NULL);
+	}
 
-	spockfs_run("PUT", headers);
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
+	spockfs_cache_invalidate(path);
+	spockfs_disk_invalidate(path);
 
 	spockfs_check(200);
 
-        ret = size;
+	ret = 0;
 end:
-	spockfs_free2();
+	spockfs_batch_leave(&bop);
+	spockfs_free();
 }
 
-static int spockfs_chmod(const char *path, mode_t mode) {
+static int spockfs_rmdir(const char *path) {
+
+	spockfs_init();
+
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "RMDIR", path, NULL, 0, 0, 0)) {
+		spockfs_run("RMDIR", NULL);
+	}
+
+	spockfs_attr_invalidate_tree(path);
+	spockfs_attr_invalidate_parent(path);
+        
+	spockfs_check(200);
+        
+        ret = 0;
+end:    
+	spockfs_batch_leave(&bop);
+	spockfs_free();
+}
+
+static int spockfs_mkdir(const char *path, mode_t mode) {
 
 	spockfs_init2();
 
-	spockfs_header_num("mode", mode);
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "MKDIR", path, NULL, 1, mode, 0)) {
+		spockfs_header_num("mode", mode);
+		spockfs_run("MKDIR", headers);
+	}
 
-	spockfs_run("CHMOD", headers);
+	spockfs_attr_invalidate(path);
+	spockfs_attr_invalidate_parent(path);
 
-	spockfs_check(200);
+	spockfs_check(201);
 
         ret = 0;
 end:
+	spockfs_batch_leave(&bop);
 	spockfs_free2();
 }
 
-static int spockfs_chown(const char *path, uid_t uid, gid_t gid) {
+#ifndef __APPLE__
+#if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
+static int spockfs_fallocate(const char *path, int mode, off_t offset, off_t size, struct fuse_file_info *fi) {
 
+	spockfs_files_flush(path, 0);
+	
 	spockfs_init2();
 
-        spockfs_header_num("uid", uid);
-        spockfs_header_num("gid", gid);
+        spockfs_header_num("mode", mode);
+
+	spockfs_header_range("Range", offset, (offset+size)-1);
 
-	spockfs_run("CHOWN", headers);
+	spockfs_run("FALLOCATE", headers);
 
+	spockfs_attr_invalidate(path);
+	spockfs_files_invalidate(path);
+	
 	spockfs_check(200);
 
         ret = 0;
 end:
-	spockfs_free2();
+	spockfs_free2();	
 }
+#endif
+#endif
 
-static int spockfs_listxattr(const char *path, char *buf, size_t len) {
+static int spockfs_utimens(const char *path, const struct timespec tv[2]) {
+
+	spockfs_files_flush(path, 0);
 
 	spockfs_init2();
 
-        spockfs_header_num("size", len);	
+	struct spockfs_bop bop;
+	if (!spockfs_batched(&bop, sh_rr, "UTIMENS", path, NULL, 2, tv[0].tv_sec, tv[1].tv_sec)) {
+		spockfs_header_num("atime", tv[0].tv_sec);
+		spockfs_header_num("mtime", tv[1].tv_sec);
+		spockfs_run("UTIMENS", headers);
+	}
 
-	spockfs_run("LISTXATTR", headers);
+	spockfs_attr_invalidate(path);
 
 	spockfs_check(200);
 
-	// special case for 0 length
-	if (len == 0) {
-		return sh_rr->x_spock_size;
-	}
+        ret = 0;
+end:
+	spockfs_batch_leave(&bop);
+	spockfs_free2();
+}
 
-	if (sh_rr->len > len) {
-		ret = -ERANGE;
-		goto end;
-	}
+// defined after the nodes
+static void *spockfs_watcher(void *arg);
 
-	// transform \n to \0
-	uint64_t i;
-	for(i=0;i<sh_rr->len;i++) {
-		if (sh_rr->buf[i] == '\n') {
-			buf[i] = 0;
+static void *spockfs_fuse_init(struct fuse_conn_info *conn) {
+	spockfs_multi_start();
+	spockfs_workers_start();
+	if (spockfs_config.writeback_size && spockfs_config.writeback_delay) {
+		pthread_t t;
+		if (!pthread_create(&t, NULL, spockfs_flusher, NULL)) {
+			pthread_detach(t);
 		}
-		else {
-			buf[i] = sh_rr->buf[i];
+	}
+	if (spockfs_config.watch) {
+		pthread_t t;
+		if (!pthread_create(&t, NULL, spockfs_watcher, NULL)) {
+			pthread_detach(t);
 		}
 	}
+	return NULL;
+}
 
-        ret = sh_rr->len;
-end:
-	spockfs_free2();
+/*
+	nodes
+
+	with the low-level API the kernel addresses objects by node id. Every object returned
+	by lookup() (or created) gets a node, indexed by the (dev, ino) reported by the server
+	(so hard links, or an object found again under a new name after a rename made by
+	another client, keep the same node) and carrying the names (paths) used for talking
+	with the server, one for every name the kernel looked up. Names are indexed by path and
+	linked to the name of their parent directory, so an unlink or a rename only touches
+	the names involved (and the cached names below a renamed directory). The kernel caches
+	entries and attributes for attr_ttl seconds (and non-existent names for negative_ttl)
+	and releases the nodes it drops with forget().
+
+	Node ids are never reused, so the generation is always 0.
+*/
+#define SPOCKFS_NODES_BUCKETS 65536
+
+struct spockfs_node;
+
+struct spockfs_name {
+	char *path;
+	struct spockfs_node *node;
+	// the name of the parent directory (NULL for the children of the root or when it is unknown)
+	struct spockfs_name *parent;
+	struct spockfs_name *children;
+	struct spockfs_name *prev_sibling;
+	struct spockfs_name *next_sibling;
+	// the other names of the same node
+	struct spockfs_name *next_name;
+	struct spockfs_name *next_path;
+};
+
+struct spockfs_node {
+	fuse_ino_t id;
+	dev_t dev;
+	ino_t ino;
+	mode_t type;
+	// the most recently used first, NULL when every name has been removed (or replaced) locally
+	struct spockfs_name *names;
+	uint64_t nlookup;
+	// still reachable by (dev, ino)
+	int indexed;
+	struct spockfs_node *next_id;
+	struct spockfs_node *next_ino;
+};
+
+static struct spockfs_nodes {
+	pthread_mutex_t lock;
+	struct spockfs_node *by_id[SPOCKFS_NODES_BUCKETS];
+	struct spockfs_node *by_ino[SPOCKFS_NODES_BUCKETS];
+	struct spockfs_name *by_path[SPOCKFS_NODES_BUCKETS];
+	fuse_ino_t next_id;
+	uint64_t names;
+} spockfs_nodes = { .lock = PTHREAD_MUTEX_INITIALIZER, .next_id = FUSE_ROOT_ID + 1 };
+
+#define spockfs_node_id_bucket(x) (x % SPOCKFS_NODES_BUCKETS)
+#define spockfs_node_ino_bucket(x, y) ((((uint64_t) x) ^ ((uint64_t) y)) % SPOCKFS_NODES_BUCKETS)
+#define spockfs_node_path_bucket(x) (spockfs_hash(x, strlen(x)) % SPOCKFS_NODES_BUCKETS)
+
+// lock must be held
+static struct spockfs_node *spockfs_node_find(fuse_ino_t id) {
+	struct spockfs_node *node = spockfs_nodes.by_id[spockfs_node_id_bucket(id)];
+	while(node) {
+		if (node->id == id) return node;
+		node = node->next_id;
+	}
+	return NULL;
 }
 
-#ifndef __APPLE__
-static int spockfs_getxattr(const char *path, const char *name, char *buf, size_t len) {
-#else
-static int spockfs_getxattr(const char *path, const char *name, char *buf, size_t len, uint32_t position) {
-#endif
+static void spockfs_node_unindex(struct spockfs_node *node) {
+	if (!node->indexed) return;
+	struct spockfs_node **prev = &spockfs_nodes.by_ino[spockfs_node_ino_bucket(node->dev, node->ino)];
+	while(*prev != node) prev = &(*prev)->next_ino;
+	*prev = node->next_ino;
+	node->indexed = 0;
+}
 
-	spockfs_init2();
+// lock must be held (the root has no name)
+static struct spockfs_name *spockfs_name_find(const char *path) {
+	struct spockfs_name *name = spockfs_nodes.by_path[spockfs_node_path_bucket(path)];
+	while(name) {
+		if (!strcmp(name->path, path)) return name;
+		name = name->next_path;
+	}
+	return NULL;
+}
 
-	spockfs_header_num("size", len);
+static void spockfs_name_index(struct spockfs_name *name) {
+	uint32_t bucket = spockfs_node_path_bucket(name->path);
+	name->next_path = spockfs_nodes.by_path[bucket];
+	spockfs_nodes.by_path[bucket] = name;
+}
 
-	spockfs_header_target(name);
+static void spockfs_name_unindex(struct spockfs_name *name) {
+	struct spockfs_name **prev = &spockfs_nodes.by_path[spockfs_node_path_bucket(name->path)];
+	while(*prev != name) prev = &(*prev)->next_path;
+	*prev = name->next_path;
+}
 
-        spockfs_run("GETXATTR", headers);
+// link the name to the name of its parent directory (if the kernel knows it)
+static void spockfs_name_attach(struct spockfs_name *name) {
+	char *slash = strrchr(name->path, '/');
+	name->parent = NULL;
+	if (slash > name->path) {
+		*slash = 0;
+		name->parent = spockfs_name_find(name->path);
+		*slash = '/';
+	}
+	name->prev_sibling = NULL;
+	name->next_sibling = NULL;
+	if (!name->parent) return;
+	name->next_sibling = name->parent->children;
+	if (name->next_sibling) name->next_sibling->prev_sibling = name;
+	name->parent->children = name;
+}
 
-	spockfs_check(200);
+static void spockfs_name_detach(struct spockfs_name *name) {
+	if (!name->parent) return;
+	if (name->prev_sibling) name->prev_sibling->next_sibling = name->next_sibling;
+	else name->parent->children = name->next_sibling;
+	if (name->next_sibling) name->next_sibling->prev_sibling = name->prev_sibling;
+	name->parent = NULL;
+}
 
-        // special case for 0 length
-        if (len == 0) {
-                return sh_rr->x_spock_size;
-        }
+// lock must be held, the name owns path from now on
+static struct spockfs_name *spockfs_name_add(struct spockfs_node *node, char *path) {
+	struct spockfs_name *name = calloc(1, sizeof(struct spockfs_name));
+	if (!name) return NULL;
+	name->path = path;
+	name->node = node;
+	spockfs_name_index(name);
+	spockfs_name_attach(name);
+	name->next_name = node->names;
+	node->names = name;
+	spockfs_nodes.names++;
+	return name;
+}
 
-        if (sh_rr->len > len) {
-                ret = -ERANGE;
-                goto end;
-        }
+// the names below it stay (unlinked from it) as they could still be valid
+static void spockfs_name_free(struct spockfs_name *name) {
+	spockfs_name_unindex(name);
+	spockfs_name_detach(name);
+	while(name->children) spockfs_name_detach(name->children);
+	struct spockfs_name **prev = &name->node->names;
+	while(*prev != name) prev = &(*prev)->next_name;
+	*prev = name->next_name;
+	free(name->path);
+	free(name);
+	spockfs_nodes.names--;
+}
 
-	memcpy(buf, sh_rr->buf, sh_rr->len);
+// drop a name and the names below it
+static void spockfs_name_remove(struct spockfs_name *name) {
+	while(name->children) spockfs_name_remove(name->children);
+	spockfs_name_free(name);
+}
 
-        ret = sh_rr->len;
-end:
-	spockfs_free2();
+// lock must be held (the root has no node)
+static struct spockfs_node *spockfs_node_by_path(const char *path) {
+	struct spockfs_name *name = spockfs_name_find(path);
+	return name ? name->node : NULL;
 }
 
-static int spockfs_removexattr(const char *path, const char *name) {
+// returns a copy of the path of a node (NULL if it is unknown or has been removed)
+static char *spockfs_node_path(fuse_ino_t id) {
+	if (id == FUSE_ROOT_ID) return strdup("/");
+	char *path = NULL;
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	struct spockfs_node *node = spockfs_node_find(id);
+	if (node && node->names) path = strdup(node->names->path);
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+	return path;
+}
 
-	spockfs_init2();
+static char *spockfs_node_child(fuse_ino_t parent, const char *name) {
+	char *base = spockfs_node_path(parent);
+	if (!base) return NULL;
+	size_t base_len = strlen(base);
+	// skip the slash for the root
+	if (base_len == 1) base_len = 0;
+	size_t name_len = strlen(name);
+	char *path = NULL;
+	if (base_len + 1 + name_len <= PATH_MAX) {
+		path = malloc(base_len + 1 + name_len + 1);
+		if (path) {
+			memcpy(path, base, base_len);
+			path[base_len] = '/';
+			memcpy(path + base_len + 1, name, name_len + 1);
+		}
+	}
+	free(base);
+	return path;
+}
 
-	spockfs_header_target(name);
+// map an object found at path to a node (a new lookup reference is taken), returns 0 on error
+static fuse_ino_t spockfs_node_get(const char *path, struct stat *st) {
+	if (!strcmp(path, "/")) return FUSE_ROOT_ID;
+	fuse_ino_t id = 0;
+	uint32_t bucket = spockfs_node_ino_bucket(st->st_dev, st->st_ino);
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	struct spockfs_node *node = spockfs_nodes.by_ino[bucket];
+	while(node) {
+		if (node->dev == st->st_dev && node->ino == st->st_ino) break;
+		node = node->next_ino;
+	}
+	// the inode number has been reused by the server for a different kind of object
+	if (node && node->type != (st->st_mode & S_IFMT)) {
+		spockfs_node_unindex(node);
+		node = NULL;
+	}
 
-	spockfs_run("REMOVEXATTR", headers);
+	struct spockfs_name *name = spockfs_name_find(path);
+	// the name now refers to another object (replaced by another client)
+	if (name && name->node != node) {
+		spockfs_name_remove(name);
+		name = NULL;
+	}
 
-	spockfs_check(200);
+	if (!node) {
+		node = calloc(1, sizeof(struct spockfs_node));
+		if (!node) goto end;
+		char *new_path = strdup(path);
+		if (!new_path || !spockfs_name_add(node, new_path)) {
+			if (new_path) free(new_path);
+			free(node);
+			goto end;
+		}
+		node->id = spockfs_nodes.next_id++;
+		node->dev = st->st_dev;
+		node->ino = st->st_ino;
+		node->type = st->st_mode & S_IFMT;
+		node->indexed = 1;
+		node->next_ino = spockfs_nodes.by_ino[bucket];
+		spockfs_nodes.by_ino[bucket] = node;
+		uint32_t id_bucket = spockfs_node_id_bucket(node->id);
+		node->next_id = spockfs_nodes.by_id[id_bucket];
+		spockfs_nodes.by_id[id_bucket] = node;
+		spockfs_stats.nodes++;
+	}
+	// a new name (an hard link, or the object has been moved)
+	else if (!name) {
+		char *new_path = strdup(path);
+		if (!new_path) goto end;
+		if (!spockfs_name_add(node, new_path)) {
+			free(new_path);
+			goto end;
+		}
+	}
+	// the most recently used name is the one used for talking with the server
+	else if (node->names != name) {
+		struct spockfs_name **prev = &node->names;
+		while(*prev != name) prev = &(*prev)->next_name;
+		*prev = name->next_name;
+		name->next_name = node->names;
+		node->names = name;
+	}
+	node->nlookup++;
+	id = node->id;
+end:
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+	return id;
+}
 
-        ret = 0;
+static void spockfs_node_forget(fuse_ino_t id, uint64_t nlookup) {
+	if (id == FUSE_ROOT_ID) return;
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	struct spockfs_node **prev = &spockfs_nodes.by_id[spockfs_node_id_bucket(id)];
+	while(*prev) {
+		struct spockfs_node *node = *prev;
+		if (node->id == id) {
+			if (node->nlookup > nlookup) {
+				node->nlookup -= nlookup;
+				break;
+			}
+			*prev = node->next_id;
+			spockfs_node_unindex(node);
+			while(node->names) spockfs_name_free(node->names);
+			free(node);
+			spockfs_stats.nodes--;
+			break;
+		}
+		prev = &node->next_id;
+	}
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+}
+
+// detach the name path (removed or replaced locally), the other names of the node are still valid
+static void spockfs_nodes_remove(const char *path) {
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	struct spockfs_name *name = spockfs_name_find(path);
+	if (name) spockfs_name_remove(name);
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+}
+
+// give a name (and the names below it) the new prefix, without memory it is simply dropped
+static void spockfs_name_move(struct spockfs_name *name, size_t old_len, const char *new, size_t new_len) {
+	size_t rest = strlen(name->path + old_len);
+	char *path = malloc(new_len + rest + 1);
+	if (!path) {
+		spockfs_name_remove(name);
+		return;
+	}
+	memcpy(path, new, new_len);
+	memcpy(path + new_len, name->path + old_len, rest + 1);
+	// a stale name (whose parent was unknown) could already be there
+	struct spockfs_name *stale = spockfs_name_find(path);
+	if (stale) spockfs_name_remove(stale);
+	spockfs_name_unindex(name);
+	free(name->path);
+	name->path = path;
+	spockfs_name_index(name);
+	struct spockfs_name *child = name->children;
+	while(child) {
+		struct spockfs_name *next = child->next_sibling;
+		spockfs_name_move(child, old_len, new, new_len);
+		child = next;
+	}
+}
+
+// update the names after a rename (of the object or of one of its parents)
+static void spockfs_nodes_rename(const char *old, const char *new) {
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	struct spockfs_name *name = spockfs_name_find(old);
+	struct spockfs_name *target = spockfs_name_find(new);
+	// renaming an hard link over another name of the same object does nothing
+	if (name && target && name->node == target->node) goto end;
+	if (target) spockfs_name_remove(target);
+	if (!name) goto end;
+	spockfs_name_detach(name);
+	spockfs_name_move(name, strlen(old), new, strlen(new));
+	// it could have been dropped (no memory)
+	if (spockfs_name_find(new) == name) spockfs_name_attach(name);
 end:
-	spockfs_free2();
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+}
+
+/*
+	watch
+
+	with the watch option a thread keeps a WATCH stream open on the root of the mount and
+	precisely invalidates (in the client caches and in the kernel) the objects changed on
+	the server, so long attr_ttl and negative_ttl are safe even on shared trees.
+	Changes could be lost while the stream is down, so everything is invalidated whenever
+	it is (re)established and when the server reports an overflow.
+*/
+#define SPOCKFS_INVAL_DATA 1
+#define SPOCKFS_INVAL_ENTRY 2
+#define SPOCKFS_WATCH_LINE_MAX (16 + (PATH_MAX * 3))
+
+// the kernel side (notifications are sent on the channel with libfuse 2, on the session with libfuse 3)
+#if FUSE_USE_VERSION >= 30
+static struct fuse_session *spockfs_notify;
+#else
+static struct fuse_chan *spockfs_notify;
+#endif
+
+struct spockfs_watch_stream {
+	char *buf;
+	size_t len;
+	int ready;
+	uint64_t last;
+};
+
+// node id of a path (0 if the kernel does not know it), lock must be held
+static fuse_ino_t spockfs_node_lookup(const char *path) {
+	if (!strcmp(path, "/")) return FUSE_ROOT_ID;
+	struct spockfs_node *node = spockfs_node_by_path(path);
+	return node ? node->id : 0;
+}
+
+// drop the cached attributes (and data) of path from the kernel, and its entry (with the attributes of the parent)
+static void spockfs_kernel_invalidate(const char *path, int what) {
+	if (!spockfs_notify) return;
+	const char *name = strrchr(path, '/') + 1;
+	size_t parent_len = name - path > 1 ? (name - path) - 1 : 1;
+	char *parent_path = strndup(path, parent_len);
+	if (!parent_path) return;
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	fuse_ino_t id = spockfs_node_lookup(path);
+	fuse_ino_t parent = spockfs_node_lookup(parent_path);
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+	free(parent_path);
+	// the lock is never held while notifying, the kernel could need to call us
+	if (id) {
+		fuse_lowlevel_notify_inval_inode(spockfs_notify, id, (what & SPOCKFS_INVAL_DATA) ? 0 : -1, 0);
+	}
+	if ((what & SPOCKFS_INVAL_ENTRY) && parent && *name) {
+		fuse_lowlevel_notify_inval_entry(spockfs_notify, parent, name, strlen(name));
+		fuse_lowlevel_notify_inval_inode(spockfs_notify, parent, -1, 0);
+	}
+}
+
+// forget everything (the stream has been (re)established or events have been lost)
+static void spockfs_watch_reset() {
+	spockfs_attr_invalidate_tree("/");
+	spockfs_cache_invalidate_tree("/");
+	pthread_mutex_lock(&spockfs_files.lock);
+	struct spockfs_file *sf = spockfs_files.head;
+	while(sf) {
+		pthread_mutex_lock(&sf->lock);
+		spockfs_ra_reset(sf);
+		sf->c_valid = 0;
+		pthread_mutex_unlock(&sf->lock);
+		sf = sf->next;
+	}
+	pthread_mutex_unlock(&spockfs_files.lock);
+
+	if (!spockfs_notify) return;
+	char **paths = NULL;
+	size_t count = 0;
+	uint32_t i;
+	pthread_mutex_lock(&spockfs_nodes.lock);
+	paths = malloc(sizeof(char *) * (spockfs_nodes.names + 1));
+	if (paths) {
+		for(i=0;i<SPOCKFS_NODES_BUCKETS;i++) {
+			struct spockfs_name *name = spockfs_nodes.by_path[i];
+			while(name && count < spockfs_nodes.names) {
+				paths[count] = strdup(name->path);
+				if (paths[count]) count++;
+				name = name->next_path;
+			}
+		}
+	}
+	pthread_mutex_unlock(&spockfs_nodes.lock);
+	spockfs_kernel_invalidate("/", SPOCKFS_INVAL_DATA);
+	for(i=0;i<count;i++) {
+		spockfs_kernel_invalidate(paths[i], SPOCKFS_INVAL_DATA|SPOCKFS_INVAL_ENTRY);
+		free(paths[i]);
+	}
+	if (paths) free(paths);
+}
+
+// paths are percent-encoded
+static void spockfs_watch_decode(char *s) {
+	char *dst = s;
+	while(*s) {
+		if (s[0] == '%' && isxdigit((unsigned char) s[1]) && isxdigit((unsigned char) s[2])) {
+			char hex[3] = { s[1], s[2], 0 };
+			*dst++ = (char) strtol(hex, NULL, 16);
+			s += 3;
+			continue;
+		}
+		*dst++ = *s++;
+	}
+	*dst = 0;
+}
+
+static int spockfs_watch_line(struct spockfs_watch_stream *ws, char *line) {
+	if (!ws->ready) {
+		// not a WATCH stream (e.g. an old server answering with an error)
+		if (strcmp(line, "READY")) return -1;
+		ws->ready = 1;
+		spockfs_stats_inc(watch_streams);
+		spockfs_watch_reset();
+		return 0;
+	}
+	// heartbeat
+	if (!*line) return 0;
+	spockfs_stats_inc(watch_events);
+	if (!strcmp(line, "OVERFLOW")) {
+		spockfs_watch_reset();
+		return 0;
+	}
+	char *path = strchr(line, ' ');
+	if (!path) return 0;
+	*path++ = 0;
+	spockfs_watch_decode(path);
+	if (path[0] != '/') return 0;
+
+	if (!strcmp(line, "MODIFY")) {
+		spockfs_attr_invalidate(path);
+		spockfs_files_invalidate(path);
+		spockfs_kernel_invalidate(path, SPOCKFS_INVAL_DATA);
+	}
+	else if (!strcmp(line, "ATTRIB")) {
+		spockfs_attr_invalidate(path);
+		spockfs_kernel_invalidate(path, 0);
+	}
+	else if (!strcmp(line, "CREATE")) {
+		// drop the negative entries
+		spockfs_attr_invalidate(path);
+		spockfs_attr_invalidate_parent(path);
+		spockfs_kernel_invalidate(path, SPOCKFS_INVAL_ENTRY);
+	}
+	else if (!strcmp(line, "DELETE")) {
+		// (directories are empty when removed)
+		spockfs_attr_invalidate(path);
+		spockfs_attr_invalidate_parent(path);
+		spockfs_files_invalidate(path);
+		spockfs_kernel_invalidate(path, SPOCKFS_INVAL_DATA|SPOCKFS_INVAL_ENTRY);
+	}
+	else if (!strcmp(line, "MOVE")) {
+		// the name now points to a different object (or to nothing), along with all of the names below it
+		spockfs_attr_invalidate_tree(path);
+		spockfs_attr_invalidate_parent(path);
+		spockfs_cache_invalidate_tree(path);
+		spockfs_files_invalidate(path);
+		spockfs_kernel_invalidate(path, SPOCKFS_INVAL_DATA|SPOCKFS_INVAL_ENTRY);
+	}
+	return 0;
+}
+
+static size_t spockfs_watch_body(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct spockfs_watch_stream *ws = (struct spockfs_watch_stream *) userdata;
+	size_t len = size * nmemb;
+	ws->last = spockfs_now();
+	// a (partial) line can not be longer than an event with an encoded path
+	if (ws->len > SPOCKFS_WATCH_LINE_MAX) return 0;
+	char *buf = realloc(ws->buf, ws->len + len);
+	if (!buf) return 0;
+	ws->buf = buf;
+	memcpy(ws->buf + ws->len, ptr, len);
+	ws->len += len;
+
+	char *line = ws->buf;
+	char *end = ws->buf + ws->len;
+	char *nl;
+	while((nl = memchr(line, '\n', end - line))) {
+		*nl = 0;
+		if (spockfs_watch_line(ws, line)) return 0;
+		line = nl + 1;
+	}
+	ws->len = end - line;
+	memmove(ws->buf, line, ws->len);
+	return len;
+}
+
+// the stream never ends, but a silent one (no heartbeats) is dead
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int spockfs_watch_progress(void *clientp, curl_off_t dltotal,  curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+#else
+static int spockfs_watch_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow) {
+#endif
+	struct spockfs_watch_stream *ws = (struct spockfs_watch_stream *) clientp;
+	return spockfs_now() - ws->last > (uint64_t) spockfs_config.watch_timeout * 1000 ? -1 : 0;
+}
+
+static void *spockfs_watcher(void *arg) {
+	spockfs_background = 1;
+	unsigned int delay = 1;
+	for(;;) {
+		struct spockfs_watch_stream ws;
+		memset(&ws, 0, sizeof(struct spockfs_watch_stream));
+		ws.last = spockfs_now();
+		char *url = NULL;
+		CURL *curl = NULL;
+		size_t mark = spockfs_arena_mark();
+		struct spockfs_http_rr *sh_rr = spockfs_arena_calloc(sizeof(struct spockfs_http_rr));
+		if (sh_rr) curl = spockfs_http_setup("WATCH", "/", sh_rr, NULL, &url);
+		if (curl) {
+			curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+			curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, spockfs_watch_progress);
+			curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &ws);
+#else
+			curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, spockfs_watch_progress);
+			curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &ws);
+#endif
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, spockfs_watch_body);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ws);
+			curl_easy_perform(curl);
+			// the connection is dedicated to the stream, do not pool it
+			curl_easy_cleanup(curl);
+			spockfs_arena_release(url);
+		}
+		if (sh_rr) spockfs_arena_release(sh_rr);
+		if (ws.buf) free(ws.buf);
+		spockfs_arena_rewind(mark);
+		// unreachable servers (or servers without WATCH) are retried less and less often
+		if (ws.ready) {
+			delay = 1;
+		}
+		else if (delay < 60) {
+			delay *= 2;
+		}
+		sleep(delay);
+	}
+	return NULL;
 }
 
-#ifndef __APPLE__
-static int spockfs_setxattr(const char *path, const char *name, const char *buf, size_t len, int flag) {
-#else
-static int spockfs_setxattr(const char *path, const char *name, const char *buf, size_t len, int flag, uint32_t position) {
-#endif
+/*
+	low-level hooks
 
-	spockfs_init2();
+	they resolve the node ids to paths and call the path-based operations above
+*/
 
-	spockfs_header_num("flag", flag);
+/*
+	reads (up to max_read bytes) and directory listings are assembled in a per-thread
+	buffer, reused by the following requests (freed when the thread exits)
+*/
+struct spockfs_tbuf {
+	char *buf;
+	size_t len;
+};
 
-        spockfs_header_target(name);
+static pthread_key_t spockfs_tbuf_key;
 
-	sh_rr->body = buf;
-	sh_rr->body_len = len;
+static void spockfs_tbuf_free(void *data) {
+	struct spockfs_tbuf *tbuf = (struct spockfs_tbuf *) data;
+	if (tbuf->buf) free(tbuf->buf);
+	free(tbuf);
+}
 
-        spockfs_run("SETXATTR", headers);
+static char *spockfs_thread_buf(size_t len) {
+	struct spockfs_tbuf *tbuf = pthread_getspecific(spockfs_tbuf_key);
+	if (!tbuf) {
+		tbuf = calloc(1, sizeof(struct spockfs_tbuf));
+		if (!tbuf) return NULL;
+		if (pthread_setspecific(spockfs_tbuf_key, tbuf)) {
+			free(tbuf);
+			return NULL;
+		}
+	}
+	if (len > tbuf->len) {
+		char *buf = realloc(tbuf->buf, len);
+		if (!buf) return NULL;
+		tbuf->buf = buf;
+		tbuf->len = len;
+	}
+	return tbuf->buf;
+}
+#define spockfs_ll_path(x) spockfs_req = req;\
+			char *path = spockfs_node_path(x);\
+			if (!path) {\
+				spockfs_req = NULL;\
+				fuse_reply_err(req, ENOENT);\
+				return;\
+			}
 
-	spockfs_check(200);
+#define spockfs_ll_child(x, y) spockfs_req = req;\
+			char *path = spockfs_node_child(x, y);\
+			if (!path) {\
+				spockfs_req = NULL;\
+				fuse_reply_err(req, ENOENT);\
+				return;\
+			}
 
-        ret = 0;
-end:
-	spockfs_free2();
+#define spockfs_ll_free() free(path);\
+			spockfs_req = NULL
+
+// the path of an open file (it follows renames, even when the node has been detached)
+static char *spockfs_ll_file_path(fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct spockfs_file *sf = (struct spockfs_file *) (uintptr_t) fi->fh;
+	if (!sf) return spockfs_node_path(ino);
+	pthread_mutex_lock(&sf->lock);
+	char *path = strdup(sf->path);
+	pthread_mutex_unlock(&sf->lock);
+	return path;
 }
 
-static int spockfs_truncate(const char *path, off_t n) {
+#define spockfs_ll_file(x, y) spockfs_req = req;\
+			char *path = spockfs_ll_file_path(x, y);\
+			if (!path) {\
+				spockfs_req = NULL;\
+				fuse_reply_err(req, ENOMEM);\
+				return;\
+			}
 
-	spockfs_init2();
+// reply with the entry of path (created by the caller if fi is set)
+static void spockfs_ll_entry(fuse_req_t req, const char *path, struct fuse_file_info *fi, int lookup) {
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(struct fuse_entry_param));
+	int ret = spockfs_getattr(path, &e.attr);
+	// let the kernel remember the non-existence of the name
+	if (ret == -ENOENT && lookup && spockfs_config.negative_ttl > 0) {
+		e.entry_timeout = spockfs_config.negative_ttl;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (!ret) {
+		e.ino = spockfs_node_get(path, &e.attr);
+		if (!e.ino) ret = -ENOMEM;
+	}
+	if (ret) {
+		if (fi) spockfs_release(path, fi);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	e.attr_timeout = spockfs_config.attr_ttl;
+	e.entry_timeout = spockfs_config.attr_ttl;
+	if (fi) {
+		// the request has been interrupted, drop the reference and the handle
+		if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+			spockfs_node_forget(e.ino, 1);
+			spockfs_release(path, fi);
+		}
+		return;
+	}
+	if (fuse_reply_entry(req, &e) == -ENOENT) {
+		spockfs_node_forget(e.ino, 1);
+	}
+}
 
-	spockfs_header_num("size", n);
+#define SPOCKFS_MAX_WRITE (1024 * 1024)
+
+static void spockfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+#if FUSE_USE_VERSION >= 30
+	/*
+		the kernel page cache absorbs small writes (and serves re-reads), requests can be up to 1MiB
+		and lookups in the same directory run in parallel.
+		Splice is not asked for: read data comes from HTTP bodies in memory and written data goes to
+		curl from memory, so a pipe would only add a copy in both directions
+	*/
+	unsigned int want = FUSE_CAP_ASYNC_READ|FUSE_CAP_PARALLEL_DIROPS;
+	if (!spockfs_config.no_writeback_cache) want |= FUSE_CAP_WRITEBACK_CACHE;
+	conn->want |= conn->capable & want;
+	conn->max_write = SPOCKFS_MAX_WRITE;
+	if (conn->max_readahead < SPOCKFS_MAX_WRITE) conn->max_readahead = SPOCKFS_MAX_WRITE;
+#endif
+	spockfs_fuse_init(conn);
+}
 
-	spockfs_run("TRUNCATE", headers);
+static void spockfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	spockfs_ll_child(parent, name);
+	spockfs_ll_entry(req, path, NULL, 1);
+	spockfs_ll_free();
+}
 
-	spockfs_check(200);
+#if FUSE_USE_VERSION >= 30
+static void spockfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+#else
+static void spockfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+#endif
+	spockfs_node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-        ret = 0;
-end:
-	spockfs_free2();
+static void spockfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	spockfs_ll_path(ino);
+	struct stat st;
+	int ret = spockfs_getattr(path, &st);
+	spockfs_ll_free();
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_attr(req, &st, spockfs_config.attr_ttl);
 }
 
-static int spockfs_rename(const char *target, const char *path) {
+static void spockfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	spockfs_ll_path(ino);
+	struct stat st;
+	int ret = 0;
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		ret = spockfs_chmod(path, attr->st_mode);
+	}
+	if (!ret && (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID))) {
+		ret = spockfs_chown(path, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1, (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+	}
+	if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+		ret = spockfs_truncate(path, attr->st_size);
+	}
+	if (!ret && (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME))) {
+		// UTIMENS sets both of them
+		struct timespec tv[2];
+		memset(tv, 0, sizeof(tv));
+		if ((to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME)) != (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME)) {
+			ret = spockfs_getattr(path, &st);
+			tv[0].tv_sec = st.st_atime;
+			tv[1].tv_sec = st.st_mtime;
+		}
+		if (to_set & FUSE_SET_ATTR_ATIME) tv[0].tv_sec = attr->st_atime;
+		if (to_set & FUSE_SET_ATTR_MTIME) tv[1].tv_sec = attr->st_mtime;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) tv[0].tv_sec = time(NULL);
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) tv[1].tv_sec = time(NULL);
+#endif
+		if (!ret) ret = spockfs_utimens(path, tv);
+	}
+	if (!ret) ret = spockfs_getattr(path, &st);
+	spockfs_ll_free();
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_attr(req, &st, spockfs_config.attr_ttl);
+}
 
-	spockfs_init2();
+static void spockfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	spockfs_ll_path(ino);
+	char link[PATH_MAX+1];
+	int ret = spockfs_readlink(path, link, sizeof(link));
+	spockfs_ll_free();
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_readlink(req, link);
+}
 
-	spockfs_header_target(target);
+static void spockfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_mknod(path, mode, rdev);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		spockfs_ll_entry(req, path, NULL, 0);
+	}
+	spockfs_ll_free();
+}
 
-	spockfs_run("RENAME", headers);
+static void spockfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_mkdir(path, mode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		spockfs_ll_entry(req, path, NULL, 0);
+	}
+	spockfs_ll_free();
+}
 
-	spockfs_check(200);
+static void spockfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_unlink(path);
+	if (!ret) spockfs_nodes_remove(path);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-        ret = 0;
-end:
-	spockfs_free2();
+static void spockfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_rmdir(path);
+	if (!ret) spockfs_nodes_remove(path);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
 }
 
-static int spockfs_link(const char *target, const char *path) {
+static void spockfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_symlink(link, path);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		spockfs_ll_entry(req, path, NULL, 0);
+	}
+	spockfs_ll_free();
+}
 
-	spockfs_init2();
+#if FUSE_USE_VERSION >= 30
+static void spockfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) {
+	// RENAME_NOREPLACE and RENAME_EXCHANGE cannot be expressed with RENAME
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+#else
+static void spockfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+#endif
+	spockfs_ll_child(parent, name);
+	char *new_path = spockfs_node_child(newparent, newname);
+	if (!new_path) {
+		spockfs_ll_free();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int ret = spockfs_rename(path, new_path);
+	if (!ret) spockfs_nodes_rename(path, new_path);
+	free(new_path);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-        spockfs_header_target(target);
+static void spockfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	spockfs_ll_child(newparent, newname);
+	char *target = spockfs_node_path(ino);
+	if (!target) {
+		spockfs_ll_free();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int ret = spockfs_link(target, path);
+	free(target);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		spockfs_ll_entry(req, path, NULL, 0);
+	}
+	spockfs_ll_free();
+}
 
-        spockfs_run("LINK", headers);
+static void spockfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	spockfs_ll_child(parent, name);
+	int ret = spockfs_create(path, mode, fi);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		spockfs_ll_entry(req, path, fi, 0);
+	}
+	spockfs_ll_free();
+}
 
-	spockfs_check(201);
+static void spockfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	spockfs_ll_path(ino);
+	int ret = spockfs_open(path, fi);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	}
+	else if (fuse_reply_open(req, fi) == -ENOENT) {
+		spockfs_release(path, fi);
+	}
+	spockfs_ll_free();
+}
 
-        ret = 0;
-end:
-	spockfs_free2();
+static void spockfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	char *buf = spockfs_thread_buf(size);
+	int ret = buf ? spockfs_read(path, buf, size, off, fi) : -ENOMEM;
+	spockfs_ll_free();
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_buf(req, buf, ret);
 }
 
-static int spockfs_symlink(const char *target, const char *path) {
+static void spockfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	int ret = spockfs_write(path, buf, size, off, fi);
+	spockfs_ll_free();
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_write(req, ret);
+}
 
-	spockfs_init2();
+static void spockfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	int ret = spockfs_flush(path, fi);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-        spockfs_header_target(target);
+static void spockfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	int ret = spockfs_release(path, fi);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-        spockfs_run("SYMLINK", headers);
+static void spockfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	int ret = spockfs_fsync(path, datasync, fi);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-	spockfs_check(201);
+/*
+	directories are read one page at a time: the first one at opendir(), the following ones when
+	readdir() (and readdirplus() with libfuse 3) reaches the end of the current page, whose slices
+	are turned into kernel dirents (the offset is the index of the next item in the whole listing).
+	Only the current page is kept in memory, going back (rewinddir()) restarts from the first page.
+*/
+struct spockfs_dirent {
+	char *name;
+	struct stat st;
+	int has_st;
+};
 
-	ret = 0;
+struct spockfs_dir {
+	char *path;
+	pthread_mutex_t lock;
+	struct spockfs_dirent *items;
+	size_t count;
+	size_t size;
+	// the offset of the first item of the page
+	off_t base;
+	// where the next page starts
+	uint64_t cookie;
+	int eof;
+	int error;
+};
 
-end:
-	spockfs_free2();
+static void spockfs_dir_clear(struct spockfs_dir *dir) {
+	size_t i;
+	for(i=0;i<dir->count;i++) {
+		free(dir->items[i].name);
+	}
+	dir->count = 0;
 }
 
-static int spockfs_readlink(const char *path, char *buf, size_t len) {
-
-	spockfs_init();
+static void spockfs_dir_destroy(struct spockfs_dir *dir) {
+	spockfs_dir_clear(dir);
+	if (dir->items) free(dir->items);
+	if (dir->path) free(dir->path);
+	pthread_mutex_destroy(&dir->lock);
+	free(dir);
+}
 
-        spockfs_run("READLINK", NULL);
+static int spockfs_ll_fill(void *data, const char *name, const struct stat *st) {
+	struct spockfs_dir *dir = (struct spockfs_dir *) data;
+	if (dir->count >= dir->size) {
+		size_t size = dir->size ? dir->size * 2 : 64;
+		struct spockfs_dirent *items = realloc(dir->items, sizeof(struct spockfs_dirent) * size);
+		if (!items) goto error;
+		dir->items = items;
+		dir->size = size;
+	}
+	struct spockfs_dirent *item = &dir->items[dir->count];
+	memset(item, 0, sizeof(struct spockfs_dirent));
+	item->name = strdup(name);
+	if (!item->name) goto error;
+	if (st) {
+		item->st = *st;
+		item->has_st = 1;
+	}
+	// some tools skip items with inode 0
+	if (!item->st.st_ino) item->st.st_ino = (ino_t) -1;
+	dir->count++;
+	return 0;
+error:
+	dir->error = 1;
+	return 1;
+}
 
-	spockfs_check(200);
+// replace the items with the next page (or with the first one)
+static int spockfs_dir_fetch(struct spockfs_dir *dir, int first) {
+	off_t base = dir->base + (off_t) dir->count;
+	if (first) {
+		base = 0;
+		dir->cookie = 0;
+	}
+	spockfs_dir_clear(dir);
+	dir->base = base;
+	dir->eof = 0;
+	dir->error = 0;
+	uint64_t cookie = dir->cookie;
+	int ret = spockfs_readdir(dir->path, &cookie, dir, spockfs_ll_fill);
+	if (!ret && dir->error) ret = -ENOMEM;
+	if (ret) {
+		// the same page is requested again by the next readdir()
+		spockfs_dir_clear(dir);
+		return ret;
+	}
+	dir->cookie = cookie;
+	// an empty page cannot be followed by other items
+	dir->eof = !cookie || !dir->count;
+	return 0;
+}
 
-	if (!sh_rr->buf) goto end;
+// load the page containing the item at off (no items are left if it is after the end)
+static int spockfs_dir_seek(struct spockfs_dir *dir, off_t off) {
+	int ret;
+	if (off < dir->base) {
+		if ((ret = spockfs_dir_fetch(dir, 1))) return ret;
+	}
+	while(off >= dir->base + (off_t) dir->count && !dir->eof) {
+		if ((ret = spockfs_dir_fetch(dir, 0))) return ret;
+	}
+	return 0;
+}
 
-	if (sh_rr->len >= len) {
-		// truncate
-		memcpy(buf, sh_rr->buf, len-1);	
-		buf[len-1] = 0;
+static void spockfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	spockfs_ll_path(ino);
+	struct spockfs_dir *dir = calloc(1, sizeof(struct spockfs_dir));
+	int ret = -ENOMEM;
+	if (dir) {
+		pthread_mutex_init(&dir->lock, NULL);
+		dir->path = path;
+		ret = spockfs_dir_fetch(dir, 1);
 	}
 	else {
-		memcpy(buf, sh_rr->buf, sh_rr->len);
-		buf[sh_rr->len] = 0;
+		free(path);
+	}
+	spockfs_req = NULL;
+	if (ret) {
+		if (dir) spockfs_dir_destroy(dir);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fi->fh = (uint64_t) (uintptr_t) dir;
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		spockfs_dir_destroy(dir);
 	}
-
-	ret = 0;
-end:
-	spockfs_free();
 }
 
-static int spockfs_unlink(const char *path) {
-
-	spockfs_init();
-
-        spockfs_run("DELETE", NULL);
-
-	spockfs_check(200);
+/*
+	items are added until the reply is full, crossing page boundaries (every item sent with
+	its attributes takes a lookup reference on its node, as lookup() does, so nodes are taken
+	only for the items that fit in the reply)
+*/
+static void spockfs_ll_readdir_do(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi, int plus) {
+	struct spockfs_dir *dir = (struct spockfs_dir *) (uintptr_t) fi->fh;
+	char *buf = spockfs_thread_buf(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	size_t dir_len = strlen(dir->path);
+	// skip the slash for the root
+	if (dir_len == 1) dir_len = 0;
+	char path[PATH_MAX+1];
+	memcpy(path, dir->path, dir_len);
+	path[dir_len] = '/';
+
+	size_t len = 0;
+	pthread_mutex_lock(&dir->lock);
+	spockfs_req = req;
+	for(;;) {
+		int ret = spockfs_dir_seek(dir, off);
+		if (ret) {
+			spockfs_req = NULL;
+			pthread_mutex_unlock(&dir->lock);
+			// report the error only if nothing can be returned
+			if (!len) {
+				fuse_reply_err(req, -ret);
+				return;
+			}
+			fuse_reply_buf(req, buf, len);
+			return;
+		}
+		if (off >= dir->base + (off_t) dir->count) break;
+		struct spockfs_dirent *item = &dir->items[off - dir->base];
+		size_t entry_len;
+		if (!plus) {
+			entry_len = fuse_add_direntry(req, buf + len, size - len, item->name, &item->st, off + 1);
+			if (entry_len > size - len) break;
+			len += entry_len;
+			off++;
+			continue;
+		}
+#if FUSE_USE_VERSION >= 30
+		if (fuse_add_direntry_plus(req, NULL, 0, item->name, NULL, 0) > size - len) break;
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.attr = item->st;
+		size_t name_len = strlen(item->name);
+		// without attributes (or for . and ..) only the name is sent
+		if (item->has_st && strcmp(item->name, ".") && strcmp(item->name, "..") && dir_len + 1 + name_len <= PATH_MAX) {
+			memcpy(path + dir_len + 1, item->name, name_len + 1);
+			e.ino = spockfs_node_get(path, &e.attr);
+			if (e.ino) {
+				e.attr_timeout = spockfs_config.attr_ttl;
+				e.entry_timeout = spockfs_config.attr_ttl;
+			}
+		}
+		len += fuse_add_direntry_plus(req, buf + len, size - len, item->name, &e, off + 1);
+		off++;
+#endif
+	}
+	spockfs_req = NULL;
+	pthread_mutex_unlock(&dir->lock);
+	fuse_reply_buf(req, buf, len);
+}
 
-	ret = 0;
-end:
-	spockfs_free();
+static void spockfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	spockfs_ll_readdir_do(req, size, off, fi, 0);
 }
 
-static int spockfs_rmdir(const char *path) {
+#if FUSE_USE_VERSION >= 30
+static void spockfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	spockfs_ll_readdir_do(req, size, off, fi, 1);
+}
+#endif
 
-	spockfs_init();
+static void spockfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct spockfs_dir *dir = (struct spockfs_dir *) (uintptr_t) fi->fh;
+	if (dir) spockfs_dir_destroy(dir);
+	fuse_reply_err(req, 0);
+}
 
-	spockfs_run("RMDIR", NULL);
-        
-	spockfs_check(200);
-        
-        ret = 0;
-end:    
-	spockfs_free();
+static void spockfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	spockfs_ll_path(ino);
+	struct statvfs vfs;
+	memset(&vfs, 0, sizeof(struct statvfs));
+	int ret = spockfs_statfs(path, &vfs);
+	spockfs_ll_free();
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_statfs(req, &vfs);
 }
 
-static int spockfs_mkdir(const char *path, mode_t mode) {
+// a 0 size asks for the size of the value
+static void spockfs_ll_xattr_reply(fuse_req_t req, char *buf, size_t size, int ret) {
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	}
+	else if (!size) {
+		fuse_reply_xattr(req, ret);
+	}
+	else {
+		fuse_reply_buf(req, buf, ret);
+	}
+}
 
-	spockfs_init2();
+#ifdef __APPLE__
+static void spockfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags, uint32_t position) {
+	spockfs_ll_path(ino);
+	int ret = spockfs_setxattr(path, name, value, size, flags, position);
+#else
+static void spockfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
+	spockfs_ll_path(ino);
+	int ret = spockfs_setxattr(path, name, value, size, flags);
+#endif
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-	spockfs_header_num("mode", mode);
+#ifdef __APPLE__
+static void spockfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size, uint32_t position) {
+#else
+static void spockfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+#endif
+	spockfs_ll_path(ino);
+	char *buf = size ? malloc(size) : NULL;
+#ifdef __APPLE__
+	int ret = (size && !buf) ? -ENOMEM : spockfs_getxattr(path, name, buf, size, position);
+#else
+	int ret = (size && !buf) ? -ENOMEM : spockfs_getxattr(path, name, buf, size);
+#endif
+	spockfs_ll_free();
+	spockfs_ll_xattr_reply(req, buf, size, ret);
+	if (buf) free(buf);
+}
 
-	spockfs_run("MKDIR", headers);
+static void spockfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	spockfs_ll_path(ino);
+	char *buf = size ? malloc(size) : NULL;
+	int ret = (size && !buf) ? -ENOMEM : spockfs_listxattr(path, buf, size);
+	spockfs_ll_free();
+	spockfs_ll_xattr_reply(req, buf, size, ret);
+	if (buf) free(buf);
+}
 
-	spockfs_check(201);
+static void spockfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+	spockfs_ll_path(ino);
+	int ret = spockfs_removexattr(path, name);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
+}
 
-        ret = 0;
-end:
-	spockfs_free2();
+static void spockfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	spockfs_ll_path(ino);
+	int ret = spockfs_access(path, mask);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
 }
 
 #ifndef __APPLE__
 #if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
-static int spockfs_fallocate(const char *path, int mode, off_t offset, off_t size, struct fuse_file_info *fi) {
-	
-	spockfs_init2();
-
-        spockfs_header_num("mode", mode);
-
-	spockfs_header_range("Range", offset, (offset+size)-1);
-
-	spockfs_run("FALLOCATE", headers);
-	
-	spockfs_check(200);
-
-        ret = 0;
-end:
-	spockfs_free2();	
+static void spockfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	spockfs_ll_file(ino, fi);
+	int ret = spockfs_fallocate(path, mode, offset, length, fi);
+	spockfs_ll_free();
+	fuse_reply_err(req, -ret);
 }
 #endif
 #endif
 
-static int spockfs_utimens(const char *path, const struct timespec tv[2]) {
-
-	spockfs_init2();
-
-	spockfs_header_num("atime", tv[0].tv_sec);
-
-	spockfs_header_num("mtime", tv[1].tv_sec);
-
-	spockfs_run("UTIMENS", headers);
-
-	spockfs_check(200);
-
-        ret = 0;
-end:
-	spockfs_free2();
-}
-
-static struct fuse_operations spockfs_ops = {
-	.readdir = spockfs_readdir,
-	.getattr = spockfs_getattr,
-	.create = spockfs_create,
-	.mknod = spockfs_mknod,
-	.open = spockfs_open,
-	.chmod = spockfs_chmod,
-	.chown = spockfs_chown,
-	.truncate = spockfs_truncate,
-	.write = spockfs_write,
-	.read = spockfs_read,
-	.access = spockfs_access,
-	.symlink = spockfs_symlink,
-	.readlink = spockfs_readlink,
-	.unlink = spockfs_unlink,
-	.rmdir = spockfs_rmdir,
-	.mkdir = spockfs_mkdir,
-	.link = spockfs_link,
-	.rename = spockfs_rename,
+static struct fuse_lowlevel_ops spockfs_ops = {
+	.init = spockfs_ll_init,
+	.lookup = spockfs_ll_lookup,
+	.forget = spockfs_ll_forget,
+	.getattr = spockfs_ll_getattr,
+	.setattr = spockfs_ll_setattr,
+	.opendir = spockfs_ll_opendir,
+	.readdir = spockfs_ll_readdir,
+	.releasedir = spockfs_ll_releasedir,
+	.create = spockfs_ll_create,
+	.mknod = spockfs_ll_mknod,
+	.open = spockfs_ll_open,
+	.release = spockfs_ll_release,
+	.flush = spockfs_ll_flush,
+	.fsync = spockfs_ll_fsync,
+	.write = spockfs_ll_write,
+	.read = spockfs_ll_read,
+	.access = spockfs_ll_access,
+	.symlink = spockfs_ll_symlink,
+	.readlink = spockfs_ll_readlink,
+	.unlink = spockfs_ll_unlink,
+	.rmdir = spockfs_ll_rmdir,
+	.mkdir = spockfs_ll_mkdir,
+	.link = spockfs_ll_link,
+	.rename = spockfs_ll_rename,
+#if FUSE_USE_VERSION >= 30
+	.readdirplus = spockfs_ll_readdirplus,
+#endif
 #ifndef __APPLE__
 #if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
-	.fallocate = spockfs_fallocate,
+	.fallocate = spockfs_ll_fallocate,
 #endif
 #endif
-	.statfs = spockfs_statfs,
-	.listxattr = spockfs_listxattr,
-	.getxattr = spockfs_getxattr,
-	.setxattr = spockfs_setxattr,
-	.removexattr = spockfs_removexattr,
-	.utimens = spockfs_utimens,
+	.statfs = spockfs_ll_statfs,
+	.listxattr = spockfs_ll_listxattr,
+	.getxattr = spockfs_ll_getxattr,
+	.setxattr = spockfs_ll_setxattr,
+	.removexattr = spockfs_ll_removexattr,
+};
+
+#define SPOCKFS_OPT(t, p) { t, offsetof(struct spockfs_config, p), 0 }
+#define SPOCKFS_FLAG(t, p) { t, offsetof(struct spockfs_config, p), 1 }
+
+static struct fuse_opt spockfs_opts[] = {
+	SPOCKFS_OPT("pool_size=%u", pool_size),
+	SPOCKFS_OPT("pool_idle=%u", pool_idle),
+	SPOCKFS_OPT("attr_ttl=%lf", attr_ttl),
+	SPOCKFS_OPT("attr_cache_size=%u", attr_cache_size),
+	SPOCKFS_OPT("negative_ttl=%lf", negative_ttl),
+	SPOCKFS_OPT("negative_cache_size=%u", negative_cache_size),
+	SPOCKFS_FLAG("noreaddirplus", no_readdirplus),
+	SPOCKFS_OPT("readdir_page=%u", readdir_page),
+	SPOCKFS_FLAG("nomulti", no_multi),
+	SPOCKFS_FLAG("nowritebackcache", no_writeback_cache),
+	SPOCKFS_OPT("multi_connections=%u", multi_connections),
+	SPOCKFS_OPT("stripes_max=%u", stripes_max),
+	SPOCKFS_OPT("stripe_size=%u", stripe_size),
+	SPOCKFS_OPT("workers=%u", workers),
+	SPOCKFS_OPT("readahead_max=%u", readahead_max),
+	SPOCKFS_OPT("writeback_size=%u", writeback_size),
+	SPOCKFS_OPT("writeback_delay=%u", writeback_delay),
+	SPOCKFS_OPT("writeback_max=%u", writeback_max),
+	SPOCKFS_OPT("cache_size=%u", cache_size),
+	SPOCKFS_OPT("cache_dir=%s", cache_dir),
+	SPOCKFS_OPT("cache_dir_size=%u", cache_dir_size),
+	SPOCKFS_OPT("batch_max=%u", batch_max),
+	SPOCKFS_OPT("batch_inflight=%u", batch_inflight),
+	SPOCKFS_FLAG("watch", watch),
+	SPOCKFS_OPT("watch_timeout=%u", watch_timeout),
+	FUSE_OPT_END
 };
 
 static int spockfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
@@ -900,22 +5582,141 @@ static int spockfs_opt_proc(void *data, const char *arg, int key, struct fuse_ar
 	return 1;
 }
 
-void spockfs_dns_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr) {
-	pthread_mutex_lock(&spockfs_config.dns_lock);
+void spockfs_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr) {
+	pthread_mutex_lock(&spockfs_config.share_lock[data]);
 }
 
-void spockfs_dns_unlock(CURL *curl, curl_lock_data data, void *userptr) {
-	pthread_mutex_unlock(&spockfs_config.dns_lock);
+void spockfs_share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+	pthread_mutex_unlock(&spockfs_config.share_lock[data]);
 }
 
 
 int main(int argc, char *argv[]) {
-	pthread_mutex_init(&spockfs_config.dns_lock, NULL);
-	spockfs_config.dns_cache = curl_share_init();
-	curl_share_setopt(spockfs_config.dns_cache, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
-	curl_share_setopt(spockfs_config.dns_cache, CURLSHOPT_LOCKFUNC, spockfs_dns_lock);
-	curl_share_setopt(spockfs_config.dns_cache, CURLSHOPT_UNLOCKFUNC, spockfs_dns_unlock);
+	int i;
+	for(i=0;i<CURL_LOCK_DATA_LAST;i++) {
+		pthread_mutex_init(&spockfs_config.share_lock[i], NULL);
+	}
+	pthread_mutex_init(&spockfs_config.pool_lock, NULL);
+	spockfs_config.pool_size = 32;
+	spockfs_config.pool_idle = 30;
+	spockfs_config.attr_ttl = 1;
+	spockfs_config.attr_cache_size = 65536;
+	spockfs_config.negative_ttl = 0.5;
+	spockfs_config.negative_cache_size = 16384;
+	spockfs_config.readdir_page = 1024;
+	spockfs_config.workers = 4;
+	spockfs_config.readahead_max = 4 * 1024 * 1024;
+	spockfs_config.writeback_size = 1024 * 1024;
+	spockfs_config.writeback_delay = 1000;
+	spockfs_config.writeback_max = 64 * 1024 * 1024;
+	spockfs_config.cache_size = 64 * 1024 * 1024;
+	spockfs_config.cache_dir_size = 1024;
+	spockfs_config.multi_connections = 32;
+	spockfs_config.stripes_max = 4;
+	spockfs_config.stripe_size = 512 * 1024;
+	spockfs_config.batch_max = 256;
+	spockfs_config.batch_inflight = 4;
+	spockfs_config.watch_timeout = 90;
+
+	spockfs_config.share = curl_share_init();
+	curl_share_setopt(spockfs_config.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(spockfs_config.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(spockfs_config.share, CURLSHOPT_LOCKFUNC, spockfs_share_lock);
+	curl_share_setopt(spockfs_config.share, CURLSHOPT_UNLOCKFUNC, spockfs_share_unlock);
+	spockfs_headers_init();
+	spockfs_url_init();
+
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	fuse_opt_parse(&args, NULL, NULL, spockfs_opt_proc);
-	return fuse_main(args.argc, args.argv, &spockfs_ops, NULL);
+	fuse_opt_parse(&args, &spockfs_config, spockfs_opts, spockfs_opt_proc);
+	if (spockfs_config.stripe_size && spockfs_config.stripe_size < 4096) {
+		fprintf(stderr, "stripe_size must be at least 4096 bytes (or 0 to disable striping)\n");
+		exit(1);
+	}
+#if LIBCURL_VERSION_NUM >= 0x074400
+	// the multi handle has its own connection cache
+	if (spockfs_config.no_multi) {
+		curl_share_setopt(spockfs_config.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	}
+#elif LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(spockfs_config.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	if (spockfs_config.attr_ttl > 0 || spockfs_config.negative_ttl > 0) {
+		spockfs_attr_init();
+	}
+	spockfs_cache_init();
+	if (spockfs_config.cache_dir) {
+		if (spockfs_disk_init()) {
+			fprintf(stderr, "unable to initialize the cache directory %s: %s\n", spockfs_config.cache_dir, strerror(errno));
+			exit(1);
+		}
+	}
+
+	pthread_key_create(&spockfs_tbuf_key, spockfs_tbuf_free);
+	pthread_key_create(&spockfs_arena_key, spockfs_arena_free);
+
+	int ret = 1;
+#if FUSE_USE_VERSION >= 30
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(&args, &opts)) return 1;
+	if (opts.show_help || !spockfs_config.http_url || !opts.mountpoint) {
+		fprintf(stderr, "usage: %s [options] <url> <mountpoint>\n", argv[0]);
+		if (opts.show_help) {
+			fuse_cmdline_help();
+			fuse_lowlevel_help();
+		}
+		return 1;
+	}
+	// the kernel must know the maximum size of read requests at mount time
+	char max_read[64];
+	snprintf(max_read, sizeof(max_read), "-omax_read=%u", SPOCKFS_MAX_WRITE);
+	fuse_opt_add_arg(&args, max_read);
+	struct fuse_session *se = fuse_session_new(&args, &spockfs_ops, sizeof(spockfs_ops), NULL);
+	if (se) {
+		if (fuse_set_signal_handlers(se) != -1) {
+			if (!fuse_session_mount(se, opts.mountpoint)) {
+				spockfs_notify = se;
+				fuse_daemonize(opts.foreground);
+				if (opts.singlethread) {
+					ret = fuse_session_loop(se);
+				}
+				else {
+					struct fuse_loop_config config;
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads = opts.max_idle_threads;
+					ret = fuse_session_loop_mt(se, &config);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+	free(opts.mountpoint);
+#else
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+	if (!spockfs_config.http_url || !mountpoint) {
+		fprintf(stderr, "usage: %s [options] <url> <mountpoint>\n", argv[0]);
+		return 1;
+	}
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	if (!ch) return 1;
+	struct fuse_session *se = fuse_lowlevel_new(&args, &spockfs_ops, sizeof(spockfs_ops), NULL);
+	if (se) {
+		if (fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			spockfs_notify = ch;
+			fuse_daemonize(foreground);
+			ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+#endif
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
 }
@@ -2,6 +2,7 @@ import unittest
 import os
 import shutil
 import stat
+import threading
 import time
 import xattr
 
@@ -36,6 +37,38 @@ class SpockFS(unittest.TestCase):
         self.assertEqual(s.st_size, 5)
         self.assertIsNone(os.remove(path))
 
+    def test_attr_invalidation(self):
+        path = os.path.join(self.testpath, 'growing')
+        with open(path, 'w') as f:
+            f.write('hello')
+        self.assertEqual(os.stat(path).st_size, 5)
+        with open(path, 'a') as f:
+            f.write('world')
+        self.assertEqual(os.stat(path).st_size, 10)
+        self.assertIsNone(os.chmod(path, stat.S_IRUSR))
+        self.assertEqual(stat.S_IMODE(os.stat(path).st_mode), stat.S_IRUSR)
+        path0 = os.path.join(self.testpath, 'olddir')
+        self.assertIsNone(os.mkdir(path0))
+        path1 = os.path.join(path0, 'item')
+        with open(path1, 'w') as f:
+            f.write('x')
+        self.assertTrue(os.path.exists(path1))
+        path2 = os.path.join(self.testpath, 'newdir')
+        self.assertIsNone(os.rename(path0, path2))
+        self.assertFalse(os.path.exists(path1))
+        self.assertTrue(os.path.exists(os.path.join(path2, 'item')))
+
+    def test_negative_lookup(self):
+        path = os.path.join(self.testpath, 'appearing')
+        self.assertFalse(os.path.exists(path))
+        with open(path, 'w') as f:
+            f.write('here')
+        self.assertTrue(os.path.exists(path))
+        path2 = os.path.join(self.testpath, 'appearing_dir')
+        self.assertFalse(os.path.exists(path2))
+        self.assertIsNone(os.mkdir(path2))
+        self.assertTrue(os.path.isdir(path2))
+
     def test_unlink(self):
         path = os.path.join(self.testpath, 'notfound')
         self.assertRaises(OSError, os.remove, path)
@@ -69,6 +102,60 @@ class SpockFS(unittest.TestCase):
         with open(path, 'r') as f:
             self.assertEqual(f.read(), 'spock' * 179 * 1024)
 
+    def test_cached_read(self):
+        path = os.path.join(self.testpath, 'cacheme')
+        blob = os.urandom(300 * 1024)
+        with open(path, 'w') as f:
+            f.write(blob)
+        for i in range(0, 3):
+            with open(path, 'r') as f:
+                self.assertEqual(f.read(), blob)
+        with open(path, 'r+') as f:
+            f.seek(200 * 1024)
+            f.write('spock')
+        with open(path, 'r') as f:
+            self.assertEqual(f.read(), blob[0:200 * 1024] + 'spock' + blob[200 * 1024 + 5:])
+        self.assertIsNone(os.remove(path))
+
+    def test_sequential_read(self):
+        path = os.path.join(self.testpath, 'streamme')
+        blob = os.urandom(8 * 1024 * 1024)
+        with open(path, 'w') as f:
+            f.write(blob)
+        with open(path, 'r') as f:
+            chunks = []
+            while True:
+                chunk = f.read(65536)
+                if not chunk:
+                    break
+                chunks.append(chunk)
+        self.assertEqual(''.join(chunks), blob)
+        with open(path, 'r+') as f:
+            self.assertEqual(f.read(4096), blob[0:4096])
+            f.seek(4096)
+            f.write('spock')
+            f.flush()
+            f.seek(0)
+            self.assertEqual(f.read(8192), blob[0:4096] + 'spock' + blob[4101:8192])
+        self.assertIsNone(os.remove(path))
+
+    def test_small_writes(self):
+        path = os.path.join(self.testpath, 'smallwrites')
+        with open(path, 'w') as f:
+            for i in range(0, 1000):
+                f.write('%04d' % i)
+                f.flush()
+            self.assertEqual(os.stat(path).st_size, 4000)
+            f.seek(2000)
+            f.write('spock')
+        with open(path, 'r') as f:
+            data = f.read()
+        self.assertEqual(len(data), 4000)
+        self.assertEqual(data[0:8], '00000001')
+        self.assertEqual(data[2000:2005], 'spock')
+        self.assertEqual(data[3996:4000], '0999')
+        self.assertIsNone(os.remove(path))
+
     def test_bigfile_with_random(self):
         path = os.path.join(self.testpath, 'bigfile2')
         blob = os.urandom(1024 * 1024)
@@ -107,6 +194,18 @@ class SpockFS(unittest.TestCase):
         with open(path3, 'r') as f:
             self.assertEqual(f.read(), 'copyme')
 
+    def test_link_unlink(self):
+        path = os.path.join(self.testpath, 'twonames')
+        with open(path, 'w') as f:
+            f.write('still here')
+        path2 = os.path.join(self.testpath, 'twonames_link')
+        self.assertIsNone(os.link(path, path2))
+        self.assertEqual(os.stat(path).st_ino, os.stat(path2).st_ino)
+        self.assertIsNone(os.remove(path))
+        with open(path2, 'r') as f:
+            self.assertEqual(f.read(), 'still here')
+        self.assertIsNone(os.remove(path2))
+
     def test_truncate(self):
         path = os.path.join(self.testpath, 'resizeme')
         with open(path, 'w') as f:
@@ -156,6 +255,19 @@ class SpockFS(unittest.TestCase):
         ldir.sort()
         self.assertEqual(items, ldir)
 
+    def test_readdir_pages(self):
+        # more items than a single page of the listing
+        path = os.path.join(self.testpath, 'bigdir')
+        self.assertIsNone(os.mkdir(path))
+        items = ['file%04d' % i for i in range(2500)]
+        for item in items:
+            with open(os.path.join(path, item), 'w') as f:
+                f.write('x')
+        ldir = os.listdir(path)
+        ldir.sort()
+        self.assertEqual(items, ldir)
+        shutil.rmtree(path)
+
     def test_mknod(self):
         path = os.path.join(self.testpath, 'the_fifo_of_spock')
         self.assertIsNone(os.mknod(path, stat.S_IFIFO))
@@ -175,6 +287,27 @@ class SpockFS(unittest.TestCase):
         self.assertFalse(os.access(path, os.R_OK))
         self.assertIsNone(os.chmod(path, stat.S_IRUSR))
         self.assertTrue(os.access(path, os.R_OK))
+
+    def test_concurrent_metadata(self):
+        # enough parallel operations to be grouped in BATCH requests
+        path = os.path.join(self.testpath, 'manyfiles')
+        os.mkdir(path)
+        items = [os.path.join(path, 'file%03d' % i) for i in range(64)]
+        for item in items:
+            with open(item, 'w') as f:
+                f.write('x')
+
+        def worker(item):
+            os.chmod(item, stat.S_IRUSR)
+            os.stat(item)
+            os.remove(item)
+        threads = [threading.Thread(target=worker, args=(item,)) for item in items]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(os.listdir(path), [])
+        self.assertIsNone(os.rmdir(path))
          
 
 
@@ -4,6 +4,13 @@
 #ifndef __FreeBSD__
 #include <sys/xattr.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#endif
 
 extern struct uwsgi_server uwsgi;
 
@@ -13,6 +20,10 @@ static struct spockfs {
 	struct uwsgi_string_list *mountpoints;
 	struct uwsgi_string_list *ro_mountpoints;
 	uint64_t xattr_limit;
+	uint64_t batch_limit;
+	int watch_heartbeat;
+	int fd_cache;
+	int fd_cache_ttl;
 } spockfs;
 
 static struct uwsgi_option spockfs_options[] = {
@@ -20,15 +31,23 @@ static struct uwsgi_option spockfs_options[] = {
 	{"spockfs-ro-mount", required_argument, 0, "serves a directory via spockfs under the specified mountpoint in readonly, syntax: <mountpoint>=<path>", uwsgi_opt_add_string_list, &spockfs.ro_mountpoints, 0},
 	{"spockfs-readonly-mount", required_argument, 0, "serves a directory via spockfs under the specified mountpoint in readonly, syntax: <mountpoint>=<path>", uwsgi_opt_add_string_list, &spockfs.ro_mountpoints, 0},
 	{"spockfs-xattr-limit", required_argument, 0, "set the max size for spockfs xattr operations (default 64k)", uwsgi_opt_set_64bit, &spockfs.xattr_limit, 0},
+	{"spockfs-batch-limit", required_argument, 0, "set the max body size of spockfs BATCH requests (default 1m)", uwsgi_opt_set_64bit, &spockfs.batch_limit, 0},
+	{"spockfs-watch-heartbeat", required_argument, 0, "send a heartbeat on idle spockfs WATCH streams every <n> seconds (default 30)", uwsgi_opt_set_int, &spockfs.watch_heartbeat, 0},
+	{"spockfs-fd-cache", required_argument, 0, "keep up to <n> files opened by spockfs data requests open in every worker (default 64, -1 disables)", uwsgi_opt_set_int, &spockfs.fd_cache, 0},
+	{"spockfs-fd-cache-ttl", required_argument, 0, "close the spockfs cached files unused for <n> seconds (default 10, -1 disables)", uwsgi_opt_set_int, &spockfs.fd_cache_ttl, 0},
 	UWSGI_END_OF_OPTIONS
 };
 
+// set (at startup) when every lookup is confined beneath the mount by the kernel (see below)
+static int spockfs_beneath;
+
 static int spockfs_build_path(char *path, struct wsgi_request *wsgi_req, char *item, uint16_t item_len) {
 	char *base = (char *) uwsgi_apps[wsgi_req->app_id].interpreter;
 	size_t base_len = (size_t) uwsgi_apps[wsgi_req->app_id].callable;
 
 	// first check for size
 	if (base_len + item_len > PATH_MAX) return -1;
+	if (spockfs_beneath) goto done;
 	// then check for invalid combinations (initial slash is already checked) /../ /.. /./
 	if (uwsgi_contains_n(item, item_len, "/../", 4)) return -1;
 	if (uwsgi_contains_n(item, item_len, "/./", 3)) return -1;
@@ -47,6 +66,7 @@ static int spockfs_build_path(char *path, struct wsgi_request *wsgi_req, char *i
 		}
 	}
 
+done:
 	memcpy(path, base, base_len);
 	memcpy(path + base_len, item, item_len);
 	// final 0
@@ -54,6 +74,254 @@ static int spockfs_build_path(char *path, struct wsgi_request *wsgi_req, char *i
 	return 0;
 }
 
+/*
+	path resolution
+
+	every mount keeps a descriptor of its directory (in responder1, opened at startup), objects
+	are resolved relative to it, so the kernel does not walk the base path again and again.
+	Objects are opened with openat2() and RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS, so neither '..'
+	nor symlinks (even in the middle of a path) can lead outside of the mount.
+	Methods working on a name (creating, removing, changing or stat'ing objects) open the parent
+	directory that way and use the *at() syscalls on the last component, never following it when
+	it is a symlink (a final '..' is refused). The calls without an *at() variant (access, xattrs
+	and inotify) go through the /proc/self/fd entry of a descriptor opened beneath the mount.
+	When all of this is available (Linux >= 5.6 with /proc) the '..' checks on the request path
+	are skipped, otherwise lookups are only relative to the mount descriptor (symlinks are followed
+	wherever they lead) and the checks are the only protection.
+*/
+#define spockfs_dirfd(x) ((int) (long) uwsgi_apps[x->app_id].responder1)
+
+// the path relative to the mount directory ("." for the directory itself)
+static char *spockfs_relpath(struct wsgi_request *wsgi_req, char *path) {
+	size_t base_len = (size_t) uwsgi_apps[wsgi_req->app_id].callable;
+	char *rel = path + base_len;
+	while(*rel == '/') rel++;
+	return *rel ? rel : ".";
+}
+
+#ifdef O_PATH
+#define SPOCKFS_O_PATH O_PATH
+#else
+#define SPOCKFS_O_PATH O_RDONLY
+#endif
+
+// the kernel (< 5.6) could not support openat2() (checked at startup)
+static int spockfs_openat2;
+// /proc/self/fd entries can stand for paths (checked at startup)
+static int spockfs_proc_fd;
+
+#define SPOCKFS_PROC_FD_LEN 64
+
+static int spockfs_openat_rel(struct wsgi_request *wsgi_req, char *rel, int flags) {
+	int dfd = spockfs_dirfd(wsgi_req);
+#ifdef SYS_openat2
+	if (spockfs_openat2) {
+		struct open_how how;
+		memset(&how, 0, sizeof(struct open_how));
+		how.flags = flags;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		int fd = syscall(SYS_openat2, dfd, rel, &how, sizeof(struct open_how));
+		// trying to escape from the mount
+		if (fd < 0 && errno == EXDEV) errno = EACCES;
+		return fd;
+	}
+#endif
+	return openat(dfd, rel, flags);
+}
+
+static int spockfs_openat(struct wsgi_request *wsgi_req, char *path, int flags) {
+	return spockfs_openat_rel(wsgi_req, spockfs_relpath(wsgi_req, path), flags);
+}
+
+/*
+	open the directory containing path (the mount descriptor is used for its direct children),
+	*name is set to the last component, release it with spockfs_parent_close()
+*/
+static int spockfs_parentat(struct wsgi_request *wsgi_req, char *path, char **name) {
+	char *rel = spockfs_relpath(wsgi_req, path);
+	size_t len = strlen(rel);
+	// "dir/" is "dir"
+	while(len > 1 && rel[len-1] == '/') rel[--len] = 0;
+	char *slash = strrchr(rel, '/');
+	*name = slash ? slash + 1 : rel;
+	// the parent of the parent could be outside of the mount
+	if (!strcmp(*name, "..")) {
+		errno = EACCES;
+		return -1;
+	}
+	if (!slash) return spockfs_dirfd(wsgi_req);
+	*slash = 0;
+	int fd = spockfs_openat_rel(wsgi_req, rel, SPOCKFS_O_PATH|O_DIRECTORY);
+	*slash = '/';
+	return fd;
+}
+
+// errno is preserved
+static void spockfs_parent_close(struct wsgi_request *wsgi_req, int fd) {
+	if (fd < 0 || fd == spockfs_dirfd(wsgi_req)) return;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+}
+
+// the /proc/self/fd entry of fd in buf (SPOCKFS_PROC_FD_LEN bytes)
+static char *spockfs_proc_path(char *buf, int fd) {
+	snprintf(buf, SPOCKFS_PROC_FD_LEN, "/proc/self/fd/%d", fd);
+	return buf;
+}
+
+// stat() beneath the mount (symlinks are followed only inside of it)
+static int spockfs_statat(struct wsgi_request *wsgi_req, char *path, struct stat *st) {
+	int fd = spockfs_openat(wsgi_req, path, SPOCKFS_O_PATH|O_CLOEXEC);
+	if (fd < 0) return -1;
+	int ret = fstat(fd, st);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+// access() beneath the mount
+static int spockfs_accessat(struct wsgi_request *wsgi_req, char *path, int mode) {
+#ifdef O_PATH
+	if (spockfs_proc_fd) {
+		char buf[SPOCKFS_PROC_FD_LEN];
+		int fd = spockfs_openat(wsgi_req, path, O_PATH|O_CLOEXEC);
+		if (fd < 0) return -1;
+		int ret = access(spockfs_proc_path(buf, fd), mode);
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return ret;
+	}
+#endif
+	return faccessat(spockfs_dirfd(wsgi_req), spockfs_relpath(wsgi_req, path), mode, 0);
+}
+
+/*
+	the operations on the last component of a path, relative to its parent directory
+	(they return -1 with errno set on error, like the syscalls)
+*/
+static int spockfs_lstatat(struct wsgi_request *wsgi_req, char *path, struct stat *st) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = fstatat(pfd, name, st, AT_SYMLINK_NOFOLLOW);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+static int spockfs_mkdirat(struct wsgi_request *wsgi_req, char *path, mode_t mode) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = mkdirat(pfd, name, mode);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+static int spockfs_mknodat(struct wsgi_request *wsgi_req, char *path, mode_t mode, dev_t dev) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = mknodat(pfd, name, mode, dev);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+// flags is 0 or AT_REMOVEDIR
+static int spockfs_unlinkat(struct wsgi_request *wsgi_req, char *path, int flags) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = unlinkat(pfd, name, flags);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+static int spockfs_symlinkat(struct wsgi_request *wsgi_req, char *target, char *path) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = symlinkat(target, pfd, name);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+// returns the new descriptor, a symlink is never followed (it could point outside of the mount)
+static int spockfs_createat(struct wsgi_request *wsgi_req, char *path, mode_t mode) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int fd = openat(pfd, name, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, mode);
+	spockfs_parent_close(wsgi_req, pfd);
+	return fd;
+}
+
+// the owner of a symlink is changed, not the one of its target (like lchown())
+static int spockfs_chownat(struct wsgi_request *wsgi_req, char *path, uid_t uid, gid_t gid) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	int ret = fchownat(pfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+/*
+	fchmodat() cannot portably avoid following a symlink, so they are refused (clients resolve
+	symlinks by themselves, so they never ask for them)
+*/
+static int spockfs_chmodat(struct wsgi_request *wsgi_req, char *path, mode_t mode) {
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) return -1;
+	struct stat st;
+	int ret = fstatat(pfd, name, &st, AT_SYMLINK_NOFOLLOW);
+	if (!ret) {
+		if (S_ISLNK(st.st_mode)) {
+			errno = EACCES;
+			ret = -1;
+		}
+		else {
+			ret = fchmodat(pfd, name, mode, 0);
+		}
+	}
+	spockfs_parent_close(wsgi_req, pfd);
+	return ret;
+}
+
+// path2 is renamed (or linked) to path
+static int spockfs_renameat(struct wsgi_request *wsgi_req, char *path2, char *path, int link) {
+	char *name2, *name;
+	int pfd2 = spockfs_parentat(wsgi_req, path2, &name2);
+	if (pfd2 < 0) return -1;
+	int ret = -1;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) goto end;
+	if (link) {
+		ret = linkat(pfd2, name2, pfd, name, 0);
+	}
+	else {
+		ret = renameat(pfd2, name2, pfd, name);
+	}
+	spockfs_parent_close(wsgi_req, pfd);
+end:
+	spockfs_parent_close(wsgi_req, pfd2);
+	return ret;
+}
+
+static int spockfs_truncateat(struct wsgi_request *wsgi_req, char *path, off_t size) {
+	// a fifo without readers fails instead of blocking
+	int fd = spockfs_openat(wsgi_req, path, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+	if (fd < 0) return -1;
+	int ret = ftruncate(fd, size);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
 static void spockfs_errno(struct wsgi_request *wsgi_req) {
 	switch(errno) {
         	case ENOENT:
@@ -94,6 +362,44 @@ static void spockfs_errno(struct wsgi_request *wsgi_req) {
 				return UWSGI_OK; \
 			   }
 
+/*
+	methods
+
+	the methods are mapped to their handlers by a table, indexed (at startup) by a hash of the
+	name length and of its first and last chars, so the dispatch costs a single lookup.
+	Methods always modifying the tree are refused on readonly mounts by the dispatcher (the
+	others check it by themselves when needed), methods not reading the request body refuse
+	requests having one.
+*/
+#define SPOCKFS_NEEDS_WRITE	(1 << 0)
+#define SPOCKFS_NEEDS_BODY	(1 << 1)
+
+struct spockfs_method {
+	const char *name;
+	uint16_t len;
+	int flags;
+	int (*func)(struct wsgi_request *, char *);
+};
+
+#define SPOCKFS_METHODS_SLOTS 64
+
+static struct spockfs_method *spockfs_methods_index[SPOCKFS_METHODS_SLOTS];
+
+static uint32_t spockfs_method_hash(const char *name, uint16_t len) {
+	return ((len * 31) + (name[0] * 7) + name[len-1]) & (SPOCKFS_METHODS_SLOTS - 1);
+}
+
+static struct spockfs_method *spockfs_method_find(const char *name, uint16_t len) {
+	if (len == 0) return NULL;
+	uint32_t slot = spockfs_method_hash(name, len);
+	while(spockfs_methods_index[slot]) {
+		struct spockfs_method *sm = spockfs_methods_index[slot];
+		if (sm->len == len && !memcmp(sm->name, name, len)) return sm;
+		slot = (slot + 1) & (SPOCKFS_METHODS_SLOTS - 1);
+	}
+	return NULL;
+}
+
 static int spockfs_response_add_header_num(struct wsgi_request *wsgi_req, char *key, uint16_t kl, uint64_t n) {
         char buf[sizeof(UMAX64_STR)+1];
         int ret = snprintf(buf, sizeof(UMAX64_STR)+1, "%llu", (unsigned long long) n);
@@ -105,16 +411,297 @@ static int spockfs_response_add_header_num(struct wsgi_request *wsgi_req, char *
 }
 
 
+/*
+	strong validator of an object: it changes with the inode, the size, the content (mtime)
+	and the attributes (ctime), so it is valid for both the data and the metadata
+*/
+#define SPOCKFS_ETAG_LEN 96
+
+#ifdef __APPLE__
+#define spockfs_nsec(st, x) (st)->st_##x##timespec.tv_nsec
+#else
+#define spockfs_nsec(st, x) (st)->st_##x##tim.tv_nsec
+#endif
+
+static int spockfs_etag(struct stat *st, char *buf) {
+	int ret = snprintf(buf, SPOCKFS_ETAG_LEN, "\"%llx-%llx-%llx.%lx-%llx.%lx\"",
+		(unsigned long long) st->st_ino, (unsigned long long) st->st_size,
+		(unsigned long long) st->st_mtime, (long) spockfs_nsec(st, m),
+		(unsigned long long) st->st_ctime, (long) spockfs_nsec(st, c));
+	if (ret <= 0 || ret >= SPOCKFS_ETAG_LEN) return -1;
+	return ret;
+}
+
+// the etag is listed in the value of the If-None-Match/If-Match header (or it is "*")
+static int spockfs_etag_match(char *value, uint16_t value_len, char *etag, int etag_len) {
+	if (value_len == 1 && value[0] == '*') return 1;
+	return uwsgi_contains_n(value, value_len, etag, etag_len);
+}
+
+// returns 1 (after preparing a 304 response) if the client already has the current version
+static int spockfs_not_modified(struct wsgi_request *wsgi_req, char *etag, int etag_len) {
+	uint16_t inm_len = 0;
+	char *inm = uwsgi_get_var(wsgi_req, "HTTP_IF_NONE_MATCH", 18, &inm_len);
+	if (!inm || !spockfs_etag_match(inm, inm_len, etag, etag_len)) return 0;
+	if (!uwsgi_response_prepare_headers(wsgi_req, "304 Not Modified", 16)) {
+		uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len);
+	}
+	return 1;
+}
+
+/*
+	descriptor cache
+
+	the files opened by GET, PUT, UTIMENS and FALLOCATE are kept open (per worker, shared by
+	its threads) in a LRU of --spockfs-fd-cache entries keyed by path and access mode, so
+	streams of small reads and writes do not pay an open() and a close() each.
+	RENAME, DELETE, RMDIR, TRUNCATE, CHMOD and CHOWN drop the entries of the involved paths
+	(and of the objects under them) in the worker running them and bump a generation counter
+	shared by all the workers. A hit is used as is while the generation is unchanged, otherwise
+	it is validated with a stat() of the path (another worker could have replaced the file or
+	changed its permissions) and a change of object, mode or owner reopens the file.
+	Changes made by local processes are not seen by the counter: a file they replace is served
+	until the next spockfs change or until the entry expires (--spockfs-fd-cache-ttl seconds
+	without being used, checked whenever the worker opens a file).
+*/
+struct spockfs_fd {
+	char *path;
+	size_t len;
+	uint32_t hash;
+	int mode;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	mode_t st_mode;
+	uid_t uid;
+	gid_t gid;
+	time_t used;
+	// value of spockfs_generation when it was last validated
+	uint64_t generation;
+	// threads using it, a dropped entry is closed by the last one
+	int refs;
+	int dropped;
+	struct spockfs_fd *hnext;
+	struct spockfs_fd *prev;
+	struct spockfs_fd *next;
+};
+
+static struct spockfs_fds {
+	pthread_mutex_t lock;
+	struct spockfs_fd **buckets;
+	uint32_t mask;
+	int count;
+	// most recently used first
+	struct spockfs_fd *head;
+	struct spockfs_fd *tail;
+} spockfs_fds = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// shared by the workers (allocated by the master), bumped by every change invalidating entries
+static uint64_t *spockfs_generation;
+
+static uint32_t spockfs_fd_hash(char *path, size_t len, int mode) {
+	uint32_t hash = 2166136261U ^ mode;
+	size_t i;
+	for(i=0;i<len;i++) {
+		hash = (hash ^ (uint8_t) path[i]) * 16777619U;
+	}
+	return hash;
+}
+
+// add an entry to the index and to the head of the LRU (the lock must be held)
+static void spockfs_fd_link(struct spockfs_fd *sfd) {
+	struct spockfs_fd **slot = &spockfs_fds.buckets[sfd->hash & spockfs_fds.mask];
+	sfd->hnext = *slot;
+	*slot = sfd;
+	sfd->prev = NULL;
+	sfd->next = spockfs_fds.head;
+	if (sfd->next) sfd->next->prev = sfd;
+	spockfs_fds.head = sfd;
+	if (!spockfs_fds.tail) spockfs_fds.tail = sfd;
+	spockfs_fds.count++;
+}
+
+// remove an entry from the index and from the LRU (the lock must be held)
+static void spockfs_fd_unlink(struct spockfs_fd *sfd) {
+	struct spockfs_fd **slot = &spockfs_fds.buckets[sfd->hash & spockfs_fds.mask];
+	while(*slot != sfd) slot = &(*slot)->hnext;
+	*slot = sfd->hnext;
+	if (sfd->prev) sfd->prev->next = sfd->next;
+	else spockfs_fds.head = sfd->next;
+	if (sfd->next) sfd->next->prev = sfd->prev;
+	else spockfs_fds.tail = sfd->prev;
+	spockfs_fds.count--;
+}
+
+static void spockfs_fd_destroy(struct spockfs_fd *sfd) {
+	close(sfd->fd);
+	free(sfd->path);
+	free(sfd);
+}
+
+// drop an entry (the lock must be held), it is closed now or by the last thread using it
+static void spockfs_fd_drop(struct spockfs_fd *sfd) {
+	spockfs_fd_unlink(sfd);
+	sfd->dropped = 1;
+	if (!sfd->refs) spockfs_fd_destroy(sfd);
+}
+
+// evict the least recently used entries not in use (the lock must be held)
+static void spockfs_fd_evict() {
+	struct spockfs_fd *sfd = spockfs_fds.tail;
+	while(sfd && spockfs_fds.count > spockfs.fd_cache) {
+		struct spockfs_fd *prev = sfd->prev;
+		if (!sfd->refs) spockfs_fd_drop(sfd);
+		sfd = prev;
+	}
+}
+
+// close the entries unused for --spockfs-fd-cache-ttl seconds (the lock must be held)
+static void spockfs_fd_expire(time_t now) {
+	if (spockfs.fd_cache_ttl < 0) return;
+	struct spockfs_fd *sfd = spockfs_fds.tail;
+	while(sfd && sfd->used + spockfs.fd_cache_ttl <= now) {
+		struct spockfs_fd *prev = sfd->prev;
+		if (!sfd->refs) spockfs_fd_drop(sfd);
+		sfd = prev;
+	}
+}
+
+static struct spockfs_fd *spockfs_fd_lookup(char *path, size_t len, int mode, uint32_t hash) {
+	struct spockfs_fd *sfd = spockfs_fds.buckets[hash & spockfs_fds.mask];
+	while(sfd) {
+		if (sfd->hash == hash && sfd->mode == mode && sfd->len == len && !memcmp(sfd->path, path, len)) return sfd;
+		sfd = sfd->hnext;
+	}
+	return NULL;
+}
+
+/*
+	open path (O_RDONLY or O_WRONLY) through the cache, the descriptor must be given back
+	with spockfs_fd_close() (*sfd_p is NULL for uncached ones)
+*/
+static int spockfs_fd_open(struct wsgi_request *wsgi_req, char *path, int mode, struct spockfs_fd **sfd_p) {
+	*sfd_p = NULL;
+	if (spockfs.fd_cache <= 0) return spockfs_openat(wsgi_req, path, mode);
+
+	size_t len = strlen(path);
+	uint32_t hash = spockfs_fd_hash(path, len, mode);
+	// read before the check (or the open), a change racing with it forces another check
+	uint64_t generation = __atomic_load_n(spockfs_generation, __ATOMIC_ACQUIRE);
+	struct stat st;
+
+	pthread_mutex_lock(&spockfs_fds.lock);
+	if (!spockfs_fds.buckets) {
+		uint32_t slots = 16;
+		while(slots < (uint32_t) spockfs.fd_cache * 2) slots <<= 1;
+		spockfs_fds.buckets = uwsgi_calloc(sizeof(struct spockfs_fd *) * slots);
+		spockfs_fds.mask = slots - 1;
+	}
+	time_t now = uwsgi_now();
+	spockfs_fd_expire(now);
+	struct spockfs_fd *sfd = spockfs_fd_lookup(path, len, mode, hash);
+	if (sfd) {
+		sfd->refs++;
+		int valid = sfd->generation == generation;
+		pthread_mutex_unlock(&spockfs_fds.lock);
+		// is the path still pointing to the cached object (with the same permissions) ?
+		if (valid || (!spockfs_statat(wsgi_req, path, &st) && st.st_dev == sfd->dev && st.st_ino == sfd->ino &&
+			st.st_mode == sfd->st_mode && st.st_uid == sfd->uid && st.st_gid == sfd->gid)) {
+			pthread_mutex_lock(&spockfs_fds.lock);
+			sfd->generation = generation;
+			sfd->used = now;
+			if (!sfd->dropped && spockfs_fds.head != sfd) {
+				spockfs_fd_unlink(sfd);
+				spockfs_fd_link(sfd);
+			}
+			pthread_mutex_unlock(&spockfs_fds.lock);
+			uwsgi_metric_inc("spockfs.fd_cache.hits", NULL, 1);
+			*sfd_p = sfd;
+			return sfd->fd;
+		}
+		pthread_mutex_lock(&spockfs_fds.lock);
+		sfd->refs--;
+		if (!sfd->dropped) {
+			spockfs_fd_drop(sfd);
+		}
+		else if (!sfd->refs) {
+			spockfs_fd_destroy(sfd);
+		}
+	}
+	pthread_mutex_unlock(&spockfs_fds.lock);
+	uwsgi_metric_inc("spockfs.fd_cache.misses", NULL, 1);
+
+	int fd = spockfs_openat(wsgi_req, path, mode);
+	if (fd < 0) return -1;
+	// only regular files are cached
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) return fd;
+	sfd = uwsgi_calloc(sizeof(struct spockfs_fd));
+	sfd->path = uwsgi_concat2n(path, len, "", 0);
+	sfd->len = len;
+	sfd->hash = hash;
+	sfd->mode = mode;
+	sfd->fd = fd;
+	sfd->dev = st.st_dev;
+	sfd->ino = st.st_ino;
+	sfd->st_mode = st.st_mode;
+	sfd->uid = st.st_uid;
+	sfd->gid = st.st_gid;
+	sfd->used = now;
+	sfd->generation = generation;
+	sfd->refs = 1;
+
+	pthread_mutex_lock(&spockfs_fds.lock);
+	spockfs_fd_link(sfd);
+	spockfs_fd_evict();
+	pthread_mutex_unlock(&spockfs_fds.lock);
+	*sfd_p = sfd;
+	return fd;
+}
+
+static void spockfs_fd_close(int fd, struct spockfs_fd *sfd) {
+	if (!sfd) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&spockfs_fds.lock);
+	sfd->refs--;
+	if (sfd->dropped) {
+		if (!sfd->refs) spockfs_fd_destroy(sfd);
+	}
+	else {
+		spockfs_fd_evict();
+	}
+	pthread_mutex_unlock(&spockfs_fds.lock);
+}
+
+// drop the entries of path and of the objects under it, the other workers check theirs at the next hit
+static void spockfs_fd_invalidate(char *path) {
+	if (spockfs.fd_cache <= 0) return;
+	__atomic_add_fetch(spockfs_generation, 1, __ATOMIC_RELEASE);
+	size_t len = strlen(path);
+	pthread_mutex_lock(&spockfs_fds.lock);
+	struct spockfs_fd *sfd = spockfs_fds.head;
+	while(sfd) {
+		struct spockfs_fd *next = sfd->next;
+		if (sfd->len >= len && !memcmp(sfd->path, path, len) && (sfd->len == len || sfd->path[len] == '/')) {
+			spockfs_fd_drop(sfd);
+		}
+		sfd = next;
+	}
+	pthread_mutex_unlock(&spockfs_fds.lock);
+}
+
 /*
 	here we could have used the uwsgi_file_serve api function, but it sets a gazillion
 	of response headers useless for spockfs
 */
 static int spockfs_get(struct wsgi_request *wsgi_req, char *path) {
 
-	int fd = open(path, O_RDONLY);
+	struct spockfs_fd *sfd = NULL;
+	int fd = spockfs_fd_open(wsgi_req, path, O_RDONLY, &sfd);
         if (fd < 0) {
 		spockfs_errno(wsgi_req);
-		goto end;
+		goto end2;
         }
 
 	struct stat st;
@@ -129,6 +716,12 @@ static int spockfs_get(struct wsgi_request *wsgi_req, char *path) {
                 goto end;
 	}
 
+	char etag[SPOCKFS_ETAG_LEN];
+	int etag_len = spockfs_etag(&st, etag);
+	if (etag_len < 0) goto end;
+
+	if (spockfs_not_modified(wsgi_req, etag, etag_len)) goto end;
+
 	size_t fsize = st.st_size;
 	// security check
 	if (wsgi_req->range_from > fsize) {
@@ -146,10 +739,13 @@ static int spockfs_get(struct wsgi_request *wsgi_req, char *path) {
 	else {
 		if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	}
+	if (uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len)) goto end;
 	if (uwsgi_response_add_content_length(wsgi_req, fsize)) goto end;
-	// fd will be automatically closed
-	uwsgi_response_sendfile_do(wsgi_req, fd, wsgi_req->range_from, fsize);
+	// the descriptor could be cached, do not let uWSGI close it
+	uwsgi_response_sendfile_do_can_close(wsgi_req, fd, wsgi_req->range_from, fsize, 0);
 end:
+	spockfs_fd_close(fd, sfd);
+end2:
         return UWSGI_OK;
 }
 
@@ -165,7 +761,7 @@ static int spockfs_access(struct wsgi_request *wsgi_req, char *path) {
 		spockfs_check_readonly(wsgi_req);
 	}
 
-        if (access(path, i_mode)) {
+        if (spockfs_accessat(wsgi_req, path, i_mode)) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -181,13 +777,12 @@ end:
 #if !defined(__APPLE__) && !defined(__FreeBSD__)
 static int spockfs_fallocate(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
 	uint16_t mode_len = 0;
         char *mode = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_MODE", 17, &mode_len);
         if (!mode) goto end2;
 
-        int fd = open(path, O_WRONLY);
+	struct spockfs_fd *sfd = NULL;
+        int fd = spockfs_fd_open(wsgi_req, path, O_WRONLY, &sfd);
         if (fd < 0) {
                 spockfs_errno(wsgi_req);
                 goto end2;
@@ -201,21 +796,138 @@ static int spockfs_fallocate(struct wsgi_request *wsgi_req, char *path) {
 	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
 end:
-	close(fd);
+	spockfs_fd_close(fd, sfd);
 end2:
         return UWSGI_OK;
 }
 #endif
 
+// the request body is written in chunks of (up to) this size
+#define SPOCKFS_PUT_CHUNK (256 * 1024)
+
+// write the whole buffer at offset (short writes are resumed)
+static int spockfs_pwrite(int fd, char *buf, size_t len, off_t offset) {
+	while(len > 0) {
+		ssize_t wlen = pwrite(fd, buf, len, offset);
+		if (wlen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (wlen == 0) {
+			errno = EIO;
+			return -1;
+		}
+		buf += wlen;
+		len -= wlen;
+		offset += wlen;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+/*
+	zero-copy PUT
+
+	when uWSGI does not buffer the body (no post-buffering, no TLS...) it is moved from the
+	socket to the file with splice() through a per-thread pipe, never crossing userspace.
+*/
+#define SPOCKFS_SPLICE_CLIENT -2
+
+static __thread int spockfs_pipe[2] = {-1, -1};
+
+static void spockfs_pipe_close() {
+	close(spockfs_pipe[0]);
+	close(spockfs_pipe[1]);
+	spockfs_pipe[0] = -1;
+	spockfs_pipe[1] = -1;
+}
+
+static int spockfs_can_splice(struct wsgi_request *wsgi_req) {
+	if (uwsgi.post_buffering || wsgi_req->post_file) return 0;
+	if (wsgi_req->socket->proto_read_body != uwsgi_proto_base_read_body) return 0;
+	if (spockfs_pipe[0] < 0) {
+		if (pipe2(spockfs_pipe, O_CLOEXEC)) return 0;
+		// the default (64k) would need a round trip every 16 pages
+		fcntl(spockfs_pipe[1], F_SETPIPE_SZ, SPOCKFS_PUT_CHUNK);
+	}
+	return 1;
+}
+
+/*
+	move up to len bytes of the body to fd (at offset), returns the number of bytes moved,
+	-1 on write errors and SPOCKFS_SPLICE_CLIENT if the client is gone or too slow.
+	If the socket or the file cannot be spliced *can_splice is cleared (nothing is lost)
+*/
+static ssize_t spockfs_splice(struct wsgi_request *wsgi_req, int fd, off_t offset, size_t len, int *can_splice) {
+	ssize_t in;
+	for(;;) {
+		in = splice(wsgi_req->fd, NULL, spockfs_pipe[1], NULL, len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (in > 0) break;
+		if (in == 0) return SPOCKFS_SPLICE_CLIENT;
+		if (errno == EINTR) continue;
+		if (errno == EINVAL) {
+			*can_splice = 0;
+			return 0;
+		}
+		if (errno != EAGAIN) return SPOCKFS_SPLICE_CLIENT;
+		if (uwsgi.wait_read_hook(wsgi_req->fd, uwsgi.socket_timeout) <= 0) return SPOCKFS_SPLICE_CLIENT;
+	}
+	wsgi_req->post_pos += in;
+
+	loff_t off = offset;
+	size_t piped = in;
+	while(piped > 0) {
+		ssize_t out = splice(spockfs_pipe[0], NULL, fd, &off, piped, SPLICE_F_MOVE);
+		if (out > 0) {
+			piped -= out;
+			continue;
+		}
+		if (out < 0 && errno == EINTR) continue;
+		// the filesystem does not support splice(), write what is in the pipe the old way
+		if (out < 0 && errno == EINVAL && piped == (size_t) in) {
+			char *buf = uwsgi_malloc(in);
+			size_t got = 0;
+			while(got < (size_t) in) {
+				ssize_t rlen = read(spockfs_pipe[0], buf + got, in - got);
+				if (rlen <= 0) break;
+				got += rlen;
+			}
+			int ret = got == (size_t) in ? spockfs_pwrite(fd, buf, in, offset) : -1;
+			free(buf);
+			if (ret) {
+				spockfs_pipe_close();
+				return -1;
+			}
+			*can_splice = 0;
+			return in;
+		}
+		if (out == 0) errno = EIO;
+		// the data left in the pipe would end in the next request
+		int splice_errno = errno;
+		spockfs_pipe_close();
+		errno = splice_errno;
+		return -1;
+	}
+	return in;
+}
+#endif
+
 /*
 	unfortunately uWSGI does not expose an api for content-range.
 	The lucky thing is that we only need the first part of the range string
 */
 static int spockfs_put(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
-        int fd = open(path, O_WRONLY);
+	struct spockfs_fd *sfd = NULL;
+	uint16_t im_len = 0;
+	char *im = uwsgi_get_var(wsgi_req, "HTTP_IF_MATCH", 13, &im_len);
+	int fd;
+	/*
+		conditional writes get a private descriptor (flock() locks are per open file,
+		while cached descriptors are shared by the threads)
+	*/
+	if (im) fd = spockfs_openat(wsgi_req, path, O_WRONLY);
+	else fd = spockfs_fd_open(wsgi_req, path, O_WRONLY, &sfd);
         if (fd < 0) {
 		spockfs_errno(wsgi_req);
                 goto end2;
@@ -232,36 +944,92 @@ static int spockfs_put(struct wsgi_request *wsgi_req, char *path) {
 	char *minus = memchr(content_range+6, '-', content_range_len-6);
 	if (!minus) goto end;
 
-	if (lseek(fd, uwsgi_str_num(content_range+6, minus-(content_range+6)), SEEK_SET) < 0) {
+	/*
+		optimistic concurrency: write only if the object did not change since the client saw it.
+		The check and the write hold an exclusive flock() (released by close()), so they are
+		atomic with respect to the other conditional writes (not to the unconditional ones)
+	*/
+	char etag[SPOCKFS_ETAG_LEN];
+	int etag_len = 0;
+	struct stat st;
+	if (im) {
+		if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+			spockfs_errno(wsgi_req);
+			goto end;
+		}
+		etag_len = spockfs_etag(&st, etag);
+		if (etag_len < 0) goto end;
+		if (!spockfs_etag_match(im, im_len, etag, etag_len)) {
+			uwsgi_response_prepare_headers(wsgi_req, "412 Precondition Failed", 23);
+			uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len);
+			uwsgi_response_add_content_length(wsgi_req, 0);
+			goto end;
+		}
+	}
+
+	// the descriptor could be shared with other threads, so no lseek()
+	off_t offset = uwsgi_str_num(content_range+6, minus-(content_range+6));
+	if (offset < 0) {
+		errno = EINVAL;
 		spockfs_errno(wsgi_req);
-                goto end;
+		goto end;
 	}
 
 	size_t remains = wsgi_req->post_cl;
+#ifdef __linux__
+	int can_splice = spockfs_can_splice(wsgi_req);
+#endif
         while(remains > 0) {
                 ssize_t body_len = 0;
-                char *body =  uwsgi_request_body_read(wsgi_req, UMIN(remains, 32768) , &body_len);
-                if (!body || body == uwsgi.empty) break;
-                if (write(fd, body, body_len) != body_len) goto end;
+#ifdef __linux__
+		// what uWSGI already read from the socket (with the headers) goes the old way
+		if (can_splice && !wsgi_req->proto_parser_remains) {
+			body_len = spockfs_splice(wsgi_req, fd, offset, UMIN(remains, SPOCKFS_PUT_CHUNK), &can_splice);
+			if (body_len == SPOCKFS_SPLICE_CLIENT) goto end;
+			if (body_len < 0) {
+				spockfs_errno(wsgi_req);
+				goto end;
+			}
+			remains -= body_len;
+			offset += body_len;
+			continue;
+		}
+#endif
+                char *body =  uwsgi_request_body_read(wsgi_req, UMIN(remains, SPOCKFS_PUT_CHUNK) , &body_len);
+		// the client is gone (or too slow)
+                if (!body || body == uwsgi.empty) goto end;
+		if (spockfs_pwrite(fd, body, body_len, offset)) {
+			spockfs_errno(wsgi_req);
+			goto end;
+		}
+		remains -= body_len;
+		offset += body_len;
         }
 
+	// the new version (for chaining conditional writes)
+	if (fstat(fd, &st)) {
+		spockfs_errno(wsgi_req);
+		goto end;
+	}
+	etag_len = spockfs_etag(&st, etag);
+	if (etag_len < 0) goto end;
+
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
 end:
-	close(fd);
+	spockfs_fd_close(fd, sfd);
 end2:
         return UWSGI_OK;
 }
 
 static int spockfs_mkdir(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t mode_len = 0;
         char *mode = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_MODE", 17, &mode_len);
 	if (!mode) goto end;
 
-        if (mkdir(path, uwsgi_str_num(mode, mode_len))) {
+        if (spockfs_mkdirat(wsgi_req, path, uwsgi_str_num(mode, mode_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -275,14 +1043,12 @@ end:
 
 static int spockfs_post(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t mode_len = 0;
         char *mode = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_MODE", 17, &mode_len);
         if (!mode) goto end;
 
 	// ensure owner has write permissions
-        int fd = creat(path, uwsgi_str_num(mode, mode_len) | S_IWUSR);
+        int fd = spockfs_createat(wsgi_req, path, uwsgi_str_num(mode, mode_len) | S_IWUSR);
 	if (fd < 0) {
                 spockfs_errno(wsgi_req);
                 goto end;
@@ -297,8 +1063,76 @@ end:
 }
 
 #ifndef __FreeBSD__
+/*
+	extended attributes
+
+	there are no *at() variants of the xattr syscalls and f*xattr() do not accept O_PATH
+	descriptors (while really opening a fifo or a device could block or have side effects),
+	so on Linux the object is opened with O_PATH|O_NOFOLLOW beneath the mount and reached
+	through its /proc/self/fd entry. Without /proc (or on other systems) the path is used.
+*/
+// returns what to pass to the xattr calls, *fd (when >= 0) must be closed after them
+static char *spockfs_xattr_target(struct wsgi_request *wsgi_req, char *path, char *buf, int *fd) {
+	*fd = -1;
+#ifdef O_PATH
+	if (spockfs_proc_fd) {
+		*fd = spockfs_openat(wsgi_req, path, O_PATH|O_NOFOLLOW|O_CLOEXEC);
+		if (*fd < 0) return NULL;
+		return spockfs_proc_path(buf, *fd);
+	}
+#endif
+	return path;
+}
+
+// the /proc entry must be followed (it leads to the object itself, even if it is a symlink)
+static ssize_t spockfs_xattr_list(char *object, int fd, char *buf, size_t len) {
+#ifdef __APPLE__
+	return listxattr(object, buf, len, XATTR_NOFOLLOW);
+#else
+	if (fd >= 0) return listxattr(object, buf, len);
+	return llistxattr(object, buf, len);
+#endif
+}
+
+static ssize_t spockfs_xattr_get(char *object, int fd, char *name, char *buf, size_t len) {
+#ifdef __APPLE__
+	return getxattr(object, name, buf, len, 0, XATTR_NOFOLLOW);
+#else
+	if (fd >= 0) return getxattr(object, name, buf, len);
+	return lgetxattr(object, name, buf, len);
+#endif
+}
+
+static int spockfs_xattr_set(char *object, int fd, char *name, char *buf, size_t len, int flags) {
+#ifdef __APPLE__
+	return setxattr(object, name, buf, len, 0, XATTR_NOFOLLOW | flags);
+#else
+	if (fd >= 0) return setxattr(object, name, buf, len, flags);
+	return lsetxattr(object, name, buf, len, flags);
+#endif
+}
+
+static int spockfs_xattr_remove(char *object, int fd, char *name) {
+#ifdef __APPLE__
+	return removexattr(object, name, XATTR_NOFOLLOW);
+#else
+	if (fd >= 0) return removexattr(object, name);
+	return lremovexattr(object, name);
+#endif
+}
+
+// errno is preserved
+static void spockfs_xattr_close(int fd) {
+	if (fd < 0) return;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+}
+
 static int spockfs_listxattr(struct wsgi_request *wsgi_req, char *path) {
 	char *buf = NULL;
+	char object_buf[SPOCKFS_PROC_FD_LEN];
+	int fd = -1;
 
         uint16_t size_len = 0;
         char *size = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_SIZE", 17, &size_len);
@@ -306,13 +1140,15 @@ static int spockfs_listxattr(struct wsgi_request *wsgi_req, char *path) {
 
 	size_t mem = uwsgi_str_num(size, size_len);
 
+	char *object = spockfs_xattr_target(wsgi_req, path, object_buf, &fd);
+	if (!object) {
+		spockfs_errno(wsgi_req);
+		goto end;
+	}
+
 	// special condition: get the size of the required buffer
 	if (mem == 0) {
-#ifndef __APPLE__
-		ssize_t rlen = llistxattr(path, NULL, 0);
-#else
-		ssize_t rlen = listxattr(path, NULL, 0, XATTR_NOFOLLOW);
-#endif
+		ssize_t rlen = spockfs_xattr_list(object, fd, NULL, 0);
         	if (rlen < 0) {
                 	spockfs_errno(wsgi_req);
                 	goto end;
@@ -331,11 +1167,7 @@ static int spockfs_listxattr(struct wsgi_request *wsgi_req, char *path) {
 
 	buf = uwsgi_malloc(mem);
 
-#ifndef __APPLE__
-	ssize_t rlen = llistxattr(path, buf, mem);
-#else
-	ssize_t rlen = listxattr(path, buf, mem, XATTR_NOFOLLOW);
-#endif
+	ssize_t rlen = spockfs_xattr_list(object, fd, buf, mem);
 	if (rlen < 0) {
 		spockfs_errno(wsgi_req);
                 goto end;
@@ -354,6 +1186,7 @@ static int spockfs_listxattr(struct wsgi_request *wsgi_req, char *path) {
 	uwsgi_response_write_body_do(wsgi_req, buf, rlen);
 
 end:
+	spockfs_xattr_close(fd);
 	if (buf) free(buf);
         return UWSGI_OK;
 }
@@ -361,6 +1194,8 @@ end:
 static int spockfs_getxattr(struct wsgi_request *wsgi_req, char *path) {
         char *buf = NULL;
 	char *name = NULL;
+	char object_buf[SPOCKFS_PROC_FD_LEN];
+	int fd = -1;
 
 
 	uint16_t target_len = 0;
@@ -375,13 +1210,15 @@ static int spockfs_getxattr(struct wsgi_request *wsgi_req, char *path) {
 
         size_t mem = uwsgi_str_num(size, size_len);
 
+	char *object = spockfs_xattr_target(wsgi_req, path, object_buf, &fd);
+	if (!object) {
+		spockfs_errno(wsgi_req);
+		goto end;
+	}
+
         // special condition: get the size of the required buffer
         if (mem == 0) {
-#ifndef __APPLE__
-                ssize_t rlen = lgetxattr(path, name, NULL, 0);
-#else
-                ssize_t rlen = getxattr(path, name, NULL, 0, 0, XATTR_NOFOLLOW);
-#endif
+                ssize_t rlen = spockfs_xattr_get(object, fd, name, NULL, 0);
                 if (rlen < 0) {
                         spockfs_errno(wsgi_req);
                         goto end;
@@ -401,11 +1238,7 @@ static int spockfs_getxattr(struct wsgi_request *wsgi_req, char *path) {
 
         buf = uwsgi_malloc(mem);
 
-#ifndef __APPLE__
-        ssize_t rlen = lgetxattr(path, name, buf, mem);
-#else
-        ssize_t rlen = getxattr(path, name, buf, mem, 0, XATTR_NOFOLLOW);
-#endif
+        ssize_t rlen = spockfs_xattr_get(object, fd, name, buf, mem);
         if (rlen < 0) {
                 spockfs_errno(wsgi_req);
                 goto end;
@@ -417,6 +1250,7 @@ static int spockfs_getxattr(struct wsgi_request *wsgi_req, char *path) {
         uwsgi_response_write_body_do(wsgi_req, buf, rlen);
 
 end:
+	spockfs_xattr_close(fd);
 	if (name) free(name);
         if (buf) free(buf);
         return UWSGI_OK;
@@ -425,9 +1259,8 @@ end:
 
 static int spockfs_utimens(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
-	int fd = open(path, O_WRONLY);
+	struct spockfs_fd *sfd = NULL;
+	int fd = spockfs_fd_open(wsgi_req, path, O_WRONLY, &sfd);
 	if (fd < 0) {
 		spockfs_errno(wsgi_req);
                 goto end2;
@@ -464,7 +1297,7 @@ static int spockfs_utimens(struct wsgi_request *wsgi_req, char *path) {
         if (uwsgi_response_add_content_length(wsgi_req, 0)) goto end;
 
 end:
-	close(fd);
+	spockfs_fd_close(fd, sfd);
 end2:
         return UWSGI_OK;
 
@@ -473,10 +1306,10 @@ end2:
 #ifndef __FreeBSD__
 static int spockfs_setxattr(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         char *buf = NULL;
         char *name = NULL;
+	char object_buf[SPOCKFS_PROC_FD_LEN];
+	int fd = -1;
 
 
         uint16_t target_len = 0;
@@ -498,11 +1331,8 @@ static int spockfs_setxattr(struct wsgi_request *wsgi_req, char *path) {
 	ssize_t body_len = 0;
 	char *body = uwsgi_request_body_read(wsgi_req, wsgi_req->post_cl , &body_len);
 
-#ifndef __APPLE__
-        if (lsetxattr(path, name, body, body_len, uwsgi_str_num(flag, flag_len))) {
-#else
-        if (setxattr(path, name, body, body_len, 0, XATTR_NOFOLLOW | uwsgi_str_num(flag, flag_len))) {
-#endif
+	char *object = spockfs_xattr_target(wsgi_req, path, object_buf, &fd);
+        if (!object || spockfs_xattr_set(object, fd, name, body, body_len, uwsgi_str_num(flag, flag_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -511,6 +1341,7 @@ static int spockfs_setxattr(struct wsgi_request *wsgi_req, char *path) {
         if (uwsgi_response_add_content_length(wsgi_req, 0)) goto end;
 
 end:
+	spockfs_xattr_close(fd);
         if (name) free(name);
         if (buf) free(buf);
         return UWSGI_OK;
@@ -518,9 +1349,9 @@ end:
 
 static int spockfs_removexattr(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         char *name = NULL;
+	char object_buf[SPOCKFS_PROC_FD_LEN];
+	int fd = -1;
 
         uint16_t target_len = 0;
         char *target = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_TARGET", 19, &target_len);
@@ -528,11 +1359,8 @@ static int spockfs_removexattr(struct wsgi_request *wsgi_req, char *path) {
 
         name = uwsgi_concat2n(target, target_len, "", 0);
 
-#ifndef __APPLE__
-        if (lremovexattr(path, name)) {
-#else
-        if (removexattr(path, name, XATTR_NOFOLLOW)) {
-#endif
+	char *object = spockfs_xattr_target(wsgi_req, path, object_buf, &fd);
+        if (!object || spockfs_xattr_remove(object, fd, name)) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -541,11 +1369,15 @@ static int spockfs_removexattr(struct wsgi_request *wsgi_req, char *path) {
         if (uwsgi_response_add_content_length(wsgi_req, 0)) goto end;
 
 end:
+	spockfs_xattr_close(fd);
         if (name) free(name);
         return UWSGI_OK;
 }
 #endif
 
+// the flags checked by OPEN (the clients could forward kernel internal ones too)
+#define SPOCKFS_OPEN_FLAGS (O_ACCMODE|O_APPEND|O_TRUNC|O_DIRECTORY|O_NOFOLLOW)
+
 static int spockfs_open(struct wsgi_request *wsgi_req, char *path) {
 
         uint16_t flag_len = 0;
@@ -558,14 +1390,30 @@ static int spockfs_open(struct wsgi_request *wsgi_req, char *path) {
 		spockfs_check_readonly(wsgi_req);
 	}
 
-	int fd = open(path, i_flag);
+	int fd = spockfs_openat(wsgi_req, path, i_flag & SPOCKFS_OPEN_FLAGS);
 	if (fd < 0) {
 		spockfs_errno(wsgi_req);
                 goto end;
 	}
+	// the client uses the ETag (or mtime and size) to validate its cached data
+	struct stat st;
+	if (fstat(fd, &st)) {
+		spockfs_errno(wsgi_req);
+		close(fd);
+		goto end;
+	}
 	close(fd);
 
+	char etag[SPOCKFS_ETAG_LEN];
+	int etag_len = spockfs_etag(&st, etag);
+	if (etag_len < 0) goto end;
+
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len)) goto end;
+	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-mode", 12, st.st_mode)) goto end;
+	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-size", 12, st.st_size)) goto end;
+	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-mtime", 13, st.st_mtime)) goto end;
+	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-ino", 11, st.st_ino)) goto end;
         if (uwsgi_response_add_content_length(wsgi_req, 0)) goto end;
 
 end:
@@ -576,16 +1424,15 @@ end:
 
 static int spockfs_truncate(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t size_len = 0;
         char *size = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_SIZE", 17, &size_len);
         if (!size) goto end;
 
-        if (truncate(path, uwsgi_str_num(size, size_len))) {
+        if (spockfs_truncateat(wsgi_req, path, uwsgi_str_num(size, size_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
+	spockfs_fd_invalidate(path);
 
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
         uwsgi_response_add_content_length(wsgi_req, 0);
@@ -596,16 +1443,15 @@ end:
 
 static int spockfs_chmod(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t mode_len = 0;
         char *mode = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_MODE", 17, &mode_len);
         if (!mode) goto end;
 
-        if (chmod(path, uwsgi_str_num(mode, mode_len))) {
+        if (spockfs_chmodat(wsgi_req, path, uwsgi_str_num(mode, mode_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
+	spockfs_fd_invalidate(path);
 
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
         uwsgi_response_add_content_length(wsgi_req, 0);
@@ -616,8 +1462,6 @@ end:
 
 static int spockfs_mknod(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t mode_len = 0;
         char *mode = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_MODE", 17, &mode_len);
         if (!mode) goto end;
@@ -626,7 +1470,7 @@ static int spockfs_mknod(struct wsgi_request *wsgi_req, char *path) {
         char *dev = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_DEV", 16, &dev_len);
         if (!dev) goto end;
 
-        if (mknod(path, uwsgi_str_num(mode, mode_len), uwsgi_str_num(dev, dev_len))) {
+        if (spockfs_mknodat(wsgi_req, path, uwsgi_str_num(mode, mode_len), uwsgi_str_num(dev, dev_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -641,8 +1485,6 @@ end:
 
 static int spockfs_chown(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         uint16_t uid_len = 0;
         char *uid = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_UID", 16, &uid_len);
         if (!uid) goto end;
@@ -651,10 +1493,11 @@ static int spockfs_chown(struct wsgi_request *wsgi_req, char *path) {
         char *gid = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_GID", 16, &gid_len);
         if (!gid) goto end;
 
-        if (chown(path, uwsgi_str_num(uid, uid_len), uwsgi_str_num(gid, gid_len))) {
+        if (spockfs_chownat(wsgi_req, path, uwsgi_str_num(uid, uid_len), uwsgi_str_num(gid, gid_len))) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
+	spockfs_fd_invalidate(path);
 
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
@@ -665,8 +1508,6 @@ end:
 
 static int spockfs_rename(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
         char path2[PATH_MAX+1];
 
         uint16_t target_len = 0;
@@ -679,10 +1520,12 @@ static int spockfs_rename(struct wsgi_request *wsgi_req, char *path) {
 		goto end;
 	}
 
-        if (rename(path2, path)) {
+        if (spockfs_renameat(wsgi_req, path2, path, 0)) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
+	spockfs_fd_invalidate(path2);
+	spockfs_fd_invalidate(path);
 
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
@@ -693,8 +1536,6 @@ end:
 
 static int spockfs_link(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
 	char path2[PATH_MAX+1];
 
         uint16_t target_len = 0;
@@ -707,7 +1548,7 @@ static int spockfs_link(struct wsgi_request *wsgi_req, char *path) {
                 goto end;
         }
 
-        if (link(path2, path)) {
+        if (spockfs_renameat(wsgi_req, path2, path, 1)) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -721,8 +1562,6 @@ end:
 
 static int spockfs_symlink(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
 	char *path2 = NULL;
 
 	uint16_t target_len = 0;
@@ -731,7 +1570,7 @@ static int spockfs_symlink(struct wsgi_request *wsgi_req, char *path) {
 
 	path2 = uwsgi_concat2n(target, target_len, "", 0);
 
-	if (symlink(path2, path)) {
+	if (spockfs_symlinkat(wsgi_req, path2, path)) {
 		spockfs_errno(wsgi_req);
 		goto end;
 	}
@@ -746,12 +1585,11 @@ end:
 
 static int spockfs_delete(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
-	if (unlink(path)) {
+	if (spockfs_unlinkat(wsgi_req, path, 0)) {
 		spockfs_errno(wsgi_req);
                 goto end;
 	}
+	spockfs_fd_invalidate(path);
 
 	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
@@ -762,12 +1600,11 @@ end:
 
 static int spockfs_rmdir(struct wsgi_request *wsgi_req, char *path) {
 
-	spockfs_check_readonly(wsgi_req);
-
-        if (rmdir(path)) {
+        if (spockfs_unlinkat(wsgi_req, path, AT_REMOVEDIR)) {
                 spockfs_errno(wsgi_req);
                 goto end;
         }
+	spockfs_fd_invalidate(path);
 
         if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
 	uwsgi_response_add_content_length(wsgi_req, 0);
@@ -778,14 +1615,22 @@ end:
 
 static int spockfs_readlink(struct wsgi_request *wsgi_req, char *path) {
 
+	char *name;
+	int pfd = spockfs_parentat(wsgi_req, path, &name);
+	if (pfd < 0) {
+		spockfs_errno(wsgi_req);
+		goto end;
+	}
 	struct stat st;
-	if (lstat(path, &st)) {
+	if (fstatat(pfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+		spockfs_parent_close(wsgi_req, pfd);
 		spockfs_errno(wsgi_req);
 		goto end;
 	}
 
 	char *link = uwsgi_malloc(st.st_size);
-	ssize_t rlen = readlink(path, link, st.st_size);
+	ssize_t rlen = readlinkat(pfd, name, link, st.st_size);
+	spockfs_parent_close(wsgi_req, pfd);
 	if (rlen < 0) {
 		free(link);
 		spockfs_errno(wsgi_req);
@@ -812,11 +1657,18 @@ end:
 
 static int spockfs_getattr(struct wsgi_request *wsgi_req, char *path) {
 	struct stat st;
-	if (lstat(path, &st)) {
+	if (spockfs_lstatat(wsgi_req, path, &st)) {
 		spockfs_errno(wsgi_req);
 		goto end;
 	}
+
+	char etag[SPOCKFS_ETAG_LEN];
+	int etag_len = spockfs_etag(&st, etag);
+	if (etag_len < 0) goto end;
+	if (spockfs_not_modified(wsgi_req, etag, etag_len)) goto end;
+
 	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len)) goto end;
 
 	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-mode", 12, st.st_mode)) goto end;
 	if (spockfs_response_add_header_num(wsgi_req, "X-Spock-uid", 11, st.st_uid)) goto end;
@@ -838,7 +1690,16 @@ end:
 
 static int spockfs_statfs(struct wsgi_request *wsgi_req, char *path) {
         struct statvfs st;
-        if (statvfs(path, &st)) {
+	int fd = spockfs_openat(wsgi_req, path, SPOCKFS_O_PATH|O_CLOEXEC);
+	if (fd < 0) {
+                spockfs_errno(wsgi_req);
+                goto end;
+	}
+	int ret = fstatvfs(fd, &st);
+	int saved_errno = errno;
+	close(fd);
+        if (ret) {
+		errno = saved_errno;
                 spockfs_errno(wsgi_req);
                 goto end;
         }
@@ -862,191 +1723,810 @@ end:
         return UWSGI_OK;
 }
 
-static int spockfs_readdir(struct wsgi_request *wsgi_req, char *path) {
-	int headers_sent = 0;
+/*
+	directory scanning
+
+	on Linux items are read in batches with getdents64() (without the DIR layer of libc), the position
+	after every item (d_off) is a cookie the scan can be resumed from (with lseek()) by another request.
+	Elsewhere the cookie is the number of items already returned (skipped again when resuming).
+*/
+#ifdef SYS_getdents64
+struct spockfs_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+struct spockfs_dirscan {
+	int fd;
+	// the position after the last returned item
+	uint64_t cookie;
+#ifdef SYS_getdents64
+	char buf[32768];
+	long len;
+	long pos;
+#else
+	DIR *d;
+#endif
+};
+
+static struct spockfs_dirscan *spockfs_dirscan_open(struct wsgi_request *wsgi_req, char *path, uint64_t cookie) {
+	int fd = spockfs_openat(wsgi_req, path, O_RDONLY|O_DIRECTORY);
+	if (fd < 0) return NULL;
+	struct spockfs_dirscan *ds = uwsgi_malloc(sizeof(struct spockfs_dirscan));
+	ds->fd = fd;
+	ds->cookie = cookie;
+#ifdef SYS_getdents64
+	ds->len = 0;
+	ds->pos = 0;
+	if (cookie && lseek(fd, (off_t) cookie, SEEK_SET) < 0) goto error;
+#else
+	ds->d = fdopendir(fd);
+	if (!ds->d) goto error;
+	uint64_t i;
+	for(i=0;i<cookie;i++) {
+		errno = 0;
+		if (!readdir(ds->d)) {
+			if (errno) goto error;
+			break;
+		}
+	}
+#endif
+	return ds;
+error:
+	{
+		int err = errno;
+#ifndef SYS_getdents64
+		// closedir() closes the descriptor too
+		if (ds->d) closedir(ds->d);
+		else
+#endif
+		close(fd);
+		free(ds);
+		errno = err;
+	}
+	return NULL;
+}
+
+// returns the name of the next item, NULL at the end (errno is 0) or on error
+static char *spockfs_dirscan_next(struct spockfs_dirscan *ds) {
+#ifdef SYS_getdents64
+	if (ds->pos >= ds->len) {
+		ds->pos = 0;
+		ds->len = syscall(SYS_getdents64, ds->fd, ds->buf, sizeof(ds->buf));
+		if (ds->len <= 0) {
+			if (ds->len == 0) errno = 0;
+			return NULL;
+		}
+	}
+	struct spockfs_dirent64 *de = (struct spockfs_dirent64 *) (ds->buf + ds->pos);
+	ds->pos += de->d_reclen;
+	ds->cookie = de->d_off;
+	return de->d_name;
+#else
+	errno = 0;
+	struct dirent *de = readdir(ds->d);
+	if (!de) return NULL;
+	ds->cookie++;
+	return de->d_name;
+#endif
+}
+
+static void spockfs_dirscan_close(struct spockfs_dirscan *ds) {
+#ifdef SYS_getdents64
+	close(ds->fd);
+#else
+	closedir(ds->d);
+#endif
+	free(ds);
+}
+
+// append the attributes of an object (as sent by READDIRPLUS and BATCH) followed by a space
+static int spockfs_buffer_append_attrs(struct uwsgi_buffer *ub, struct stat *st) {
+	char attrs[12 * (sizeof(UMAX64_STR)+1)];
+	int attrs_len = snprintf(attrs, sizeof(attrs), "%llu %llu %llu %llu %lld %lld %lld %llu %llu %llu %llu ",
+		(unsigned long long) st->st_mode, (unsigned long long) st->st_uid, (unsigned long long) st->st_gid,
+		(unsigned long long) st->st_size, (long long) st->st_mtime, (long long) st->st_atime, (long long) st->st_ctime,
+		(unsigned long long) st->st_nlink, (unsigned long long) st->st_blocks, (unsigned long long) st->st_dev,
+		(unsigned long long) st->st_ino);
+	if (attrs_len <= 0 || attrs_len >= (int) sizeof(attrs)) return -1;
+	return uwsgi_buffer_append(ub, attrs, attrs_len);
+}
+
+/*
+	READDIR and READDIRPLUS
+
+	a client can ask for a page of at most X-Spock-count items (resuming from the X-Spock-cookie
+	returned with the previous page), so huge directories are never loaded in memory as a whole.
+	The cookie of the next page is sent with X-Spock-cookie (missing after the last page), without
+	X-Spock-count the whole directory is returned.
+
+	READDIRPLUS lines contain the lstat() attributes of the item too:
+
+	<mode> <uid> <gid> <size> <mtime> <atime> <ctime> <nlink> <blocks> <dev> <ino> <name>\n
+
+	items are stat'ed relative to the directory fd, avoiding the rebuild (and the walk) of the full path
+*/
+static int spockfs_readdir_do(struct wsgi_request *wsgi_req, char *path, int plus) {
 	struct uwsgi_buffer *ub = uwsgi_buffer_new(uwsgi.page_size);
-	DIR *d = opendir(path);
-	if (!d) {
+
+	uint16_t cookie_len = 0;
+	char *cookie = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_COOKIE", 19, &cookie_len);
+	uint16_t count_len = 0;
+	char *count = uwsgi_get_var(wsgi_req, "HTTP_X_SPOCK_COUNT", 18, &count_len);
+	uint64_t max = count ? uwsgi_str_num(count, count_len) : 0;
+
+	struct spockfs_dirscan *ds = spockfs_dirscan_open(wsgi_req, path, cookie ? uwsgi_str_num(cookie, cookie_len) : 0);
+	if (!ds) {
 		spockfs_errno(wsgi_req);
 		goto end;
 	}
-	struct dirent de, *result;
+
+	uint64_t n = 0;
+	int more = 0;
 	for(;;) {
-		int ret = readdir_r(d, &de, &result);
-		if (ret != 0) {
-			spockfs_errno(wsgi_req);
-			goto end;
+		if (max && n >= max) {
+			more = 1;
+			break;
+		}
+		char *name = spockfs_dirscan_next(ds);
+		if (!name) {
+			if (errno) {
+				spockfs_errno(wsgi_req);
+				goto end;
+			}
+			break;
 		}
-		if (!headers_sent) {
-			if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
-			headers_sent = 1;
+		if (plus) {
+			struct stat st;
+			// the item could have been removed in the mean time
+			if (fstatat(ds->fd, name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+			if (spockfs_buffer_append_attrs(ub, &st)) goto end;
 		}
-		if (!result) break;
-		if (uwsgi_buffer_append(ub, de.d_name, strlen(de.d_name))) goto end;
+		if (uwsgi_buffer_append(ub, name, strlen(name))) goto end;
 		if (uwsgi_buffer_append(ub, "\n", 1)) goto end;
+		n++;
 	}
 
+	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (more) {
+		if (spockfs_response_add_header_num(wsgi_req, "X-Spock-cookie", 14, ds->cookie)) goto end;
+	}
 	if (uwsgi_response_add_content_length(wsgi_req, ub->pos)) goto end;
 
 	uwsgi_response_write_body_do(wsgi_req, ub->buf, ub->pos);
 end:
 	uwsgi_buffer_destroy(ub);
-	if (d) closedir(d);
+	if (ds) spockfs_dirscan_close(ds);
 	return UWSGI_OK;
 }
 
-static int spockfs_request(struct wsgi_request *wsgi_req) {
+static int spockfs_readdir(struct wsgi_request *wsgi_req, char *path) {
+	return spockfs_readdir_do(wsgi_req, path, 0);
+}
 
-	char path[PATH_MAX+1];
+static int spockfs_readdirplus(struct wsgi_request *wsgi_req, char *path) {
+	return spockfs_readdir_do(wsgi_req, path, 1);
+}
 
-	if (uwsgi_parse_vars(wsgi_req)) {
-                return -1;
-        }
+/*
+	BATCH: the body contains a list of operations (one per line) executed in order,
+	the response body the status of each of them (followed by the attributes for GETATTR)
 
-        if (wsgi_req->path_info_len == 0) {
-                uwsgi_403(wsgi_req);
-                return UWSGI_OK;
-        }
+	<METHOD> <urlencoded path>[ <urlencoded target>][ <arg>...]\n
+*/
 
-	if (wsgi_req->path_info[0] != '/') {
-                uwsgi_403(wsgi_req);
-                return UWSGI_OK;
+// the status code spockfs_errno() would send
+static int spockfs_errno_code() {
+	switch(errno) {
+		case ENOENT:
+			return 404;
+		case EACCES:
+		case EPERM:
+			return 403;
+		case ENOSYS:
+		case EOPNOTSUPP:
+			return 405;
+		case EEXIST:
+			return 409;
+		case ENOTEMPTY:
+			return 412;
+		case ERANGE:
+			return 413;
+#ifdef ENODATA
+		case ENODATA:
+#endif
+#ifdef ENOATTR
+		case ENOATTR:
+#endif
+			return 415;
+		default:
+			return 500;
 	}
+}
 
-	wsgi_req->app_id = uwsgi_get_app_id(wsgi_req, wsgi_req->appid, wsgi_req->appid_len, spockfs_plugin.modifier1);
-	if (wsgi_req->app_id == -1 && !uwsgi.no_default_app && uwsgi.default_app > -1) {
-		if (uwsgi_apps[uwsgi.default_app].modifier1 == spockfs_plugin.modifier1) {
-			wsgi_req->app_id = uwsgi.default_app;
-		}
-	}
+static int spockfs_batch_num(char *arg, int64_t *n) {
+	if (!arg) return -1;
+	char *end = NULL;
+	errno = 0;
+	*n = strtoll(arg, &end, 10);
+	if (errno || end == arg || *end) return -1;
+	return 0;
+}
 
-	if (wsgi_req->app_id == -1) {
-		uwsgi_404(wsgi_req);
-		return UWSGI_OK;
-	}
+// decode (in place) and sanitize an absolute path
+static int spockfs_batch_path(char *path, struct wsgi_request *wsgi_req, char *item) {
+	size_t len = strlen(item);
+	if (len == 0 || len > PATH_MAX) return -1;
+	uint16_t item_len = len;
+	http_url_decode(item, &item_len, item);
+	if (item_len == 0 || item[0] != '/') return -1;
+	return spockfs_build_path(path, wsgi_req, item, item_len);
+}
 
-	if (spockfs_build_path(path, wsgi_req, wsgi_req->path_info, wsgi_req->path_info_len)) {
-		uwsgi_404(wsgi_req);
-                return UWSGI_OK;
-	}
+#define spockfs_batch_readonly() if (uwsgi_apps[wsgi_req->app_id].responder0) {\
+				code = 403;\
+				goto done;\
+			}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "GETATTR", 7)) {
-		return spockfs_getattr(wsgi_req, path);
+static int spockfs_batch_op(struct wsgi_request *wsgi_req, char *line, struct uwsgi_buffer *ub) {
+	char path[PATH_MAX+1];
+	char path2[PATH_MAX+1];
+	struct stat st;
+	int has_attrs = 0;
+	int code = 200;
+	int64_t a0 = 0, a1 = 0;
+
+	// METHOD path [arg1 [arg2 [arg3]]]
+	char *argv[4] = { NULL, NULL, NULL, NULL };
+	int argc = 0;
+	char *method = line;
+	char *ptr = strchr(line, ' ');
+	while(ptr && argc < 4) {
+		*ptr++ = 0;
+		argv[argc++] = ptr;
+		ptr = strchr(ptr, ' ');
 	}
-
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "ACCESS", 6)) {
-		return spockfs_access(wsgi_req, path);
+	if (ptr || !argv[0]) {
+		code = 400;
+		goto done;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "OPEN", 4)) {
-		return spockfs_open(wsgi_req, path);
+	if (spockfs_batch_path(path, wsgi_req, argv[0])) {
+		code = 404;
+		goto done;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "GET", 3)) {
-		return spockfs_get(wsgi_req, path);
+	// the same readonly policy of the plain requests
+	struct spockfs_method *sm = spockfs_method_find(method, strlen(method));
+	if (sm && (sm->flags & SPOCKFS_NEEDS_WRITE)) {
+		spockfs_batch_readonly();
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "PUT", 3)) {
-		return spockfs_put(wsgi_req, path);
+	if (!strcmp(method, "GETATTR")) {
+		if (spockfs_lstatat(wsgi_req, path, &st)) goto error;
+		has_attrs = 1;
+	}
+	else if (!strcmp(method, "ACCESS")) {
+		if (spockfs_batch_num(argv[1], &a0)) goto invalid;
+		if (a0 & W_OK) spockfs_batch_readonly();
+		if (spockfs_accessat(wsgi_req, path, a0)) goto error;
+	}
+	else if (!strcmp(method, "CHMOD")) {
+		if (spockfs_batch_num(argv[1], &a0)) goto invalid;
+		if (spockfs_chmodat(wsgi_req, path, a0)) goto error;
+		spockfs_fd_invalidate(path);
 	}
+	else if (!strcmp(method, "CHOWN")) {
+		if (spockfs_batch_num(argv[1], &a0) || spockfs_batch_num(argv[2], &a1)) goto invalid;
+		if (spockfs_chownat(wsgi_req, path, a0, a1)) goto error;
+		spockfs_fd_invalidate(path);
+	}
+	else if (!strcmp(method, "TRUNCATE")) {
+		if (spockfs_batch_num(argv[1], &a0)) goto invalid;
+		if (spockfs_truncateat(wsgi_req, path, a0)) goto error;
+		spockfs_fd_invalidate(path);
+	}
+	else if (!strcmp(method, "UTIMENS")) {
+		if (spockfs_batch_num(argv[1], &a0) || spockfs_batch_num(argv[2], &a1)) goto invalid;
+		int fd = spockfs_openat(wsgi_req, path, O_WRONLY);
+		if (fd < 0) goto error;
+#if !defined( __APPLE__) && !defined(__FreeBSD__)
+		struct timespec tv[2];
+		tv[0].tv_sec = a0;
+		tv[0].tv_nsec = 0;
+		tv[1].tv_sec = a1;
+		tv[1].tv_nsec = 0;
+		int ret = futimens(fd, tv);
+#else
+		struct timeval tv[2];
+		tv[0].tv_sec = a0;
+		tv[0].tv_usec = 0;
+		tv[1].tv_sec = a1;
+		tv[1].tv_usec = 0;
+		int ret = futimes(fd, tv);
+#endif
+		int utimens_errno = errno;
+		close(fd);
+		errno = utimens_errno;
+		if (ret) goto error;
+	}
+	else if (!strcmp(method, "MKDIR")) {
+		if (spockfs_batch_num(argv[1], &a0)) goto invalid;
+		if (spockfs_mkdirat(wsgi_req, path, a0)) goto error;
+		code = 201;
+	}
+	else if (!strcmp(method, "RMDIR")) {
+		if (spockfs_unlinkat(wsgi_req, path, AT_REMOVEDIR)) goto error;
+		spockfs_fd_invalidate(path);
+	}
+	else if (!strcmp(method, "DELETE")) {
+		if (spockfs_unlinkat(wsgi_req, path, 0)) goto error;
+		spockfs_fd_invalidate(path);
+	}
+	else if (!strcmp(method, "SYMLINK")) {
+		if (!argv[1] || !*argv[1] || strlen(argv[1]) > PATH_MAX) goto invalid;
+		uint16_t target_len = strlen(argv[1]);
+		http_url_decode(argv[1], &target_len, argv[1]);
+		argv[1][target_len] = 0;
+		if (spockfs_symlinkat(wsgi_req, argv[1], path)) goto error;
+		code = 201;
+	}
+	else if (!strcmp(method, "LINK") || !strcmp(method, "RENAME")) {
+		if (!argv[1]) goto invalid;
+		if (spockfs_batch_path(path2, wsgi_req, argv[1])) {
+			code = 404;
+			goto done;
+		}
+		if (method[0] == 'L') {
+			if (spockfs_renameat(wsgi_req, path2, path, 1)) goto error;
+			code = 201;
+		}
+		else {
+			if (spockfs_renameat(wsgi_req, path2, path, 0)) goto error;
+			spockfs_fd_invalidate(path2);
+			spockfs_fd_invalidate(path);
+		}
+	}
+	else {
+		code = 405;
+	}
+	goto done;
+
+invalid:
+	code = 400;
+	goto done;
+error:
+	code = spockfs_errno_code();
+done:
+	if (uwsgi_buffer_num64(ub, code)) return -1;
+	if (has_attrs) {
+		if (uwsgi_buffer_append(ub, " ", 1)) return -1;
+		if (spockfs_buffer_append_attrs(ub, &st)) return -1;
+	}
+	return uwsgi_buffer_append(ub, "\n", 1);
+}
+
+static int spockfs_batch(struct wsgi_request *wsgi_req, char *path) {
+
+	struct uwsgi_buffer *body = NULL;
+	struct uwsgi_buffer *ub = NULL;
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "POST", 4)) {
-		return spockfs_post(wsgi_req, path);
+	if (wsgi_req->post_cl > spockfs.batch_limit) {
+		errno = ERANGE;
+		spockfs_errno(wsgi_req);
+		goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "MKNOD", 5)) {
-		return spockfs_mknod(wsgi_req, path);
+	body = uwsgi_buffer_new(wsgi_req->post_cl + 1);
+	size_t remains = wsgi_req->post_cl;
+	while(remains > 0) {
+		ssize_t rlen = 0;
+		char *buf = uwsgi_request_body_read(wsgi_req, remains, &rlen);
+		// a truncated body
+		if (!buf || buf == uwsgi.empty) {
+			uwsgi_response_prepare_headers(wsgi_req, "400 Bad Request", 15);
+			uwsgi_response_add_content_length(wsgi_req, 0);
+			goto end;
+		}
+		if (uwsgi_buffer_append(body, buf, rlen)) goto end;
+		remains -= rlen;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "LINK", 4)) {
-		return spockfs_link(wsgi_req, path);
+	ub = uwsgi_buffer_new(uwsgi.page_size);
+	char *line = body->buf;
+	size_t i;
+	for(i=0;i<body->pos;i++) {
+		if (body->buf[i] != '\n') continue;
+		body->buf[i] = 0;
+		if (spockfs_batch_op(wsgi_req, line, ub)) goto end;
+		line = body->buf + i + 1;
 	}
+	// the last line could miss the newline (the buffer has room for the terminator)
+	if (line < body->buf + body->pos) {
+		body->buf[body->pos] = 0;
+		if (spockfs_batch_op(wsgi_req, line, ub)) goto end;
+	}
+
+	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (uwsgi_response_add_content_length(wsgi_req, ub->pos)) goto end;
+	uwsgi_response_write_body_do(wsgi_req, ub->buf, ub->pos);
+
+end:
+	if (body) uwsgi_buffer_destroy(body);
+	if (ub) uwsgi_buffer_destroy(ub);
+	return UWSGI_OK;
+}
+
+#ifdef __linux__
+/*
+	WATCH streams the changes made (by anyone, even outside of spockfs) in a directory tree,
+	one "<EVENT> <path>" line for each of them. The stream starts with a READY line (sent when
+	all of the watches are in place) and never ends: on idle streams an empty line is sent
+	every spockfs-watch-heartbeat seconds (it is how dead clients are detected).
+
+	inotify is not recursive, so every directory of the tree gets its own watch (directories
+	created or moved into the tree are added as soon as they appear). Directories are opened
+	beneath the mount (never following symlinks) and watched through their /proc/self/fd entry.
+*/
+#define SPOCKFS_WATCH_MASK (IN_MODIFY|IN_ATTRIB|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_EXCL_UNLINK)
+
+struct spockfs_watch {
+	struct wsgi_request *wsgi_req;
+	int fd;
+	size_t base_len;
+	// the directory of every watch descriptor
+	char **paths;
+	int paths_len;
+	struct uwsgi_buffer *ub;
+	// the last line (consecutive duplicates are dropped)
+	size_t last;
+};
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "RENAME", 6)) {
-		return spockfs_rename(wsgi_req, path);
+static int spockfs_watch_add(struct spockfs_watch *sw, char *path) {
+	int wd;
+	DIR *d = NULL;
+#ifdef O_PATH
+	if (spockfs_proc_fd) {
+		char buf[SPOCKFS_PROC_FD_LEN];
+		int fd = spockfs_openat(sw->wsgi_req, path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd < 0) {
+			// not a directory (or a symlink, or already gone)
+			if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP) return 0;
+			return -1;
+		}
+		wd = inotify_add_watch(sw->fd, spockfs_proc_path(buf, fd), SPOCKFS_WATCH_MASK);
+		if (wd < 0) {
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+		// closes fd too
+		d = fdopendir(fd);
+		if (!d) close(fd);
+	}
+	else
+#endif
+	{
+		wd = inotify_add_watch(sw->fd, path, SPOCKFS_WATCH_MASK|IN_DONT_FOLLOW);
+		if (wd < 0) {
+			// not a directory (or already gone)
+			if (errno == ENOENT || errno == ENOTDIR) return 0;
+			return -1;
+		}
+		d = opendir(path);
 	}
+	if (wd >= sw->paths_len) {
+		int len = UMAX(wd + 1, sw->paths_len * 2);
+		char **paths = realloc(sw->paths, sizeof(char *) * len);
+		if (!paths) return -1;
+		memset(paths + sw->paths_len, 0, sizeof(char *) * (len - sw->paths_len));
+		sw->paths = paths;
+		sw->paths_len = len;
+	}
+	// a directory moved inside the tree keeps its watch descriptor
+	if (sw->paths[wd]) free(sw->paths[wd]);
+	sw->paths[wd] = uwsgi_concat2(path, "");
+
+	if (!d) return 0;
+	struct dirent *de;
+	int ret = 0;
+	while((de = readdir(d))) {
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) continue;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		char *item = uwsgi_concat3(path, "/", de->d_name);
+		ret = spockfs_watch_add(sw, item);
+		free(item);
+		if (ret) break;
+	}
+	closedir(d);
+	return ret;
+}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "READDIR", 7)) {
-		return spockfs_readdir(wsgi_req, path);
+// '%' and newlines are percent-encoded
+static int spockfs_watch_append(struct uwsgi_buffer *ub, char *s) {
+	char *run = s;
+	for(;*s;s++) {
+		if (*s != '%' && *s != '\n') continue;
+		if (uwsgi_buffer_append(ub, run, s - run)) return -1;
+		if (uwsgi_buffer_append(ub, *s == '%' ? "%25" : "%0A", 3)) return -1;
+		run = s + 1;
 	}
+	return uwsgi_buffer_append(ub, run, s - run);
+}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "READDIR", 7)) {
-		return spockfs_readdir(wsgi_req, path);
+static int spockfs_watch_line(struct spockfs_watch *sw, char *event, char *dir, char *name) {
+	struct uwsgi_buffer *ub = sw->ub;
+	size_t start = ub->pos;
+	if (uwsgi_buffer_append(ub, event, strlen(event))) return -1;
+	if (dir) {
+		// paths are relative to the mountpoint
+		char *item = dir + sw->base_len;
+		if (uwsgi_buffer_append(ub, " ", 1)) return -1;
+		if (spockfs_watch_append(ub, item)) return -1;
+		if (name) {
+			if (uwsgi_buffer_append(ub, "/", 1)) return -1;
+			if (spockfs_watch_append(ub, name)) return -1;
+		}
+		else if (!*item) {
+			if (uwsgi_buffer_append(ub, "/", 1)) return -1;
+		}
 	}
+	if (uwsgi_buffer_append(ub, "\n", 1)) return -1;
+	if (start > 0 && start - sw->last == ub->pos - start && !memcmp(ub->buf + sw->last, ub->buf + start, ub->pos - start)) {
+		ub->pos = start;
+		return 0;
+	}
+	sw->last = start;
+	return 0;
+}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "SYMLINK", 7)) {
-		return spockfs_symlink(wsgi_req, path);
+static int spockfs_watch_event(struct spockfs_watch *sw, struct inotify_event *ie) {
+	if (ie->mask & IN_Q_OVERFLOW) return spockfs_watch_line(sw, "OVERFLOW", NULL, NULL);
+	if (ie->wd < 0 || ie->wd >= sw->paths_len || !sw->paths[ie->wd]) return 0;
+	char *dir = sw->paths[ie->wd];
+	if (ie->mask & IN_IGNORED) {
+		free(dir);
+		sw->paths[ie->wd] = NULL;
+		return 0;
+	}
+	char *name = ie->len ? ie->name : NULL;
+	char *event = NULL;
+	if (ie->mask & (IN_MOVED_FROM|IN_MOVED_TO)) event = "MOVE";
+	else if (ie->mask & IN_CREATE) event = "CREATE";
+	else if (ie->mask & IN_DELETE) event = "DELETE";
+	else if (ie->mask & IN_MODIFY) event = "MODIFY";
+	else if (ie->mask & IN_ATTRIB) event = "ATTRIB";
+	if (!event) return 0;
+	if (name && (ie->mask & IN_ISDIR) && (ie->mask & (IN_CREATE|IN_MOVED_TO))) {
+		char *item = uwsgi_concat3(dir, "/", name);
+		int ret = spockfs_watch_add(sw, item);
+		free(item);
+		if (ret) return -1;
 	}
+	return spockfs_watch_line(sw, event, dir, name);
+}
+
+static int spockfs_watch(struct wsgi_request *wsgi_req, char *path) {
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "READLINK", 8)) {
-		return spockfs_readlink(wsgi_req, path);
+	struct spockfs_watch sw;
+	memset(&sw, 0, sizeof(struct spockfs_watch));
+	sw.wsgi_req = wsgi_req;
+	sw.fd = -1;
+	sw.base_len = (size_t) uwsgi_apps[wsgi_req->app_id].callable;
+	size_t buf_len = 64 * 1024;
+	char *buf = NULL;
+
+	struct stat st;
+	if (spockfs_statat(wsgi_req, path, &st)) {
+		spockfs_errno(wsgi_req);
+		goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "DELETE", 6)) {
-		return spockfs_delete(wsgi_req, path);
+	if (!S_ISDIR(st.st_mode)) {
+		errno = EACCES;
+		spockfs_errno(wsgi_req);
+		goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "MKDIR", 5)) {
-		return spockfs_mkdir(wsgi_req, path);
+	sw.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (sw.fd < 0) {
+		spockfs_errno(wsgi_req);
+		goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "RMDIR", 5)) {
-		return spockfs_rmdir(wsgi_req, path);
+	// strip final slashes (the paths of the items are built as <dir>/<name>)
+	size_t path_len = strlen(path);
+	while(path_len > sw.base_len && path[path_len-1] == '/') {
+		path[--path_len] = 0;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "CHMOD", 5)) {
-		return spockfs_chmod(wsgi_req, path);
+	if (spockfs_watch_add(&sw, path)) {
+		spockfs_errno(wsgi_req);
+		goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "CHOWN", 5)) {
-		return spockfs_chown(wsgi_req, path);
+	buf = uwsgi_malloc(buf_len);
+	sw.ub = uwsgi_buffer_new(uwsgi.page_size);
+
+	if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) goto end;
+	if (uwsgi_response_add_header(wsgi_req, "Content-Type", 12, "text/plain", 10)) goto end;
+	if (uwsgi_response_write_body_do(wsgi_req, "READY\n", 6)) goto end;
+
+	for(;;) {
+		int ret = uwsgi.wait_read_hook(sw.fd, spockfs.watch_heartbeat);
+		if (ret < 0) goto end;
+		if (ret == 0) {
+			// a write error means the client went away
+			if (uwsgi_response_write_body_do(wsgi_req, "\n", 1)) goto end;
+			continue;
+		}
+		ssize_t rlen = read(sw.fd, buf, buf_len);
+		if (rlen < 0) {
+			if (errno == EAGAIN || errno == EINTR) continue;
+			goto end;
+		}
+		sw.ub->pos = 0;
+		sw.last = 0;
+		char *ptr = buf;
+		while(ptr < buf + rlen) {
+			struct inotify_event *ie = (struct inotify_event *) ptr;
+			if (spockfs_watch_event(&sw, ie)) goto end;
+			ptr += sizeof(struct inotify_event) + ie->len;
+		}
+		if (sw.ub->pos && uwsgi_response_write_body_do(wsgi_req, sw.ub->buf, sw.ub->pos)) goto end;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "TRUNCATE", 8)) {
-		return spockfs_truncate(wsgi_req, path);
+end:
+	if (sw.fd > -1) close(sw.fd);
+	if (sw.paths) {
+		int i;
+		for(i=0;i<sw.paths_len;i++) {
+			if (sw.paths[i]) free(sw.paths[i]);
+		}
+		free(sw.paths);
 	}
+	if (sw.ub) uwsgi_buffer_destroy(sw.ub);
+	if (buf) free(buf);
+	return UWSGI_OK;
+}
+#endif
 
+static struct spockfs_method spockfs_methods[] = {
+	{"GET", 3, 0, spockfs_get},
+	{"PUT", 3, SPOCKFS_NEEDS_WRITE|SPOCKFS_NEEDS_BODY, spockfs_put},
+	{"GETATTR", 7, 0, spockfs_getattr},
+	{"ACCESS", 6, 0, spockfs_access},
+	{"OPEN", 4, 0, spockfs_open},
+	{"POST", 4, SPOCKFS_NEEDS_WRITE, spockfs_post},
+	{"MKNOD", 5, SPOCKFS_NEEDS_WRITE, spockfs_mknod},
+	{"LINK", 4, SPOCKFS_NEEDS_WRITE, spockfs_link},
+	{"RENAME", 6, SPOCKFS_NEEDS_WRITE, spockfs_rename},
+	{"READDIR", 7, 0, spockfs_readdir},
+	{"READDIRPLUS", 11, 0, spockfs_readdirplus},
+	{"SYMLINK", 7, SPOCKFS_NEEDS_WRITE, spockfs_symlink},
+	{"READLINK", 8, 0, spockfs_readlink},
+	{"DELETE", 6, SPOCKFS_NEEDS_WRITE, spockfs_delete},
+	{"MKDIR", 5, SPOCKFS_NEEDS_WRITE, spockfs_mkdir},
+	{"RMDIR", 5, SPOCKFS_NEEDS_WRITE, spockfs_rmdir},
+	{"CHMOD", 5, SPOCKFS_NEEDS_WRITE, spockfs_chmod},
+	{"CHOWN", 5, SPOCKFS_NEEDS_WRITE, spockfs_chown},
+	{"TRUNCATE", 8, SPOCKFS_NEEDS_WRITE, spockfs_truncate},
 #if !defined(__APPLE__) && !defined(__FreeBSD__)
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "FALLOCATE", 9)) {
-		return spockfs_fallocate(wsgi_req, path);
-	}
+	{"FALLOCATE", 9, SPOCKFS_NEEDS_WRITE, spockfs_fallocate},
+#endif
+	{"STATFS", 6, 0, spockfs_statfs},
+#ifndef __FreeBSD__
+	{"LISTXATTR", 9, 0, spockfs_listxattr},
+	{"GETXATTR", 8, 0, spockfs_getxattr},
+	{"SETXATTR", 8, SPOCKFS_NEEDS_WRITE|SPOCKFS_NEEDS_BODY, spockfs_setxattr},
+	{"REMOVEXATTR", 11, SPOCKFS_NEEDS_WRITE, spockfs_removexattr},
+#endif
+	{"UTIMENS", 7, SPOCKFS_NEEDS_WRITE, spockfs_utimens},
+	// operations are checked one by one
+	{"BATCH", 5, SPOCKFS_NEEDS_BODY, spockfs_batch},
+#ifdef __linux__
+	{"WATCH", 5, 0, spockfs_watch},
 #endif
+	{NULL, 0, 0, NULL},
+};
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "STATFS", 6)) {
-		return spockfs_statfs(wsgi_req, path);
+static void spockfs_methods_init() {
+	struct spockfs_method *sm = spockfs_methods;
+	while(sm->name) {
+		uint32_t slot = spockfs_method_hash(sm->name, sm->len);
+		while(spockfs_methods_index[slot]) {
+			slot = (slot + 1) & (SPOCKFS_METHODS_SLOTS - 1);
+		}
+		spockfs_methods_index[slot] = sm;
+		sm++;
 	}
+}
 
-#ifndef __FreeBSD__
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "LISTXATTR", 9)) {
-		return spockfs_listxattr(wsgi_req, path);
+static int spockfs_request(struct wsgi_request *wsgi_req) {
+
+	char path[PATH_MAX+1];
+
+	if (uwsgi_parse_vars(wsgi_req)) {
+                return -1;
+        }
+
+        if (wsgi_req->path_info_len == 0) {
+                uwsgi_403(wsgi_req);
+                return UWSGI_OK;
+        }
+
+	if (wsgi_req->path_info[0] != '/') {
+                uwsgi_403(wsgi_req);
+                return UWSGI_OK;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "GETXATTR", 8)) {
-		return spockfs_getxattr(wsgi_req, path);
+	wsgi_req->app_id = uwsgi_get_app_id(wsgi_req, wsgi_req->appid, wsgi_req->appid_len, spockfs_plugin.modifier1);
+	if (wsgi_req->app_id == -1 && !uwsgi.no_default_app && uwsgi.default_app > -1) {
+		if (uwsgi_apps[uwsgi.default_app].modifier1 == spockfs_plugin.modifier1) {
+			wsgi_req->app_id = uwsgi.default_app;
+		}
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "SETXATTR", 8)) {
-		return spockfs_setxattr(wsgi_req, path);
+	if (wsgi_req->app_id == -1) {
+		uwsgi_404(wsgi_req);
+		return UWSGI_OK;
 	}
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "REMOVEXATTR", 11)) {
-		return spockfs_removexattr(wsgi_req, path);
+	if (spockfs_build_path(path, wsgi_req, wsgi_req->path_info, wsgi_req->path_info_len)) {
+		uwsgi_404(wsgi_req);
+                return UWSGI_OK;
 	}
-#endif
 
-	if (!uwsgi_strncmp(wsgi_req->method, wsgi_req->method_len, "UTIMENS", 7)) {
-		return spockfs_utimens(wsgi_req, path);
+	struct spockfs_method *sm = spockfs_method_find(wsgi_req->method, wsgi_req->method_len);
+	if (!sm) {
+		uwsgi_405(wsgi_req);
+		return UWSGI_OK;
 	}
 
+	if (sm->flags & SPOCKFS_NEEDS_WRITE) {
+		spockfs_check_readonly(wsgi_req);
+	}
 
-	uwsgi_405(wsgi_req);
+	// a body on a method not using it is a client bug (413 would be mapped to ERANGE)
+	if (wsgi_req->post_cl > 0 && !(sm->flags & SPOCKFS_NEEDS_BODY)) {
+		uwsgi_response_prepare_headers(wsgi_req, "400 Bad Request", 15);
+		uwsgi_response_add_content_length(wsgi_req, 0);
+		return UWSGI_OK;
+	}
 
-	return UWSGI_OK;
+	return sm->func(wsgi_req, path);
 };
 
 static int spockfs_init() {
 	uwsgi.honour_range = 1;
 	if (!spockfs.xattr_limit) spockfs.xattr_limit = 65536;
+	if (!spockfs.batch_limit) spockfs.batch_limit = 1024 * 1024;
+	if (!spockfs.watch_heartbeat) spockfs.watch_heartbeat = 30;
+	if (!spockfs.fd_cache) spockfs.fd_cache = 64;
+	if (!spockfs.fd_cache_ttl) spockfs.fd_cache_ttl = 10;
+	// before the workers are forked
+	spockfs_generation = uwsgi_calloc_shared(sizeof(uint64_t));
+#ifdef O_PATH
+	spockfs_proc_fd = !access("/proc/self/fd", X_OK);
+#endif
+#ifdef SYS_openat2
+	struct open_how how;
+	memset(&how, 0, sizeof(struct open_how));
+	how.flags = O_PATH|O_DIRECTORY|O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH;
+	int fd = syscall(SYS_openat2, AT_FDCWD, ".", &how, sizeof(struct open_how));
+	if (fd >= 0) {
+		close(fd);
+		spockfs_openat2 = 1;
+	}
+#endif
+	spockfs_beneath = spockfs_openat2 && spockfs_proc_fd;
+	spockfs_methods_init();
 	return 0;
 }
 
@@ -1067,6 +2547,19 @@ static void spockfs_mount(struct uwsgi_string_list *usl, long readonly) {
 
 	ua->responder0 = (void *) readonly;
 
+	// objects are resolved relative to it
+#ifdef O_PATH
+	int dfd = open(equal+1, O_PATH|O_DIRECTORY|O_CLOEXEC);
+#else
+	int dfd = open(equal+1, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+#endif
+	if (dfd < 0) {
+		uwsgi_error("[spockfs] open()");
+		uwsgi_log("[spockfs] unable to mount %.*s\n", equal-usl->value, usl->value);
+		exit(1);
+	}
+	ua->responder1 = (void *) (long) dfd;
+
         ua->started_at = now;
         ua->startup_time = uwsgi_now() - now;
         uwsgi_log("SpockFS%sapp/mountpoint %d (%.*s) loaded at %p for directory %.*s\n", readonly ? " readonly " : " ", id, equal-usl->value, usl->value, ua, usl->len - ((equal-usl->value)+1), equal+1);
@@ -1075,6 +2568,9 @@ static void spockfs_mount(struct uwsgi_string_list *usl, long readonly) {
 
 static void spockfs_apps() {
 	struct uwsgi_string_list *usl = NULL;
+	// exposed by the stats server (with --enable-metrics)
+	uwsgi_register_metric("spockfs.fd_cache.hits", NULL, UWSGI_METRIC_COUNTER, NULL, NULL, 0, NULL);
+	uwsgi_register_metric("spockfs.fd_cache.misses", NULL, UWSGI_METRIC_COUNTER, NULL, NULL, 0, NULL);
 	uwsgi_foreach(usl, spockfs.mountpoints) {
 		spockfs_mount(usl, 0);
 	}